@@ -0,0 +1,140 @@
+/*
+ * file:        bench_alloc.c
+ * description: free-block allocation microbenchmark for FSX492
+ *
+ *  usage: ./bench_alloc [nblocks] [nallocs]
+ *
+ * Fills the front of an in-memory block map of nblocks blocks to
+ * 10%, 50% and 95%, then times nallocs allocations with the original
+ * bit-at-a-time scan from block 0, with bitmap_find_zero() from block 0,
+ * with bitmap_find_zero() resuming from the last allocation, and with
+ * a bitmap summary searched from block 0, as get_free_run() does when
+ * its hint wraps around.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+/**
+ * Current monotonic time in seconds.
+ */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Original allocator: test every bit from block 0.
+ */
+static int linear_alloc(void *map, int nbits)
+{
+	for (int i = 0; i < nbits; i++) {
+		if (!bitmap_test(map, i)) {
+			bitmap_set(map, i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** block after the last one allocated */
+static int hint;
+
+/**
+ * New allocator: word-at-a-time search from a rotating hint.
+ */
+static int word_alloc(void *map, int nbits)
+{
+	int i = bitmap_find_zero(map, nbits, hint);
+	if (i >= 0) {
+		bitmap_set(map, i);
+		hint = i + 1;
+	}
+	return i;
+}
+
+/**
+ * Word-at-a-time search from block 0, to separate the effect
+ * of the word scan from that of the hint.
+ */
+static int word_alloc_nohint(void *map, int nbits)
+{
+	hint = 0;
+	return word_alloc(map, nbits);
+}
+
+/** summary of the map, rebuilt after each fill */
+static struct bitmap_summary *sum;
+
+/**
+ * Summary search from block 0.
+ */
+static int summary_alloc(void *map, int nbits)
+{
+	int i = bitmap_summary_find_zero(sum, 0);
+	if (i >= 0) {
+		bitmap_set(map, i);
+		bitmap_summary_update(sum, i);
+	}
+	return i;
+}
+
+/**
+ * Fill the first pct percent of the map and clear the rest.
+ */
+static void fill(void *map, int nbits, int pct)
+{
+	int nused = (int) ((long) nbits * pct / 100);
+	memset(map, 0, (nbits + 63) / 64 * 8);
+	for (int i = 0; i < nused; i++) {
+		bitmap_set(map, i);
+	}
+	bitmap_summary_free(sum);
+	sum = bitmap_summary_create(map, nbits);
+}
+
+/**
+ * Time nallocs allocations with an allocator.
+ *
+ * @return nanoseconds per allocation
+ */
+static double run(int (*alloc)(void*, int), void *map, int nbits, int pct, int nallocs)
+{
+	fill(map, nbits, pct);
+	hint = 0;
+	double start = now();
+	for (int i = 0; i < nallocs; i++) {
+		if (alloc(map, nbits) < 0) {
+			fprintf(stderr, "map full after %d allocations\n", i);
+			break;
+		}
+	}
+	return (now() - start) * 1e9 / nallocs;
+}
+
+int main(int argc, char **argv)
+{
+	int nblocks = (argc > 1) ? atoi(argv[1]) : 1 << 20;
+	int nallocs = (argc > 2) ? atoi(argv[2]) : 2000;
+	void *map = malloc((nblocks + 63) / 64 * 8);
+	int pcts[] = {10, 50, 95};
+
+	printf("%d blocks, %d allocations\n", nblocks, nallocs);
+	printf("fill   linear ns/alloc   word ns/alloc   word+hint ns/alloc   summary ns/alloc\n");
+	for (int i = 0; i < 3; i++) {
+		double linear = run(linear_alloc, map, nblocks, pcts[i], nallocs);
+		double word = run(word_alloc_nohint, map, nblocks, pcts[i], nallocs);
+		double hinted = run(word_alloc, map, nblocks, pcts[i], nallocs);
+		double summary = run(summary_alloc, map, nblocks, pcts[i], nallocs);
+		printf("%3d%%   %17.1f   %13.1f   %18.1f   %16.1f\n", pcts[i], linear, word, hinted, summary);
+	}
+	bitmap_summary_free(sum);
+	free(map);
+	return 0;
+}
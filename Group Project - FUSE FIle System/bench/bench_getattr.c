@@ -0,0 +1,69 @@
+/*
+ * file:        bench_getattr.c
+ * description: getattr throughput benchmark for FSX492
+ *
+ *  usage: ./bench_getattr <image.img> [iterations] [path ...]
+ *
+ * Runs fs_ops.getattr over the given paths (or a default set
+ * of paths from test/fsx492.img) and reports calls per second.
+ * Use a scratch copy of the image.
+ */
+
+#define FUSE_USE_VERSION 27
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fuse.h>
+
+#include "image.h"
+
+extern struct fuse_operations fs_ops;
+
+/**  disk block device - normally defined in main.c */
+struct blkdev *disk;
+
+/** default paths present in test/fsx492.img */
+static char *default_paths[] = {
+	"/", "/dir1", "/dir1/test.1", "/dir1/pathtest1", "/test.random", "/nonexistent"
+};
+
+/**
+ * Current monotonic time in seconds.
+ */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <image.img> [iterations] [path ...]\n", argv[0]);
+		exit(1);
+	}
+	if ((disk = image_create(argv[1])) == NULL) {
+		fprintf(stderr, "cannot open image file '%s'\n", argv[1]);
+		exit(1);
+	}
+	long iters = (argc > 2) ? atol(argv[2]) : 100000;
+	char **paths = (argc > 3) ? &argv[3] : default_paths;
+	int npaths = (argc > 3) ? argc - 3 : sizeof(default_paths) / sizeof(default_paths[0]);
+
+	fs_ops.init(NULL);
+
+	struct stat sb;
+	double start = now();
+	for (long i = 0; i < iters; i++) {
+		fs_ops.getattr(paths[i % npaths], &sb);
+	}
+	double secs = now() - start;
+
+	printf("getattr: %ld calls in %.3f s, %.0f calls/s, %.2f us/call\n",
+			iters, secs, iters / secs, secs * 1e6 / iters);
+	return 0;
+}
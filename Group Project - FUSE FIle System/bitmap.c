@@ -0,0 +1,472 @@
+/*
+ * file:        bitmap.c
+ * description: word-at-a-time operations on FSX492 bitmaps
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+/** words of the map summarized by a leaf of a summary */
+enum { GROUP_WORDS = 64, GROUP_BITS = GROUP_WORDS * 64 };
+
+/** the clear bits in part of a map, as kept in a summary node */
+struct run_info {
+	int free; /* number of clear bits */
+	int prefix; /* clear bits at the start */
+	int suffix; /* clear bits at the end */
+	int maxrun; /* longest run of clear bits */
+};
+
+struct bitmap_summary {
+	const uint64_t *map; /* the summarized map */
+	int nbits; /* number of bits in the map */
+	int ngroups; /* number of groups of GROUP_WORDS words */
+	int nleaves; /* leaves in the tree, a power of two >= ngroups */
+	struct run_info *node; /* node i has children 2i and 2i+1; leaf g is node nleaves+g */
+	unsigned char *stale; /* flags for groups changed since their leaf was computed */
+	int *stale_list; /* the changed groups */
+	int nstale; /* number of changed groups */
+};
+
+/**
+ * Find the first clear bit in [start, end) of a bitmap.
+ *
+ * @param map: the bitmap
+ * @param start: first bit number to look at
+ * @param end: bit number to stop at
+ * @return: the bit number, or -1 if all bits in the range are set
+ */
+static int find_zero_range(const uint64_t *map, int start, int end)
+{
+	if (start >= end) {
+		return -1;
+	}
+	int w = start / 64;
+	int last = (end - 1) / 64;
+
+	// ignore bits before start in the first word
+	uint64_t free = ~map[w] & (~(uint64_t) 0 << (start % 64));
+	while (free == 0) {
+		if (++w > last) {
+			return -1;
+		}
+		free = ~map[w];
+	}
+	int i = w * 64 + __builtin_ctzll(free);
+	return (i < end) ? i : -1;
+}
+
+/**
+ * Find the first set bit in [start, end) of a bitmap.
+ *
+ * @param map: the bitmap
+ * @param start: first bit number to look at
+ * @param end: bit number to stop at
+ * @return: the bit number, or end if all bits in the range are clear
+ */
+static int find_one_range(const uint64_t *map, int start, int end)
+{
+	if (start >= end) {
+		return end;
+	}
+	int w = start / 64;
+	int last = (end - 1) / 64;
+
+	uint64_t used = map[w] & (~(uint64_t) 0 << (start % 64));
+	while (used == 0) {
+		if (++w > last) {
+			return end;
+		}
+		used = map[w];
+	}
+	int i = w * 64 + __builtin_ctzll(used);
+	return (i < end) ? i : end;
+}
+
+/**
+ * Find the first run of n clear bits in [start, end) of a bitmap,
+ * counting the carry clear bits just before start as part of it.
+ *
+ * @param map: the bitmap
+ * @param start: first bit number to look at
+ * @param end: bit number to stop at
+ * @param n: length of the run
+ * @param carry: clear bits before start, updated to those before end
+ * @return: the first bit number of the run, or -1 if there is none
+ */
+static int find_run_range(const uint64_t *map, int start, int end, int n, int *carry)
+{
+	for (int i = start; i < end; ) {
+		int z = find_zero_range(map, i, end);
+		if (z < 0) {
+			*carry = 0;
+			return -1;
+		}
+		if (z > i) {
+			*carry = 0;
+		}
+		int e = find_one_range(map, z, end);
+		if (*carry + e - z >= n) {
+			return z - *carry;
+		}
+		*carry = (e < end) ? 0 : *carry + e - z;
+		i = e;
+	}
+	return -1;
+}
+
+/**
+ * Count the clear bits in a bitmap.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @return: the number of clear bits
+ */
+int bitmap_count_zero(const void *map, int nbits)
+{
+	const uint64_t *words = map;
+	int nset = 0;
+	for (int w = 0; w < nbits / 64; w++) {
+		nset += __builtin_popcountll(words[w]);
+	}
+	if (nbits % 64 != 0) {
+		uint64_t mask = ((uint64_t) 1 << (nbits % 64)) - 1;
+		nset += __builtin_popcountll(words[nbits / 64] & mask);
+	}
+	return nbits - nset;
+}
+
+/**
+ * Find the first run of n clear bits at or after start.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @param start: bit number to start searching from
+ * @param n: length of the run
+ * @return: the first bit number of the run, or -1 if there is none
+ */
+int bitmap_find_zero_run(const void *map, int nbits, int start, int n)
+{
+	int i = find_zero_range(map, start, nbits);
+	while (i >= 0) {
+		int j = i + 1;
+		while (j < nbits && j - i < n && !bitmap_test(map, j)) {
+			j++;
+		}
+		if (j - i == n) {
+			return i;
+		}
+		i = find_zero_range(map, j, nbits);
+	}
+	return -1;
+}
+
+/**
+ * Find the first clear bit at or after start, wrapping around to
+ * the beginning of the map if there is none before the end.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @param start: bit number to start searching from
+ * @return: the bit number, or -1 if all bits are set
+ */
+int bitmap_find_zero(const void *map, int nbits, int start)
+{
+	if (start < 0 || start >= nbits) {
+		start = 0;
+	}
+	int i = find_zero_range(map, start, nbits);
+	if (i < 0) {
+		i = find_zero_range(map, 0, start);
+	}
+	return i;
+}
+
+/**
+ * Length of the longest run of set bits in a word.
+ */
+static int longest_ones(uint64_t x)
+{
+	int n = 0;
+	while (x != 0) {
+		x &= x >> 1;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Compute the leaf of a summary for a group of words of the map.
+ * Bits past the end of the map count as set.
+ *
+ * @param sum: the summary
+ * @param g: the group number
+ * @param ri: the leaf to fill in
+ */
+static void group_info(const struct bitmap_summary *sum, int g, struct run_info *ri)
+{
+	int nwords = (sum->nbits + 63) / 64;
+	int first = g * GROUP_WORDS;
+	int last = (first + GROUP_WORDS < nwords) ? first + GROUP_WORDS : nwords;
+	int run = 0;
+	int set_seen = 0;
+
+	*ri = (struct run_info) { 0 };
+	for (int k = first; k < last; k++) {
+		uint64_t clear = ~sum->map[k];
+		if (sum->nbits - k * 64 < 64) {
+			clear &= ((uint64_t) 1 << (sum->nbits - k * 64)) - 1;
+		}
+		ri->free += __builtin_popcountll(clear);
+		if (clear == ~(uint64_t) 0) {
+			run += 64;
+			continue;
+		}
+		// the run so far ends at the first set bit of the word
+		run += __builtin_ctzll(~clear);
+		if (!set_seen) {
+			ri->prefix = run;
+			set_seen = 1;
+		}
+		if (run > ri->maxrun) ri->maxrun = run;
+		int inner = longest_ones(clear);
+		if (inner > ri->maxrun) ri->maxrun = inner;
+		run = __builtin_clzll(~clear);
+	}
+	if (!set_seen) ri->prefix = run;
+	if (run > ri->maxrun) ri->maxrun = run;
+	ri->suffix = run;
+}
+
+/**
+ * Compute a node of a summary from its two children.
+ *
+ * @param p: the node
+ * @param l: its left child
+ * @param r: its right child
+ * @param half: number of bits below each child
+ */
+static void combine(struct run_info *p, const struct run_info *l, const struct run_info *r,
+		int half)
+{
+	p->free = l->free + r->free;
+	p->prefix = (l->prefix == half) ? half + r->prefix : l->prefix;
+	p->suffix = (r->suffix == half) ? half + l->suffix : r->suffix;
+	p->maxrun = (l->maxrun > r->maxrun) ? l->maxrun : r->maxrun;
+	if (l->suffix + r->prefix > p->maxrun) p->maxrun = l->suffix + r->prefix;
+}
+
+/**
+ * Bring the leaves of the changed groups of a summary, and the nodes
+ * above them, up to date.
+ *
+ * @param sum: the summary
+ */
+static void refresh(struct bitmap_summary *sum)
+{
+	for (int s = 0; s < sum->nstale; s++) {
+		int g = sum->stale_list[s];
+		sum->stale[g] = 0;
+		int i = sum->nleaves + g;
+		group_info(sum, g, &sum->node[i]);
+		for (int half = GROUP_BITS; i > 1; half *= 2) {
+			i /= 2;
+			combine(&sum->node[i], &sum->node[2 * i], &sum->node[2 * i + 1], half);
+		}
+	}
+	sum->nstale = 0;
+}
+
+/**
+ * Build the summary of a bitmap. The map must stay in place for as
+ * long as the summary is used.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @return: the summary, or NULL if out of memory
+ */
+struct bitmap_summary *bitmap_summary_create(const void *map, int nbits)
+{
+	struct bitmap_summary *sum = calloc(1, sizeof(struct bitmap_summary));
+	if (sum == NULL) {
+		return NULL;
+	}
+	sum->map = map;
+	sum->nbits = nbits;
+	sum->ngroups = (nbits + GROUP_BITS - 1) / GROUP_BITS;
+	sum->nleaves = 1;
+	while (sum->nleaves < sum->ngroups) {
+		sum->nleaves *= 2;
+	}
+	sum->node = calloc(2 * sum->nleaves, sizeof(struct run_info));
+	sum->stale = calloc(sum->ngroups + 1, 1);
+	sum->stale_list = calloc(sum->ngroups + 1, sizeof(int));
+	if (sum->node == NULL || sum->stale == NULL || sum->stale_list == NULL) {
+		bitmap_summary_free(sum);
+		return NULL;
+	}
+
+	// leaves past the end of the map stay all set
+	for (int g = 0; g < sum->ngroups; g++) {
+		group_info(sum, g, &sum->node[sum->nleaves + g]);
+	}
+	for (int width = sum->nleaves / 2, half = GROUP_BITS; width >= 1; width /= 2, half *= 2) {
+		for (int i = width; i < 2 * width; i++) {
+			combine(&sum->node[i], &sum->node[2 * i], &sum->node[2 * i + 1], half);
+		}
+	}
+	return sum;
+}
+
+/**
+ * Free the summary of a bitmap.
+ *
+ * @param sum: the summary, or NULL
+ */
+void bitmap_summary_free(struct bitmap_summary *sum)
+{
+	if (sum == NULL) {
+		return;
+	}
+	free(sum->node);
+	free(sum->stale);
+	free(sum->stale_list);
+	free(sum);
+}
+
+/**
+ * Note that a bit of the map has been set or cleared. The summary
+ * is brought up to date at the next search.
+ *
+ * @param sum: the summary
+ * @param i: the bit number
+ */
+void bitmap_summary_update(struct bitmap_summary *sum, int i)
+{
+	int g = i / GROUP_BITS;
+	if (!sum->stale[g]) {
+		sum->stale[g] = 1;
+		sum->stale_list[sum->nstale++] = g;
+	}
+}
+
+/**
+ * Count the clear bits in a summarized bitmap.
+ *
+ * @param sum: the summary
+ * @return: the number of clear bits
+ */
+int bitmap_summary_count_zero(struct bitmap_summary *sum)
+{
+	refresh(sum);
+	return sum->node[1].free;
+}
+
+/**
+ * Find the first clear bit at or after start below a summary node.
+ *
+ * @param sum: the summary
+ * @param i: the node
+ * @param lo: first bit number below the node
+ * @param len: number of bits below the node
+ * @param start: bit number to start searching from
+ * @return: the bit number, or -1 if there is none
+ */
+static int node_find_zero(const struct bitmap_summary *sum, int i, int lo, int len, int start)
+{
+	if (sum->node[i].free == 0 || lo + len <= start) {
+		return -1;
+	}
+	if (i >= sum->nleaves) {
+		int end = (lo + len < sum->nbits) ? lo + len : sum->nbits;
+		return find_zero_range(sum->map, (start > lo) ? start : lo, end);
+	}
+	int r = node_find_zero(sum, 2 * i, lo, len / 2, start);
+	return (r >= 0) ? r : node_find_zero(sum, 2 * i + 1, lo + len / 2, len / 2, start);
+}
+
+/**
+ * Find the clear bit nearest after a goal in a summarized bitmap:
+ * the first clear bit at or after goal, wrapping around to the
+ * beginning of the map if there is none before the end.
+ *
+ * @param sum: the summary
+ * @param goal: bit number to start searching from
+ * @return: the bit number, or -1 if all bits are set
+ */
+int bitmap_summary_find_zero(struct bitmap_summary *sum, int goal)
+{
+	refresh(sum);
+	if (goal < 0 || goal >= sum->nbits) {
+		goal = 0;
+	}
+	int len = sum->nleaves * GROUP_BITS;
+	int i = node_find_zero(sum, 1, 0, len, goal);
+	if (i < 0 && goal > 0) {
+		i = node_find_zero(sum, 1, 0, len, 0);
+	}
+	return i;
+}
+
+/**
+ * Find the first run of n clear bits at or after start below a
+ * summary node. Whole nodes are skipped when the run cannot be in
+ * them, only carrying their clear bits at the end over to the next.
+ *
+ * @param sum: the summary
+ * @param i: the node
+ * @param lo: first bit number below the node
+ * @param len: number of bits below the node
+ * @param start: bit number to start searching from
+ * @param n: length of the run
+ * @param carry: clear bits at or after start just before the node,
+ *   updated to those just after it
+ * @return: the first bit number of the run, or -1 if there is none
+ */
+static int node_find_run(const struct bitmap_summary *sum, int i, int lo, int len,
+		int start, int n, int *carry)
+{
+	if (lo + len <= start) {
+		return -1;
+	}
+	const struct run_info *ri = &sum->node[i];
+	if (lo >= start) {
+		if (*carry + ri->prefix >= n) {
+			return lo - *carry;
+		}
+		if (ri->maxrun < n) {
+			*carry = (ri->free == len) ? *carry + len : ri->suffix;
+			return -1;
+		}
+	}
+	if (i >= sum->nleaves) {
+		int end = (lo + len < sum->nbits) ? lo + len : sum->nbits;
+		return find_run_range(sum->map, (start > lo) ? start : lo, end, n, carry);
+	}
+	int r = node_find_run(sum, 2 * i, lo, len / 2, start, n, carry);
+	return (r >= 0) ? r : node_find_run(sum, 2 * i + 1, lo + len / 2, len / 2, start, n, carry);
+}
+
+/**
+ * Find the first run of n clear bits at or after start in a
+ * summarized bitmap.
+ *
+ * @param sum: the summary
+ * @param start: bit number to start searching from
+ * @param n: length of the run
+ * @return: the first bit number of the run, or -1 if there is none
+ */
+int bitmap_summary_find_zero_run(struct bitmap_summary *sum, int start, int n)
+{
+	refresh(sum);
+	if (start < 0) {
+		start = 0;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+	int carry = 0;
+	return node_find_run(sum, 1, 0, sum->nleaves * GROUP_BITS, start, n, &carry);
+}
@@ -0,0 +1,148 @@
+/*
+ * file:        bitmap.h
+ * description: word-at-a-time operations on FSX492 bitmaps
+ *
+ * The inode and block maps are arrays of bits, bit i of the map being
+ * bit (i % 8) of byte (i / 8). On a little-endian machine this is the
+ * same as bit (i % 64) of 64-bit word (i / 64), which lets searches
+ * look at 64 bits at a time.
+ *
+ * For large maps a summary can be kept alongside a map: a tree over
+ * groups of 64 words, each node holding the number of clear bits
+ * below it and the longest run of clear bits in it, at its start and
+ * at its end. Searches for a clear bit or a run of clear bits then
+ * take time logarithmic in the size of the map. The summary is only
+ * kept in memory; the map itself is unchanged.
+ */
+
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Test a bit in a bitmap.
+ *
+ * @param map: the bitmap
+ * @param i: the bit number
+ * @return: true if bit is set
+ */
+static inline bool bitmap_test(const void *map, int i)
+{
+	return (((const uint64_t*)map)[i / 64] >> (i % 64)) & 1;
+}
+
+/**
+ * Set a bit in a bitmap.
+ *
+ * @param map: the bitmap
+ * @param i: the bit number
+ */
+static inline void bitmap_set(void *map, int i)
+{
+	((uint64_t*)map)[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+/**
+ * Clear a bit in a bitmap.
+ *
+ * @param map: the bitmap
+ * @param i: the bit number
+ */
+static inline void bitmap_clear(void *map, int i)
+{
+	((uint64_t*)map)[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
+
+/**
+ * Count the clear bits in a bitmap.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @return: the number of clear bits
+ */
+extern int bitmap_count_zero(const void *map, int nbits);
+
+/**
+ * Find the first run of n clear bits at or after start.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @param start: bit number to start searching from
+ * @param n: length of the run
+ * @return: the first bit number of the run, or -1 if there is none
+ */
+extern int bitmap_find_zero_run(const void *map, int nbits, int start, int n);
+
+/**
+ * Find the first clear bit at or after start, wrapping around to
+ * the beginning of the map if there is none before the end.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @param start: bit number to start searching from
+ * @return: the bit number, or -1 if all bits are set
+ */
+extern int bitmap_find_zero(const void *map, int nbits, int start);
+
+/** summary of a bitmap, for searching it in logarithmic time */
+struct bitmap_summary;
+
+/**
+ * Build the summary of a bitmap. The map must stay in place for as
+ * long as the summary is used.
+ *
+ * @param map: the bitmap
+ * @param nbits: number of bits in the map
+ * @return: the summary, or NULL if out of memory
+ */
+extern struct bitmap_summary *bitmap_summary_create(const void *map, int nbits);
+
+/**
+ * Free the summary of a bitmap.
+ *
+ * @param sum: the summary, or NULL
+ */
+extern void bitmap_summary_free(struct bitmap_summary *sum);
+
+/**
+ * Note that a bit of the map has been set or cleared. The summary
+ * is brought up to date at the next search.
+ *
+ * @param sum: the summary
+ * @param i: the bit number
+ */
+extern void bitmap_summary_update(struct bitmap_summary *sum, int i);
+
+/**
+ * Count the clear bits in a summarized bitmap.
+ *
+ * @param sum: the summary
+ * @return: the number of clear bits
+ */
+extern int bitmap_summary_count_zero(struct bitmap_summary *sum);
+
+/**
+ * Find the clear bit nearest after a goal in a summarized bitmap:
+ * the first clear bit at or after goal, wrapping around to the
+ * beginning of the map if there is none before the end.
+ *
+ * @param sum: the summary
+ * @param goal: bit number to start searching from
+ * @return: the bit number, or -1 if all bits are set
+ */
+extern int bitmap_summary_find_zero(struct bitmap_summary *sum, int goal);
+
+/**
+ * Find the first run of n clear bits at or after start in a
+ * summarized bitmap.
+ *
+ * @param sum: the summary
+ * @param start: bit number to start searching from
+ * @param n: length of the run
+ * @return: the first bit number of the run, or -1 if there is none
+ */
+extern int bitmap_summary_find_zero_run(struct bitmap_summary *sum, int start, int n);
+
+#endif /* BITMAP_H_ */
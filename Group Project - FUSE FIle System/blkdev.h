@@ -9,7 +9,10 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
-/**  block device block size */
+#include <stdint.h>
+#include <sys/types.h>
+
+/**  block device block size, until changed with set_block_size */
 enum { BLOCK_SIZE = 1024};
 
 /** block device operation status */
@@ -21,13 +24,23 @@ struct blkdev {
 	void *private; /* block device private state */
 };
 
-/** Operations on a block device */
+/** Operations on a block device; block numbers are 64 bits so that
+ * devices are not limited to 2^31 blocks */
 struct blkdev_ops {
-	int  (*num_blocks)(struct blkdev *dev);
-	int  (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-	int  (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-	int  (*flush)(struct blkdev *dev, int first_blk, int num_blks);
+	int64_t (*num_blocks)(struct blkdev *dev);
+	int  (*read)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+	int  (*write)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+	int  (*flush)(struct blkdev *dev, int64_t first_blk, int64_t num_blks);
 	void (*close)(struct blkdev *dev);
+	/* optional: find where a run of blocks lies in an open file, so
+	 * it can be read or written without copying through a buffer;
+	 * E_UNAVAIL if it cannot be accessed that way */
+	int  (*map)(struct blkdev *dev, int64_t first_blk, int num_blks, int writing,
+			int *fd, off_t *pos);
+	/* optional: address the device in blocks of another size, a
+	 * power of two no smaller than BLOCK_SIZE; E_SIZE if the size
+	 * cannot be used */
+	int  (*set_block_size)(struct blkdev *dev, int size);
 };
 
 #endif
@@ -0,0 +1,699 @@
+/*
+ * file:        cache.c
+ * description: LRU block buffer cache layered over a block device
+ *
+ * The cache is itself a block device, so it can sit between fs.c and
+ * the image device without fs.c knowing it is there. Blocks are kept
+ * in a fixed pool of buffers that is allocated once; lookup is through
+ * a hash table on block number and replacement takes the least
+ * recently used buffer.
+ *
+ * Blocks can also be read ahead of need with cache_prefetch. Such a
+ * block is flagged until it is first read, so the cache can count
+ * the prefetched blocks that were used and those evicted unused.
+ *
+ * Writes go straight through to the underlying device unless the
+ * cache is switched to write-back mode. Then written blocks are only
+ * marked dirty, and a flusher thread writes them back once they are
+ * old enough or too many blocks are dirty. A flush of the device, or
+ * reuse of a dirty buffer, writes dirty blocks back immediately.
+ * Dirty blocks are always written back in block order, one write
+ * per run of adjacent blocks.
+ *
+ * A run of blocks can also be mapped to where it lies in the
+ * underlying device's file, so data can be moved to or from it
+ * without passing through the cache: dirty blocks in the run are
+ * written back first, and blocks about to be written are dropped.
+ *
+ * Several threads may use the cache at once. A mutex protects it,
+ * but is dropped while missing blocks are read from the underlying
+ * device, so one thread waiting on the device does not hold up
+ * others whose blocks are cached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "cache.h"
+#include "lockstat.h"
+
+/** a cached block */
+struct cache_buf {
+	int64_t blkno; /* block number, or -1 if buffer unused */
+	struct cache_buf *hnext; /* next buffer in hash chain */
+	struct cache_buf *prev, *next; /* LRU list, most recent first */
+	bool prefetched; /* read ahead and not yet used */
+	bool dirty; /* written but not yet written back */
+	time_t dirtied; /* when the block became dirty */
+	char *data; /* block contents */
+};
+
+/** definition of caching block device */
+struct cache_dev {
+	struct blkdev *dev; /* underlying block device */
+	int blksz; /* size of blocks in bytes */
+	int nbufs; /* number of buffers */
+	struct cache_buf *bufs; /* buffer headers */
+	char *data; /* buffer contents, nbufs blocks */
+	struct cache_buf **hash; /* hash chains */
+	int hash_mask; /* number of hash chains - 1 */
+	struct cache_buf lru; /* LRU list head */
+	long hits, misses; /* statistics */
+	long prefetched, ra_hits, ra_wasted; /* readahead statistics */
+	pthread_mutex_t lock; /* protects the cache; not held while reading the device */
+	unsigned long wgen; /* count of writes, to detect writes during unlocked reads */
+	bool writeback; /* whether writes are held in the cache */
+	int max_age; /* seconds a block may stay dirty */
+	int dirty_max; /* dirty blocks that start a write-back regardless of age */
+	int ndirty; /* number of dirty blocks */
+	long written_back; /* blocks written back */
+	struct cache_buf **wb_list; /* buffers being written back, nbufs entries */
+	char *wb_data; /* contents of a run being written back, WB_MAX_RUN blocks */
+	pthread_t flusher; /* the flusher thread */
+	bool flusher_running; /* whether the flusher thread has been started */
+	bool stopping; /* tells the flusher thread to exit */
+	pthread_cond_t wake; /* wakes the flusher thread */
+};
+
+/** contention statistics of the cache locks */
+static struct lock_stats cache_lock_stats = { .name = "cache" };
+
+/** largest run of blocks written back with one write */
+enum { WB_MAX_RUN = 64 };
+
+/** seconds between checks by the flusher thread */
+enum { WB_INTERVAL = 1 };
+
+/**
+ * Find a block in the cache.
+ *
+ * @param cd: the cache
+ * @param blkno: the block number
+ * @return: the buffer holding the block, or NULL if not cached
+ */
+static struct cache_buf *cache_lookup(struct cache_dev *cd, int64_t blkno)
+{
+	struct cache_buf *b = cd->hash[blkno & cd->hash_mask];
+	while (b != NULL && b->blkno != blkno) {
+		b = b->hnext;
+	}
+	return b;
+}
+
+/**
+ * Remove a buffer from the LRU list.
+ */
+static void lru_unlink(struct cache_buf *b)
+{
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+/**
+ * Make a buffer the most recently used one.
+ */
+static void lru_touch(struct cache_dev *cd, struct cache_buf *b)
+{
+	lru_unlink(b);
+	b->next = cd->lru.next;
+	b->prev = &cd->lru;
+	cd->lru.next->prev = b;
+	cd->lru.next = b;
+}
+
+/**
+ * Remove a buffer from its hash chain.
+ */
+static void hash_unlink(struct cache_dev *cd, struct cache_buf *b)
+{
+	struct cache_buf **pp = &cd->hash[b->blkno & cd->hash_mask];
+	while (*pp != b) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = b->hnext;
+}
+
+/**
+ * Forget a cached block, making its buffer the next one reused.
+ */
+static void cache_drop(struct cache_dev *cd, struct cache_buf *b)
+{
+	hash_unlink(cd, b);
+	b->blkno = -1;
+	b->prefetched = false;
+	lru_unlink(b);
+	b->next = &cd->lru;
+	b->prev = cd->lru.prev;
+	cd->lru.prev->next = b;
+	cd->lru.prev = b;
+}
+
+/**
+ * Compare buffers by block number.
+ */
+static int cmp_blkno(const void *a, const void *b)
+{
+	int64_t x = (*(struct cache_buf* const*) a)->blkno;
+	int64_t y = (*(struct cache_buf* const*) b)->blkno;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Write back dirty blocks in a range that became dirty no later
+ * than a given time, in block order with one write per run of
+ * adjacent blocks. The cache must be locked.
+ *
+ * @param cd: the cache
+ * @param first_blk: first block of the range
+ * @param nblks: number of blocks in the range
+ * @param dirtied: only write back blocks dirty since this time or before
+ * @return: SUCCESS, or error from underlying device
+ */
+static int cache_writeback(struct cache_dev *cd, int64_t first_blk, int64_t nblks, time_t dirtied)
+{
+	int n = 0;
+	for (int i = 0; i < cd->nbufs && n < cd->ndirty; i++) {
+		struct cache_buf *b = &cd->bufs[i];
+		if (b->dirty && b->dirtied <= dirtied &&
+				b->blkno >= first_blk && b->blkno - first_blk < nblks) {
+			cd->wb_list[n++] = b;
+		}
+	}
+	qsort(cd->wb_list, n, sizeof(struct cache_buf*), cmp_blkno);
+
+	int run;
+	for (int i = 0; i < n; i += run) {
+		run = 1;
+		memcpy(cd->wb_data, cd->wb_list[i]->data, cd->blksz);
+		while (i + run < n && run < WB_MAX_RUN &&
+				cd->wb_list[i + run]->blkno == cd->wb_list[i]->blkno + run) {
+			memcpy(cd->wb_data + (size_t) run * cd->blksz, cd->wb_list[i + run]->data, cd->blksz);
+			run++;
+		}
+		int result = cd->dev->ops->write(cd->dev, cd->wb_list[i]->blkno, run, cd->wb_data);
+		if (result < 0) {
+			return result;
+		}
+		for (int j = i; j < i + run; j++) {
+			cd->wb_list[j]->dirty = false;
+		}
+		cd->ndirty -= run;
+		cd->written_back += run;
+	}
+	return SUCCESS;
+}
+
+/**
+ * The flusher thread: every WB_INTERVAL seconds, or when woken
+ * because too many blocks are dirty, write back the blocks that
+ * have been dirty for max_age seconds, or all of them if too many
+ * are dirty.
+ *
+ * @param arg: the cache
+ * @return: NULL
+ */
+static void *cache_flusher(void *arg)
+{
+	struct cache_dev *cd = arg;
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	while (!cd->stopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += WB_INTERVAL;
+		pthread_cond_timedwait(&cd->wake, &cd->lock, &until);
+		if (cd->ndirty == 0) {
+			continue;
+		}
+		time_t dirtied = (cd->ndirty > cd->dirty_max) ? time(NULL) : time(NULL) - cd->max_age;
+		if (cache_writeback(cd, 0, cd->dev->ops->num_blocks(cd->dev), dirtied) < 0) {
+			fprintf(stderr, "cache: write-back failed\n");
+		}
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return NULL;
+}
+
+/**
+ * Put a copy of a block into the cache, reusing the least
+ * recently used buffer if the block is not already cached.
+ *
+ * @param cd: the cache
+ * @param blkno: the block number
+ * @param buf: the block contents
+ * @return: the buffer now holding the block, or NULL if a dirty
+ *   buffer could not be written back for reuse
+ */
+static struct cache_buf *cache_insert(struct cache_dev *cd, int64_t blkno, const void *buf)
+{
+	struct cache_buf *b = cache_lookup(cd, blkno);
+	if (b == NULL) {
+		b = cd->lru.prev;
+		if (b->dirty && cache_writeback(cd, b->blkno, 1, b->dirtied) < 0) {
+			return NULL;
+		}
+		if (b->blkno != -1) {
+			hash_unlink(cd, b);
+		}
+		if (b->prefetched) {
+			cd->ra_wasted++;
+		}
+		b->blkno = blkno;
+		b->hnext = cd->hash[blkno & cd->hash_mask];
+		cd->hash[blkno & cd->hash_mask] = b;
+	}
+	b->prefetched = false;
+	memcpy(b->data, buf, cd->blksz);
+	lru_touch(cd, b);
+	return b;
+}
+
+/**
+ * To count the number of blocks on the device
+ * @param dev: the block device
+ * @return: the number of blocks in the underlying device
+ */
+static int64_t cache_num_blocks(struct blkdev *dev)
+{
+	struct cache_dev *cd = dev->private;
+	return cd->dev->ops->num_blocks(cd->dev);
+}
+
+/**
+ * Read a run of blocks that are not cached from the underlying
+ * device and cache them. The cache is unlocked during the device
+ * read so that other threads can use it; if any block was written
+ * meanwhile, the blocks read may be stale and are not cached.
+ *
+ * @param cd: the cache, locked
+ * @param first_blk: first block of the run
+ * @param nblks: number of blocks in the run
+ * @param buf: buffer for the blocks
+ * @param prefetched: whether the blocks are being read ahead
+ * @return: SUCCESS, or error from underlying device
+ */
+static int cache_fill(struct cache_dev *cd, int64_t first_blk, int nblks, char *buf, bool prefetched)
+{
+	unsigned long wgen = cd->wgen;
+	pthread_mutex_unlock(&cd->lock);
+	int result = cd->dev->ops->read(cd->dev, first_blk, nblks, buf);
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	if (result < 0 || cd->wgen != wgen) {
+		return result;
+	}
+	for (int i = 0; i < nblks; i++) {
+		struct cache_buf *b = cache_insert(cd, first_blk + i, buf + (size_t) i * cd->blksz);
+		if (b == NULL) {
+			return E_UNAVAIL;
+		}
+		b->prefetched = prefetched;
+	}
+	return SUCCESS;
+}
+
+/**
+ * To read blocks from the cache, reading any blocks that are not
+ * cached from the underlying device. Each run of consecutive
+ * missing blocks is read with a single device read.
+ *
+ * @param dev: the block device
+ * @param first_blk: index of the block to start reading from
+ * @param nblks: number of blocks to read from the device
+ * @param buf: buffer to store the data
+ * @return: SUCCESS if successful, or error from underlying device
+ */
+static int cache_read(struct blkdev *dev, int64_t first_blk, int nblks, void *buf)
+{
+	struct cache_dev *cd = dev->private;
+	char *cbuf = buf;
+	int result = SUCCESS;
+
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	for (int i = 0; i < nblks; ) {
+		struct cache_buf *b = cache_lookup(cd, first_blk + i);
+		if (b != NULL) {
+			memcpy(cbuf + (size_t) i * cd->blksz, b->data, cd->blksz);
+			lru_touch(cd, b);
+			cd->hits++;
+			if (b->prefetched) {
+				b->prefetched = false;
+				cd->ra_hits++;
+			}
+			i++;
+			continue;
+		}
+
+		// read the whole run of missing blocks at once
+		int n = 1;
+		while (i + n < nblks && cache_lookup(cd, first_blk + i + n) == NULL) {
+			n++;
+		}
+		result = cache_fill(cd, first_blk + i, n, cbuf + (size_t) i * cd->blksz, false);
+		if (result < 0) {
+			break;
+		}
+		cd->misses += n;
+		i += n;
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return (result < 0) ? result : SUCCESS;
+}
+
+/**
+ * To write blocks through the cache to the underlying device, or in
+ * write-back mode to mark them dirty in the cache. The flusher thread
+ * is started by the first write-back write, so that it is created in
+ * the process that will run the file system.
+ *
+ * @param dev: the block device
+ * @param first_blk: index of the block to start writing to
+ * @param nblks: number of blocks to write to the device
+ * @param buf: buffer where data comes from
+ * @return SUCCESS if successful, or error from underlying device
+ */
+static int cache_write(struct blkdev *dev, int64_t first_blk, int nblks, void *buf)
+{
+	struct cache_dev *cd = dev->private;
+	int result = SUCCESS;
+
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	cd->wgen++;
+	if (!cd->writeback) {
+		result = cd->dev->ops->write(cd->dev, first_blk, nblks, buf);
+	}
+	for (int i = 0; i < nblks && result == SUCCESS; i++) {
+		struct cache_buf *b = cache_insert(cd, first_blk + i, (char*)buf + (size_t) i * cd->blksz);
+		if (b == NULL) {
+			result = E_UNAVAIL;
+		} else if (cd->writeback && !b->dirty) {
+			b->dirty = true;
+			b->dirtied = time(NULL);
+			cd->ndirty++;
+		}
+	}
+	if (cd->writeback && !cd->flusher_running) {
+		cd->flusher_running = (pthread_create(&cd->flusher, NULL, cache_flusher, cd) == 0);
+	}
+	if (cd->ndirty > cd->dirty_max) {
+		pthread_cond_signal(&cd->wake);
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return (result < 0) ? result : SUCCESS;
+}
+
+/**
+ * Flush the block device: write back dirty blocks in the range,
+ * then flush the range of the underlying device.
+ * @param dev: the block device
+ * @param first_blk: index of the block to start flushing
+ * @param nblks: number of blocks to flush
+ * @return result of flushing the underlying device
+ */
+static int cache_flush(struct blkdev *dev, int64_t first_blk, int64_t nblks)
+{
+	struct cache_dev *cd = dev->private;
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	int result = cache_writeback(cd, first_blk, nblks, time(NULL));
+	pthread_mutex_unlock(&cd->lock);
+	if (result < 0) {
+		return result;
+	}
+	return cd->dev->ops->flush(cd->dev, first_blk, nblks);
+}
+
+/**
+ * Find where a run of blocks lies in a file of the underlying device.
+ * For reading, dirty blocks in the run are written back first so the
+ * file holds their latest contents. For writing, cached copies are
+ * dropped, since the caller changes the blocks behind the cache's
+ * back and must keep readers off them until it is done; a write-back
+ * cache holds writes itself, so it does not hand out blocks to write.
+ * @param dev: the block device
+ * @param first_blk: index of the first block
+ * @param nblks: number of blocks
+ * @param writing: whether the blocks will be written
+ * @param fd: set to the file descriptor
+ * @param pos: set to the file offset of the first block
+ * @return SUCCESS if successful, E_UNAVAIL if the blocks cannot be
+ *   accessed in a file, or error from underlying device
+ */
+static int cache_map(struct blkdev *dev, int64_t first_blk, int nblks, int writing,
+		int *fd, off_t *pos)
+{
+	struct cache_dev *cd = dev->private;
+	if (cd->dev->ops->map == NULL) {
+		return E_UNAVAIL;
+	}
+	int result = SUCCESS;
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	if (writing && cd->writeback) {
+		result = E_UNAVAIL;
+	} else if (writing) {
+		cd->wgen++;
+		for (int i = 0; i < nblks; i++) {
+			struct cache_buf *b = cache_lookup(cd, first_blk + i);
+			if (b != NULL) {
+				cache_drop(cd, b);
+			}
+		}
+	} else if (cd->ndirty > 0) {
+		result = cache_writeback(cd, first_blk, nblks, time(NULL));
+	}
+	pthread_mutex_unlock(&cd->lock);
+	if (result < 0) {
+		return result;
+	}
+	return cd->dev->ops->map(cd->dev, first_blk, nblks, writing, fd, pos);
+}
+
+/**
+ * Change the size of the blocks the cache and the underlying device
+ * are addressed in. Dirty blocks are written back and the cache is
+ * emptied; it keeps the same number of buffers, each of the new size.
+ * @param dev: the block device
+ * @param size: the block size in bytes
+ * @return SUCCESS if successful, E_SIZE if the underlying device
+ *   cannot change its block size, E_UNAVAIL if the buffers cannot
+ *   be allocated, or error from underlying device
+ */
+static int cache_set_block_size(struct blkdev *dev, int size)
+{
+	struct cache_dev *cd = dev->private;
+	if (cd->dev->ops->set_block_size == NULL) {
+		return (size == cd->blksz) ? SUCCESS : E_SIZE;
+	}
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	int result = cache_writeback(cd, 0, cd->dev->ops->num_blocks(cd->dev), time(NULL));
+	if (result == SUCCESS && size != cd->blksz) {
+		char *data = malloc((size_t) cd->nbufs * size);
+		char *wb_data = malloc((size_t) WB_MAX_RUN * size);
+		result = (data == NULL || wb_data == NULL) ? E_UNAVAIL
+				: cd->dev->ops->set_block_size(cd->dev, size);
+		if (result == SUCCESS) {
+			free(cd->data);
+			free(cd->wb_data);
+			cd->data = data;
+			cd->wb_data = wb_data;
+			cd->blksz = size;
+			cd->wgen++;
+			for (int i = 0; i < cd->nbufs; i++) {
+				struct cache_buf *b = &cd->bufs[i];
+				if (b->blkno != -1) {
+					cache_drop(cd, b);
+				}
+				b->data = cd->data + (size_t) i * size;
+			}
+		} else {
+			free(data);
+			free(wb_data);
+		}
+	}
+	pthread_mutex_unlock(&cd->lock);
+	return result;
+}
+
+/**
+ * Close the cache and the underlying device, and free all
+ * allocated memory.
+ * @param dev: the block device
+ */
+static void cache_close(struct blkdev *dev)
+{
+	struct cache_dev *cd = dev->private;
+	if (cd->flusher_running) {
+		lock_mutex(&cd->lock, &cache_lock_stats);
+		cd->stopping = true;
+		pthread_cond_signal(&cd->wake);
+		pthread_mutex_unlock(&cd->lock);
+		pthread_join(cd->flusher, NULL);
+	}
+	cache_flush(dev, 0, cache_num_blocks(dev));
+	cd->dev->ops->close(cd->dev);
+	pthread_mutex_destroy(&cd->lock);
+	pthread_cond_destroy(&cd->wake);
+	free(cd->wb_list);
+	free(cd->wb_data);
+	free(cd->hash);
+	free(cd->data);
+	free(cd->bufs);
+	free(cd);
+	free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops cache_ops = {
+	.num_blocks = cache_num_blocks,
+	.read = cache_read,
+	.write = cache_write,
+	.flush = cache_flush,
+	.close = cache_close,
+	.map = cache_map,
+	.set_block_size = cache_set_block_size
+};
+
+/**
+ * Create a block device that caches blocks of another block device.
+ *
+ * @param dev: the underlying block device
+ * @param nbufs: number of block buffers in the cache
+ * @return: the caching block device or NULL if cannot allocate cache
+ */
+struct blkdev *cache_create(struct blkdev *dev, int nbufs)
+{
+	struct blkdev *cdev = malloc(sizeof(*cdev));
+	struct cache_dev *cd = calloc(1, sizeof(*cd));
+	if (cdev == NULL || cd == NULL || nbufs <= 0) {
+		return NULL;
+	}
+
+	lock_stats_register(&cache_lock_stats);
+	int nhash = 1;
+	while (nhash < nbufs) {
+		nhash <<= 1;
+	}
+
+	cd->dev = dev;
+	cd->blksz = BLOCK_SIZE;
+	cd->nbufs = nbufs;
+	cd->bufs = calloc(nbufs, sizeof(struct cache_buf));
+	cd->data = malloc((size_t) nbufs * BLOCK_SIZE);
+	cd->hash = calloc(nhash, sizeof(struct cache_buf*));
+	cd->hash_mask = nhash - 1;
+	cd->wb_list = malloc(nbufs * sizeof(struct cache_buf*));
+	cd->wb_data = malloc(WB_MAX_RUN * BLOCK_SIZE);
+	pthread_mutex_init(&cd->lock, NULL);
+	pthread_cond_init(&cd->wake, NULL);
+	if (cd->bufs == NULL || cd->data == NULL || cd->hash == NULL ||
+			cd->wb_list == NULL || cd->wb_data == NULL) {
+		fprintf(stderr, "cannot allocate %d cache buffers\n", nbufs);
+		return NULL;
+	}
+
+	// all buffers start out unused on the LRU list
+	cd->lru.next = cd->lru.prev = &cd->lru;
+	for (int i = 0; i < nbufs; i++) {
+		struct cache_buf *b = &cd->bufs[i];
+		b->blkno = -1;
+		b->data = cd->data + (size_t) i * BLOCK_SIZE;
+		b->next = &cd->lru;
+		b->prev = cd->lru.prev;
+		cd->lru.prev->next = b;
+		cd->lru.prev = b;
+	}
+
+	cdev->private = cd;
+	cdev->ops = &cache_ops;
+	return cdev;
+}
+
+/**
+ * Read blocks into the cache ahead of need. Blocks already cached
+ * are left alone; each run of missing blocks is read with a single
+ * device read. At most half the cache is filled by one call, so a
+ * prefetch cannot flush out everything else.
+ *
+ * @param dev: the caching block device
+ * @param first_blk: index of the first block to read
+ * @param nblks: number of blocks to read
+ * @return: number of blocks read, or E_UNAVAIL if dev is not a
+ *   caching block device, or error from underlying device
+ */
+int cache_prefetch(struct blkdev *dev, int64_t first_blk, int nblks)
+{
+	if (dev->ops != &cache_ops) {
+		return E_UNAVAIL;
+	}
+	struct cache_dev *cd = dev->private;
+	if (nblks > cd->nbufs / 2) {
+		nblks = cd->nbufs / 2;
+	}
+	int nread = 0;
+	char *buf = NULL;
+
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	for (int i = 0; i < nblks; ) {
+		if (cache_lookup(cd, first_blk + i) != NULL) {
+			i++;
+			continue;
+		}
+		int n = 1;
+		while (i + n < nblks && cache_lookup(cd, first_blk + i + n) == NULL) {
+			n++;
+		}
+		if (buf == NULL && (buf = malloc((size_t) nblks * cd->blksz)) == NULL) {
+			break;
+		}
+		int result = cache_fill(cd, first_blk + i, n, buf, true);
+		if (result < 0) {
+			nread = result;
+			break;
+		}
+		cd->prefetched += n;
+		nread += n;
+		i += n;
+	}
+	pthread_mutex_unlock(&cd->lock);
+	free(buf);
+	return nread;
+}
+
+/**
+ * Switch a caching block device to write-back mode.
+ *
+ * @param dev: the caching block device
+ * @param max_age: seconds a written block may stay dirty in the cache
+ * @param dirty_max: number of dirty blocks above which the flusher
+ *   writes back all dirty blocks regardless of age
+ */
+void cache_set_writeback(struct blkdev *dev, int max_age, int dirty_max)
+{
+	struct cache_dev *cd = dev->private;
+	lock_mutex(&cd->lock, &cache_lock_stats);
+	cd->writeback = true;
+	cd->max_age = max_age;
+	cd->dirty_max = dirty_max;
+	pthread_mutex_unlock(&cd->lock);
+}
+
+/**
+ * Get hit/miss statistics for a caching block device.
+ *
+ * @param dev: the caching block device
+ * @param st: pointer to the statistics to fill in
+ */
+void cache_get_stats(struct blkdev *dev, struct cache_stats *st)
+{
+	struct cache_dev *cd = dev->private;
+	st->hits = cd->hits;
+	st->misses = cd->misses;
+	st->nbufs = cd->nbufs;
+	st->prefetched = cd->prefetched;
+	st->ra_hits = cd->ra_hits;
+	st->ra_wasted = cd->ra_wasted;
+	st->ndirty = cd->ndirty;
+	st->written_back = cd->written_back;
+}
@@ -0,0 +1,69 @@
+/*
+ * file:        cache.h
+ * description: LRU block buffer cache layered over a block device
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "blkdev.h"
+
+/** cache statistics */
+struct cache_stats {
+	long hits; /* blocks served from the cache */
+	long misses; /* blocks read from the underlying device */
+	int  nbufs; /* number of cache buffers */
+	long prefetched; /* blocks read ahead by cache_prefetch */
+	long ra_hits; /* prefetched blocks that were then read */
+	long ra_wasted; /* prefetched blocks evicted without being read */
+	int  ndirty; /* blocks waiting to be written back */
+	long written_back; /* blocks written back from the cache */
+};
+
+/**
+ * Create a block device that caches blocks of another block device.
+ * Reads are served from a fixed pool of nbufs block buffers with LRU
+ * replacement; writes go through to the underlying device.
+ *
+ * @param dev: the underlying block device
+ * @param nbufs: number of block buffers in the cache
+ * @return: the caching block device or NULL if cannot allocate cache
+ */
+extern struct blkdev *cache_create(struct blkdev *dev, int nbufs);
+
+/**
+ * Read blocks into the cache ahead of need. Blocks already cached
+ * are left alone; each run of missing blocks is read with a single
+ * device read.
+ *
+ * @param dev: the caching block device
+ * @param first_blk: index of the first block to read
+ * @param nblks: number of blocks to read
+ * @return: number of blocks read, or E_UNAVAIL if dev is not a
+ *   caching block device, or error from underlying device
+ */
+extern int cache_prefetch(struct blkdev *dev, int64_t first_blk, int nblks);
+
+/**
+ * Switch a caching block device to write-back mode: writes only
+ * update the cache, and a background thread writes dirty blocks back
+ * once they have been dirty for max_age seconds, or all of them once
+ * more than dirty_max blocks are dirty. Flushing a range of the
+ * device writes back the dirty blocks in the range first.
+ *
+ * @param dev: the caching block device
+ * @param max_age: seconds a written block may stay dirty in the cache
+ * @param dirty_max: number of dirty blocks above which the flusher
+ *   writes back all dirty blocks regardless of age
+ */
+extern void cache_set_writeback(struct blkdev *dev, int max_age, int dirty_max);
+
+/**
+ * Get hit/miss statistics for a caching block device.
+ *
+ * @param dev: the caching block device
+ * @param st: pointer to the statistics to fill in
+ */
+extern void cache_get_stats(struct blkdev *dev, struct cache_stats *st);
+
+#endif /* CACHE_H_ */
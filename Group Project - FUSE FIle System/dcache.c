@@ -0,0 +1,138 @@
+/*
+ * file:        dcache.c
+ * description: directory entry cache for FSX492 path resolution
+ *
+ * Maps (directory inode, name) to the entry's inode number, so that
+ * resolving a path does not have to read and scan each directory
+ * along the way. Failed lookups are cached as negative entries with
+ * inode 0. The table is a fixed-size hash table where each name
+ * hashes to a single slot, and a new entry simply replaces whatever
+ * was in its slot. A mutex makes the cache safe to use from several
+ * threads at once.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fsx492.h"
+#include "dcache.h"
+#include "lockstat.h"
+
+/** number of cache slots - must be a power of 2 */
+enum { DCACHE_SIZE = 8192 };
+
+/** a cached directory entry */
+struct dcache_entry {
+	int parent; /* directory inode, 0 if slot unused */
+	int inum; /* entry inode, 0 if entry not present */
+	char name[FS_FILENAME_SIZE]; /* entry name */
+};
+
+/** the cache slots */
+static struct dcache_entry dcache[DCACHE_SIZE];
+
+/** protects the cache slots */
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** contention statistics of dcache_lock */
+static struct lock_stats dcache_lock_stats = { .name = "dcache" };
+
+/**
+ * Hash a directory and name to a cache slot (FNV-1a).
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ * @return: pointer to the slot for the entry
+ */
+static struct dcache_entry *dcache_slot(int parent, const char *name)
+{
+	uint32_t h = 2166136261u ^ (uint32_t) parent;
+	for (const char *p = name; *p; p++) {
+		h = (h ^ (unsigned char) *p) * 16777619u;
+	}
+	return &dcache[h & (DCACHE_SIZE - 1)];
+}
+
+/**
+ * Look up a name in a directory in the cache.
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ * @return: the entry inode, 0 if the entry is cached as not
+ *   present, or DCACHE_MISS if nothing is cached for the name
+ */
+int dcache_lookup(int parent, const char *name)
+{
+	struct dcache_entry *de = dcache_slot(parent, name);
+	int inum = DCACHE_MISS;
+	lock_mutex(&dcache_lock, &dcache_lock_stats);
+	if (de->parent == parent && strcmp(de->name, name) == 0) {
+		inum = de->inum;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return inum;
+}
+
+/**
+ * Enter the result of a directory lookup into the cache.
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ * @param inum: the entry inode, or 0 if the entry is not present
+ */
+void dcache_insert(int parent, const char *name, int inum)
+{
+	if (strlen(name) >= FS_FILENAME_SIZE) {
+		return;
+	}
+	struct dcache_entry *de = dcache_slot(parent, name);
+	lock_mutex(&dcache_lock, &dcache_lock_stats);
+	de->parent = parent;
+	de->inum = inum;
+	strcpy(de->name, name);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Remove a name in a directory from the cache.
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ */
+void dcache_invalidate(int parent, const char *name)
+{
+	struct dcache_entry *de = dcache_slot(parent, name);
+	lock_mutex(&dcache_lock, &dcache_lock_stats);
+	if (de->parent == parent && strcmp(de->name, name) == 0) {
+		de->parent = 0;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Remove all cached entries for a directory.
+ *
+ * @param parent: inode number of the directory
+ */
+void dcache_invalidate_dir(int parent)
+{
+	lock_mutex(&dcache_lock, &dcache_lock_stats);
+	for (int i = 0; i < DCACHE_SIZE; i++) {
+		if (dcache[i].parent == parent) {
+			dcache[i].parent = 0;
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Remove all entries from the cache.
+ */
+void dcache_purge(void)
+{
+	lock_stats_register(&dcache_lock_stats);
+	lock_mutex(&dcache_lock, &dcache_lock_stats);
+	memset(dcache, 0, sizeof(dcache));
+	pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,53 @@
+/*
+ * file:        dcache.h
+ * description: directory entry cache for FSX492 path resolution
+ */
+
+#ifndef DCACHE_H_
+#define DCACHE_H_
+
+/** dcache_lookup result when the entry is not cached */
+enum { DCACHE_MISS = -1 };
+
+/**
+ * Look up a name in a directory in the cache.
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ * @return: the entry inode, 0 if the entry is cached as not
+ *   present, or DCACHE_MISS if nothing is cached for the name
+ */
+extern int dcache_lookup(int parent, const char *name);
+
+/**
+ * Enter the result of a directory lookup into the cache.
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ * @param inum: the entry inode, or 0 if the entry is not present
+ */
+extern void dcache_insert(int parent, const char *name, int inum);
+
+/**
+ * Remove a name in a directory from the cache. Must be called
+ * whenever the entry is created, removed or renamed.
+ *
+ * @param parent: inode number of the directory
+ * @param name: the entry name
+ */
+extern void dcache_invalidate(int parent, const char *name);
+
+/**
+ * Remove all cached entries for a directory. Must be called when
+ * the directory is removed, since its inode can be reused.
+ *
+ * @param parent: inode number of the directory
+ */
+extern void dcache_invalidate_dir(int parent);
+
+/**
+ * Remove all entries from the cache.
+ */
+extern void dcache_purge(void);
+
+#endif /* DCACHE_H_ */
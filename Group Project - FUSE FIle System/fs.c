@@ -8,25 +8,41 @@
  */
 
 #define FUSE_USE_VERSION 27
+#define _GNU_SOURCE /* for pthread_rwlockattr_setkind_np */
 
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "fsx492.h"
 #include "blkdev.h"
+#include "dcache.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "cache.h"
+#include "lockstat.h"
+#include "workq.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* as in linux/falloc.h */
+#endif
 
 /*
  * disk access - the global variable 'disk' points to a blkdev
  * structure which has been initialized to access the image file.
  *
- * NOTE - blkdev access is in terms of 1024-byte blocks
+ * NOTE - blkdev access is in terms of blocks of the file system's
+ * block size, which fs_init sets the device to once it has read the
+ * superblock from the first FS_BLOCK_SIZE bytes
  */
 extern struct blkdev *disk; //see main.c
 
@@ -35,6 +51,15 @@ extern struct blkdev *disk; //see main.c
  *   FD_ISSET(##, inode_map);
  *   FD_CLR(##, block_map);
  *   FD_SET(##, block_map);
+ *
+ * The FD_ macros only work for bit numbers below FD_SETSIZE, so the
+ * maps are handled with the word-at-a-time functions in bitmap.h.
+ *
+ * In the block group layout (FS_FEAT_GROUPS) the maps and inode
+ * tables of all groups are still kept in memory as one inode map,
+ * one block map and one inode array, in group order. The base
+ * numbers below then number metadata blocks in that order rather
+ * than give their place on disk, which meta_blk works out.
  */
 
 /** pointer to inode bitmap to determine free inodes */
@@ -56,24 +81,357 @@ static int     block_map_base;
 /** number of available blocks from superblock */
 static int   n_blocks;
 
+/** block size in bytes from superblock, and its log2; block sizes
+ * are powers of two, so byte offsets are split into block number
+ * and offset in block with a shift and a mask */
+static int   block_size = FS_BLOCK_SIZE;
+static int   block_shift;
+
+/** directory entries, inodes, block pointers and map bits in a
+ * block, and log2 of the number of pointers */
+static int   dirents_per_blk;
+static int   inodes_per_blk;
+static int   ptrs_per_blk;
+static int   ptrs_shift;
+static int   bits_per_blk;
+
+/** largest file in blocks, and in bytes */
+static int   max_file_blks;
+static off_t max_file_size;
+
+/** blocks of zeros for zeroing new blocks */
+static char *zero_blks;
+
+/** summaries of the inode and block maps, for searching them */
+static struct bitmap_summary *inode_sum;
+static struct bitmap_summary *block_sum;
+
+/** true for the block group layout */
+static bool  grouped;
+
+/** block groups; the original layout is a single group of blocks,
+ * with its inodes in groups of INODE_GROUP_BLKS blocks of inodes */
+static int   n_bgroups;
+static int   blocks_per_group;
+static int   inodes_per_group;
+
+/** blocks of block map and of inode table in each block group */
+static int   group_bmap_blks;
+static int   group_itable_blks;
+
+/** the inode map blocks of the block groups as they are on disk */
+static char *group_imaps;
+
+/** for each block group, the block after the last extent allocated
+ * in it, where a search for a new extent for a file of the group starts */
+static int  *blk_hints;
+
+/** number of free blocks and free inodes, kept up to date by the allocators */
+static int   n_free_blks;
+static int   n_free_inodes;
+
+/** free blocks set aside for writing back held blocks */
+static int   n_reserved;
+
+/** number of blocks held in memory by all open files */
+static int   n_held;
+
 /** number of root inode from superblock */
 static int   root_inode;
 
-/** array of dirty metadata blocks to write  -- optional */
+/** free inodes and directories in a group of inodes_per_group inodes */
+struct inode_group {
+	int free; /* number of free inodes */
+	int dirs; /* number of directories */
+};
+
+/** inode groups, kept up to date by the inode allocator */
+static struct inode_group *igroups;
+static int   n_igroups;
+
+/** number of directories */
+static int   n_dirs;
+
+/** group after the last one a top-level directory was put in */
+static int   dir_rotor;
+
+/** array of dirty metadata blocks to write, indexed by block number;
+ * each entry points to the in-memory copy of the block or is NULL */
 static void **dirty;
 
-/** length of dirty array -- optional */
+/** length of dirty array -- covers the superblock, maps and inode region */
 static int    dirty_len;
 
-/** total size of direct blocks */
-static int DIR_SIZE = BLOCK_SIZE * N_DIRECT;
-static int INDIR1_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
-static int INDIR2_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
+/** number of non-NULL entries in the dirty array */
+static int    n_dirty;
+
+/** time of the last metadata flush */
+static time_t last_flush;
+
+/** error from a metadata write that had no caller to return it to,
+ * returned by the next flush of the metadata instead */
+static int    meta_err;
+
+/** seconds that metadata changes may stay in memory before being flushed */
+enum { FLUSH_INTERVAL = 5 };
+
+/** seconds between checks by the flusher thread */
+enum { FLUSH_CHECK = 1 };
+
+/** the flusher thread, which writes back what has waited
+ * FLUSH_INTERVAL when no operation comes along to do it */
+static pthread_t flusher;
+
+/** whether the flusher thread has been started */
+static bool   flusher_running;
+
+/** tells the flusher thread to exit, set with meta_lock held */
+static bool   flusher_stopping;
+
+/** wakes the flusher thread */
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+
+/** journal handles open: operations in progress that change metadata */
+static int    n_handles;
+
+/** journal credits held by the open handles */
+static int    credits_held;
+
+/** set while a commit waits for the open handles to end or is being
+ * written; no handle is begun meanwhile */
+static bool   commit_wanted;
+
+/** set while a commit is being written without meta_lock held */
+static bool   committing;
+
+/** signalled when the last open handle ends and after a commit */
+static pthread_cond_t handle_cond = PTHREAD_COND_INITIALIZER;
+
+/** journal credits for an operation on a directory entry: the blocks
+ * of a directory whose leaf splits or is shrunk back, the pointer
+ * blocks and block map blocks of its new blocks, the inodes and the
+ * inode map; and for a change to one inode and its inode map bit */
+enum { NS_CREDITS = 40, INODE_CREDITS = 2 };
+
+/** most blocks mapped or freed under one journal handle */
+enum { HANDLE_BLKS = 64 };
+
+/** an open file, found through fi->fh */
+struct open_file {
+	int inum; /* inode number, 0 if the entry is free */
+	int next_free; /* next free entry in the table, if free */
+	off_t ra_next; /* offset where a sequential read would start */
+	int ra_end; /* logical block after the last one read ahead */
+	int ra_window; /* blocks to read ahead next time */
+	bool written; /* written since the file was last flushed */
+};
+
+/** smallest and largest readahead window in blocks */
+enum { RA_MIN_BLKS = 4, RA_MAX_BLKS = 128 };
+
+/** bytes of write data copied out of a pipe at a time, at least a block */
+enum { WRITE_CHUNK_SIZE = 16 * FS_BLOCK_SIZE };
+
+/** bytes of held blocks over which a writer writes back its file's held blocks */
+enum { HELD_MAX_SIZE = 4096 * FS_BLOCK_SIZE };
+
+/** blocks of held data written back with one write */
+enum { HELD_WRITE_BLKS = 64 };
+
+/** largest extent looked for to leave room for a growing file */
+enum { ALLOC_MAX_WINDOW = 1024 };
+
+/** blocks zeroed with one write by fallocate */
+enum { ZERO_RUN_BLKS = 64 };
+
+/** blocks of inodes in an inode group of the original layout, the unit new
+ * directories are spread over; block groups are used instead if there are any */
+enum { INODE_GROUP_BLKS = 16 };
+
+/** open file table, indexed by fi->fh; entries never move, so a
+ * pointer to one stays valid after the table grows */
+static struct open_file **open_files;
+
+/** number of entries in the open file table */
+static int    n_open_files;
+
+/** first free entry in the open file table, or -1 */
+static int    open_files_free = -1;
+
+/** slots of a block map cache: the single indirect block, the
+ * double indirect block, then the ptrs_per_blk blocks it points to */
+enum { BMAP_INDIR1 = 0, BMAP_INDIR2 = 1, BMAP_INDIR2_PTRS = 2 };
+
+/** data of a block written but not yet given a disk block */
+struct held_blk {
+	int lblk; /* logical block in the file */
+	char *data; /* block contents */
+};
+
+/** pointer blocks of an open inode, loaded as they are needed, and
+ * the blocks written to it that have not been allocated yet */
+struct bmap_cache {
+	int refs; /* number of opens of the inode */
+	struct held_blk *held; /* held blocks, sorted by logical block */
+	int nheld; /* number of held blocks */
+	int held_cap; /* number of entries allocated in held */
+	int reserved; /* free blocks reserved for writing them back */
+	time_t held_since; /* when the first of them was written */
+	off_t size; /* size of the file as written, if more than the
+	             * size on disk in the inode, which stops short of
+	             * the first held block */
+	int pins; /* replies still to send that splice from the file's
+	           * blocks in the image; its blocks are not freed meanwhile */
+	uint32_t *ptrs[]; /* copies of the pointer blocks, NULL if not loaded */
+};
+
+/** block map caches, indexed by inode number, NULL if not open */
+static struct bmap_cache **bmaps;
+
+/** references the kernel holds to each inode through the low-level
+ * API: entries replied and not yet forgotten */
+static unsigned long *lookups;
+
+/*
+ * Locking. FUSE calls the operations from several threads at once.
+ *  ns_lock:     held for writing by operations that change the
+ *               namespace (create, remove, rename) and for reading
+ *               by all others, so directories only change while no
+ *               other operation runs.
+ *  inode_locks: one per inode, held for reading while a file's data
+ *               or attributes are read and for writing while they
+ *               change, including when its block map cache comes
+ *               and goes.
+ *  bmap_lock:   loading pointer blocks into block map caches.
+ *  open_lock:   the open file table, readahead state, and the pins
+ *               on files with spliced reads in flight.
+ *  alloc_lock:  searching and changing the inode and block maps.
+ *  meta_lock:   the dirty array, the journal, and the bits of the
+ *               maps, so a commit never copies a map mid-change;
+ *               the journal handle counts. It is dropped while a
+ *               commit is written, which no handle runs alongside.
+ * A thread holding one of these locks only takes locks below it.
+ *
+ * Every change to metadata is made under a journal handle (see
+ * handle_begin), and the journal is only committed while no handle is
+ * open. Beginning a handle may wait for a commit, and so for every
+ * other handle to end, so a handle is begun after ns_lock and the
+ * inode locks the operation needs, and no inode lock is taken while
+ * one is open, except under ns_lock held for writing.
+ */
+static pthread_rwlock_t ns_lock;
+static pthread_rwlock_t *inode_locks;
+static pthread_mutex_t bmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpin_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** contention statistics, for lock_report */
+static struct lock_stats ns_stats = { .name = "namespace" };
+static struct lock_stats inode_stats = { .name = "inode" };
+static struct lock_stats bmap_stats = { .name = "bmap" };
+static struct lock_stats open_stats = { .name = "open files" };
+static struct lock_stats alloc_stats = { .name = "allocator" };
+static struct lock_stats meta_stats = { .name = "metadata" };
+
+/**
+ * Set up the namespace lock, once, and register the contention
+ * statistics of the locks.
+ */
+static void locks_init(void)
+{
+	static bool ready;
+	if (ready) return;
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// a steady stream of readers must not starve namespace changes
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&ns_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	lock_stats_register(&ns_stats);
+	lock_stats_register(&inode_stats);
+	lock_stats_register(&bmap_stats);
+	lock_stats_register(&open_stats);
+	lock_stats_register(&alloc_stats);
+	lock_stats_register(&meta_stats);
+	ready = true;
+}
+
+/**
+ * Allocate and initialize a lock for each of the n_inodes inodes.
+ */
+static void inode_locks_init(void)
+{
+	inode_locks = malloc(n_inodes * sizeof(pthread_rwlock_t));
+	if (inode_locks == NULL) {
+		fprintf(stderr, "cannot allocate inode locks\n");
+		exit(1);
+	}
+	for (int i = 0; i < n_inodes; i++) {
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	}
+}
+
+/**
+ * Free the inode locks.
+ */
+static void inode_locks_purge(void)
+{
+	for (int i = 0; inode_locks != NULL && i < n_inodes; i++) {
+		pthread_rwlock_destroy(&inode_locks[i]);
+	}
+	free(inode_locks);
+	inode_locks = NULL;
+}
+
+/**
+ * Lock an inode.
+ *
+ * @param inum: the inode number
+ * @param write: true to lock for writing, false for reading
+ */
+static void inode_lock(int inum, bool write)
+{
+	if (write) {
+		lock_write(&inode_locks[inum], &inode_stats);
+	} else {
+		lock_read(&inode_locks[inum], &inode_stats);
+	}
+}
+
+/**
+ * Unlock an inode.
+ *
+ * @param inum: the inode number
+ */
+static void inode_unlock(int inum)
+{
+	pthread_rwlock_unlock(&inode_locks[inum]);
+}
 
 /* Suggested functions to implement -- you are free to ignore these
  * and implement your own instead
  */
 
+/**
+ * Read a directory or pointer block. The latest copy of a block
+ * may be in the running journal transaction rather than on disk.
+ *
+ * @param blk: the block number
+ * @param buf: buffer for the block
+ */
+static void meta_read(int blk, void *buf)
+{
+	lock_mutex(&meta_lock, &meta_stats);
+	bool logged = journal_active() && journal_read(blk, buf);
+	pthread_mutex_unlock(&meta_lock);
+	if (logged) return;
+	if (disk->ops->read(disk, blk, 1, buf) < 0) exit(1);
+}
+
 /**
  * Find inode for existing directory entry.
  *
@@ -83,7 +441,7 @@ static int INDIR2_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * (BLOCK_SIZE / sizeof(
  */
 static int find_in_dir(struct fs_dirent *de, char *name)
 {
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+	for (int i = 0; i < dirents_per_blk; i++) {
 		//found, return its inode
 		if (de[i].valid && strcmp(de[i].name, name) == 0) {
 			return de[i].inode;
@@ -93,173 +451,315 @@ static int find_in_dir(struct fs_dirent *de, char *name)
 }
 
 /**
- * Look up a single directory entry in a directory.
+ * First block of a block group.
  *
- * Errors
- *   -EIO     - error reading block
- *   -ENOENT  - a component of the path is not present.
- *   -ENOTDIR - intermediate component of path not a directory
+ * @param g: the group number
+ * @return the block number of the first block of its block map
+ */
+static int group_start(int g)
+{
+	return g * blocks_per_group + (g == 0 ? 1 : 0);
+}
+
+/**
+ * First data block of a block group, after its maps and inode table.
  *
+ * @param g: the group number
+ * @return the block number
  */
-static int lookup(int inum, char *name)
+static int group_data(int g)
 {
-	//get corresponding directory
-	struct fs_inode cur_dir = inodes[inum];
-	//init buff entries
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, cur_dir.direct[0], 1, &entries) < 0) exit(1);
-	int inode = find_in_dir(entries, name);
-	return inode == 0 ? -ENOENT : inode;
+	return group_start(g) + group_bmap_blks + 1 + group_itable_blks;
 }
 
 /**
- * Parse path name into tokens at most nnames tokens after
- * normalizing paths by removing '.' and '..' elements.
+ * Block group that the blocks of an inode are allocated in when
+ * they are not placed after other blocks of the file.
  *
- * If names is NULL, path is not altered and function  returns
- * the path count. Otherwise, path is altered by strtok() and
- * function returns names in the names array, which point to
- * elements of path string.
+ * @param inum: the inode number
+ * @return the group number, 0 in the original layout
+ */
+static int inode_bgroup(int inum)
+{
+	return grouped ? inum / inodes_per_group : 0;
+}
+
+/**
+ * Disk block of a resident metadata block.
  *
- * @param path: the directory path
- * @param names: the argument token array or NULL
- * @param nnames: the maximum number of names, 0 = unlimited
- * @return the number of path name tokens
+ * @param i: the block number counted from 0 for the superblock, as
+ *   the inode map, block map and inode table blocks are numbered
+ *   from inode_map_base, block_map_base and inode_base
+ * @return the disk block number
  */
-static int parse(char *path, char *names[], int nnames)
+static int meta_blk(int i)
 {
-	char *_path = strdup(path);
-	int count = 0;
-	char *token = strtok(_path, "/");
-	while (token != NULL) {
-		int len = strlen(token);
-		if (len > FS_FILENAME_SIZE - 1) return -EINVAL;
-		if (strcmp(token, "..") == 0 && count > 0) count--;
-		else if (strcmp(token, ".") != 0) {
-			if (names != NULL && count < nnames) {
-				names[count] = (char*)malloc(len+1);
-				memset(names[count], 0, len+1);
-				strcpy(names[count], token);
+	if (!grouped || i == 0) return i;
+	if (i < block_map_base) {
+		return group_start(i - inode_map_base) + group_bmap_blks;
+	}
+	if (i < inode_base) {
+		i -= block_map_base;
+		return group_start(i / group_bmap_blks) + i % group_bmap_blks;
+	}
+	i -= inode_base;
+	return group_start(i / group_itable_blks) + group_bmap_blks + 1 + i % group_itable_blks;
+}
+
+/**
+ * Flush dirty metadata blocks to disk. With a journal, the dirty
+ * blocks join the directory and pointer blocks already logged and
+ * the whole transaction is committed at once. Without one, runs of
+ * dirty blocks that are adjacent both on disk and in memory go out
+ * in one write. Blocks that could not be written stay dirty for
+ * the next flush. Called with meta_lock held and, through
+ * commit_locked, with no journal handle open, so the resident blocks
+ * are copied with no operation part way through them. meta_lock is
+ * dropped while the journal is written, so that lookups reading
+ * logged blocks do not wait for the device flushes.
+ *
+ * @return: 0 if successful, or -EIO if this or an earlier metadata
+ *   write failed
+ */
+static int flush_metadata_locked(void)
+{
+	int i, n, res = meta_err;
+	meta_err = SUCCESS;
+	last_flush = time(NULL);
+	if (journal_active()) {
+		for (i = 0; i < dirty_len; i++) {
+			if (dirty[i] == NULL) continue;
+			if (journal_log(meta_blk(i), dirty[i]) < 0) return -EIO;
+			dirty[i] = NULL;
+			n_dirty--;
+		}
+		committing = true;
+		pthread_mutex_unlock(&meta_lock);
+		int err = journal_commit_write();
+		lock_mutex(&meta_lock, &meta_stats);
+		committing = false;
+		if (err < 0) return -EIO;
+		journal_commit_end();
+		return res;
+	}
+	for (i = 0; i < dirty_len; i += n) {
+		n = 1;
+		if (dirty[i]) {
+			while (i + n < dirty_len &&
+					dirty[i + n] == (char*) dirty[i] + n * block_size &&
+					meta_blk(i + n) == meta_blk(i) + n) {
+				n++;
 			}
-			count++;
+			if (disk->ops->write(disk, meta_blk(i), n, dirty[i]) < 0) {
+				res = -EIO;
+				continue;
+			}
+			memset(&dirty[i], 0, n * sizeof(void*));
+			n_dirty -= n;
 		}
-		token = strtok(NULL, "/");
 	}
-	//if the number of names in the path exceed the maximum
-	if (nnames != 0 && count > nnames) return -1;
-	return count;
+	return res;
 }
 
 /**
- * free allocated char pointer array
- * @param arr: array to be freed
+ * Flush dirty metadata blocks to disk once no journal handle is
+ * open, so the commit never holds part of an operation. New handles
+ * wait until the flush is done. Called with meta_lock held.
+ *
+ * @return: 0 if successful, or -EIO
  */
-static void free_char_ptr_array(char *arr[], int len) {
-	for (int i = 0; i < len; i++) {
-		free(arr[i]);
+static int commit_locked(void)
+{
+	while (n_handles > 0 || committing) {
+		commit_wanted = true;
+		pthread_cond_wait(&handle_cond, &meta_lock);
 	}
+	commit_wanted = true;
+	int res = flush_metadata_locked();
+	commit_wanted = false;
+	pthread_cond_broadcast(&handle_cond);
+	return res;
 }
 
 /**
- * Return inode number for specified file or
- * directory.
- *
- * Errors
- *   -ENOENT  - a component of the path is not present.
- *   -ENOTDIR - an intermediate component of path not a directory
+ * Flush dirty metadata blocks to disk. Called with no journal
+ * handle open.
  *
- * @param path: the file path
- * @return inode of path node or error
+ * @return: 0 if successful, or -EIO
  */
-static int translate(char *path)
+int flush_metadata(void)
 {
-	if (strcmp(path, "/") == 0 || strlen(path) == 0) return root_inode;
-	int inode_idx = root_inode;
-	//get number of names
-	int num_names = parse(path, NULL, 0);
-	//if the number of names in the path exceed the maximum, return an error, error type to be fixed if necessary
-	if (num_names < 0) return -ENOTDIR;
-	if (num_names == 0) return root_inode;
-	//copy all the names
-	char *names[num_names];
-	parse(path, names, num_names);
-	//lookup inode
+	lock_mutex(&meta_lock, &meta_stats);
+	int res = commit_locked();
+	pthread_mutex_unlock(&meta_lock);
+	return res;
+}
 
-	for (int i = 0; i < num_names; i++) {
-		//if token is not a directory return error
-		if (!S_ISDIR(inodes[inode_idx].mode)) {
-			free_char_ptr_array(names, num_names);
-			return -ENOTDIR;
+/**
+ * Journal credits a new handle can still be given: the room left in
+ * the running transaction, less the dirty resident blocks that join
+ * it at the commit and the credits of the handles already open.
+ * Called with meta_lock held.
+ */
+static int handle_room(void)
+{
+	if (!journal_active()) return INT32_MAX;
+	return journal_space() - n_dirty - credits_held;
+}
+
+/**
+ * Begin a journal handle: an operation, or one step of a long one,
+ * whose metadata changes go to the disk in the same transaction.
+ * Waits until the transaction has room for the credits, the most
+ * metadata blocks the operation logs or marks dirty, committing it
+ * once no other handle is open if it has not. Metadata dirty for
+ * FLUSH_INTERVAL is committed first as well. Without a journal a
+ * commit just flushes the dirty blocks.
+ *
+ * @param credits: the journal credits for the operation
+ */
+static void handle_begin(int credits)
+{
+	lock_mutex(&meta_lock, &meta_stats);
+	for (;;) {
+		bool due = time(NULL) - last_flush >= FLUSH_INTERVAL &&
+				(n_dirty > 0 || journal_pending() > 0);
+		if (!commit_wanted && !due && handle_room() >= credits) break;
+		if (commit_wanted || n_handles > 0) {
+			//a commit that is due keeps new handles out until it is done
+			if (due) commit_wanted = true;
+			pthread_cond_wait(&handle_cond, &meta_lock);
+			continue;
 		}
-		//lookup and record inode
-		inode_idx = lookup(inode_idx, names[i]);
-		if (inode_idx < 0) {
-			free_char_ptr_array(names, num_names);
-			return -ENOENT;
+		if (commit_locked() < 0) {
+			//the transaction is kept for the next commit to retry
+			meta_err = -EIO;
+			break;
 		}
 	}
-	free_char_ptr_array(names, num_names);
-	return inode_idx;
+	n_handles++;
+	credits_held += credits;
+	pthread_mutex_unlock(&meta_lock);
 }
 
 /**
- *  Return inode number for path to specified file
- *  or directory, and a leaf name that may not yet
- *  exist.
+ * End a journal handle begun with handle_begin.
  *
- * Errors
- *   -ENOENT  - a component of the path is not present.
- *   -ENOTDIR - an intermediate component of path not a directory
+ * @param credits: the journal credits it was begun with
+ */
+static void handle_end(int credits)
+{
+	lock_mutex(&meta_lock, &meta_stats);
+	n_handles--;
+	credits_held -= credits;
+	pthread_cond_broadcast(&handle_cond);
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/**
+ * Journal credits for mapping new blocks to a file: the pointer
+ * blocks changed or added, a block map block for each block, and
+ * the inode.
  *
- * @param path: the file path
- * @param leaf: pointer to space for FS_FILENAME_SIZE leaf name
- * @return inode of path node or error
+ * @param n: the number of blocks mapped
  */
-static int translate_1(char *path, char *leaf)
+static int map_credits(int n)
 {
-	if (strcmp(path, "/") == 0 || strlen(path) == 0) return root_inode;
-	int inode_idx = root_inode;
-	//get number of names
-	int num_names = parse(path, NULL, 0);
-	//if the number of names in the path exceed the maximum, return an error, error type to be fixed if necessary
-	if (num_names < 0) return -ENOTDIR;
-	if (num_names == 0) return root_inode;
-	//copy all the names
-	char *names[num_names];
-	parse(path, names, num_names);
-	//lookup inode
+	int ptrs = n / ptrs_per_blk + 4;
+	int maps = n + ptrs;
+	if (maps > inode_base - block_map_base) maps = inode_base - block_map_base;
+	return ptrs + maps + 1;
+}
 
-	for (int i = 0; i < num_names - 1; i++) {
-		//if token is not a directory return error
-		if (!S_ISDIR(inodes[inode_idx].mode)) {
-			free_char_ptr_array(names, num_names);
-			return -ENOTDIR;
-		}
-		//lookup and record inode
-		inode_idx = lookup(inode_idx, names[i]);
-		if (inode_idx < 0) {
-			free_char_ptr_array(names, num_names);
-			return -ENOENT;
-		}
+/**
+ * Journal credits for freeing blocks of a file with fs_free_tail:
+ * the block map blocks it may change, the indirect, double indirect
+ * and second level pointer blocks left partly used, and the inode.
+ */
+static int free_credits(void)
+{
+	int maps = inode_base - block_map_base;
+	return (maps < HANDLE_BLKS ? maps : HANDLE_BLKS) + 4;
+}
+
+/**
+ * Whether any metadata is waiting to be written.
+ */
+static bool metadata_pending(void)
+{
+	lock_mutex(&meta_lock, &meta_stats);
+	bool pending = n_dirty > 0 || journal_pending() > 0;
+	pthread_mutex_unlock(&meta_lock);
+	return pending;
+}
+
+/**
+ * Write a directory or pointer block. With a journal the block is
+ * logged and reaches the disk at the next commit; the handle it is
+ * written under has reserved room for it. A device error, or a full
+ * transaction, is returned by the next flush of the metadata.
+ *
+ * @param blk: the block number
+ * @param buf: the block contents
+ */
+static void meta_write(int blk, void *buf)
+{
+	lock_mutex(&meta_lock, &meta_stats);
+	if (!journal_active()) {
+		if (disk->ops->write(disk, blk, 1, buf) < 0) meta_err = -EIO;
+	} else if (journal_log(blk, buf) < 0) {
+		meta_err = -EIO;
 	}
-	strcpy(leaf, names[num_names - 1]);
-	free_char_ptr_array(names, num_names);
-	return inode_idx;
+	pthread_mutex_unlock(&meta_lock);
 }
 
 /**
- * Flush dirty metadata blocks to disk.
+ * Mark a resident metadata block as dirty.
+ *
+ * @param blk: the block number
+ * @param mem: the in-memory copy of the block
  */
-void flush_metadata(void)
+static void mark_dirty(int blk, void *mem)
 {
-	int i;
-	for (i = 0; i < dirty_len; i++) {
-		if (dirty[i]) {
-			disk->ops->write(disk, i, 1, dirty[i]);
-			dirty[i] = NULL;
+	if (dirty[blk] == NULL) n_dirty++;
+	dirty[blk] = mem;
+}
+
+/**
+ * Set or clear a bit in a bitmap, note the change in the summary of
+ * the map, and mark the block of the map that holds it as dirty.
+ * Called with alloc_lock held.
+ *
+ * @param map: the in-memory bitmap
+ * @param map_base: block number of the first block of the map
+ * @param bit: the bit number
+ * @param set: true to set the bit, false to clear it
+ */
+static void map_update(fd_set *map, int map_base, int bit, bool set)
+{
+	int blk = bit >> (block_shift + 3);
+	char *mem = (char*) map + blk * block_size;
+	lock_mutex(&meta_lock, &meta_stats);
+	if (map == inode_map && grouped) {
+		//the group's own inode map block is what goes to disk
+		blk = bit / inodes_per_group;
+		mem = group_imaps + blk * block_size;
+		if (set) {
+			bitmap_set(mem, bit % inodes_per_group);
+		} else {
+			bitmap_clear(mem, bit % inodes_per_group);
 		}
 	}
+	if (set) {
+		bitmap_set(map, bit);
+	} else {
+		bitmap_clear(map, bit);
+		//a logged copy must not overwrite the block once it is reused
+		if (map == block_map && journal_active()) journal_forget(bit);
+	}
+	bitmap_summary_update(map == block_map ? block_sum : inode_sum, bit);
+	mark_dirty(map_base + blk, mem);
+	pthread_mutex_unlock(&meta_lock);
 }
 
 /**
@@ -267,32 +767,87 @@ void flush_metadata(void)
  * @return number of free blocks
  */
 int num_free_blk() {
-	int count = 0;
-	for (int i = 0; i < n_blocks; i++) {
-		if (!FD_ISSET(i, block_map)) {
-			count++;
+	lock_mutex(&alloc_lock, &alloc_stats);
+	int n = n_free_blks - n_reserved;
+	pthread_mutex_unlock(&alloc_lock);
+	return n;
+}
+
+/**
+ * Allocate a run of up to n free blocks that are contiguous on disk.
+ *
+ * A file growing in place continues at goal if that block is free.
+ * Otherwise the run starts a new extent, searched for from the end
+ * of the last one in the block group of goal: the search is for
+ * window free blocks in a row,
+ * so that the file has room to keep growing there, settling for
+ * shorter extents if there are none. The next search starts after
+ * the whole extent, so other files do not take the room left for
+ * this one. Blocks reserved for held blocks are not handed out.
+ *
+ * @param goal: block number to try first, or 0 for no preference
+ * @param n: the number of blocks wanted
+ * @param window: length of extent to look for if goal is not free, at least n
+ * @param nrun: set to the number of blocks allocated, 1 to n
+ * @return the first block of the run, or -ENOSPC if none available
+ */
+static int get_free_run(int goal, int n, int window, int *nrun)
+{
+	lock_mutex(&alloc_lock, &alloc_stats);
+	int *hint = &blk_hints[(goal > 0 && goal < n_blocks) ? goal / blocks_per_group : 0];
+	int start = -1;
+	if (n > n_free_blks - n_reserved) {
+		n = n_free_blks - n_reserved;
+	}
+	if (n <= 0) {
+		//the free blocks left are reserved for held blocks
+	} else if (goal > 0 && goal < n_blocks && !bitmap_test(block_map, goal)) {
+		start = goal;
+	} else {
+		for (int w = window; start < 0 && w > 0; w /= 2) {
+			start = bitmap_summary_find_zero_run(block_sum, *hint, w);
+			if (start < 0) start = bitmap_summary_find_zero_run(block_sum, 0, w);
+			if (start >= 0) *hint = start + w;
 		}
 	}
-	return count;
+	int len = 0;
+	if (start >= 0) {
+		while (len < n && start + len < n_blocks && !bitmap_test(block_map, start + len)) {
+			map_update(block_map, block_map_base, start + len, true);
+			len++;
+		}
+		n_free_blks -= len;
+		if (*hint > start && *hint < start + len) *hint = start + len;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	*nrun = len;
+	return start >= 0 ? start : -ENOSPC;
 }
 
 /**
  * Returns a free block number or -ENOSPC if none available.
  *
+ * The block at goal is taken if free, normally the block after the
+ * previous block of the same file so that files stay contiguous.
+ * Otherwise the search resumes after the last extent allocated
+ * instead of rescanning the full part of the map from block 0.
+ *
+ * @param goal: block number to try first, or 0 for no preference
+ * @param zero: true to write zeros to the block, false if the caller
+ *   will write the whole block itself
  * @return free block number or -ENOSPC if none available
  */
-static int get_free_blk(void)
+static int get_free_blk(int goal, bool zero)
 {
-	for (int i = 0; i < n_blocks; i++) {
-		if (!FD_ISSET(i, block_map)) {
-			char buff[BLOCK_SIZE];
-			memset(buff, 0, BLOCK_SIZE);
-			if (disk->ops->write(disk, i, 1, buff) < 0) exit(1);
-			FD_SET(i, block_map);
-			return i;
-		}
+	int n;
+	int i = get_free_run(goal, 1, 1, &n);
+	if (i < 0) return -ENOSPC;
+	if (zero) {
+		char buff[block_size];
+		memset(buff, 0, block_size);
+		meta_write(i, buff);
 	}
-	return -ENOSPC;
+	return i;
 }
 
 /**
@@ -302,47 +857,126 @@ static int get_free_blk(void)
  */
 static void return_blk(int blkno)
 {
-	FD_CLR(blkno, block_map);
+	lock_mutex(&alloc_lock, &alloc_stats);
+	if (bitmap_test(block_map, blkno)) {
+		map_update(block_map, block_map_base, blkno, false);
+		n_free_blks++;
+	}
+	pthread_mutex_unlock(&alloc_lock);
 }
 
-static void update_blk(void)
+/**
+ * Choose the inode group for a new directory, in the manner of the
+ * Orlov allocator. Directories made in the root are spread out: each
+ * goes in the group with the fewest directories of those with at
+ * least the average number of free inodes, so unrelated trees start
+ * far apart. Other directories stay in their parent's group, or the
+ * next group after it, that has neither too many directories nor
+ * too few free inodes, so a tree stays together. Called with
+ * alloc_lock held.
+ *
+ * @param parent: the parent directory inode number
+ * @return the group number
+ */
+static int dir_group(int parent)
 {
-	if (disk->ops->write(disk, block_map_base, inode_base - block_map_base, block_map) < 0)
-		exit(1);
+	int avg_free = n_free_inodes / n_igroups;
+	int pg = parent / inodes_per_group;
+
+	if (parent == root_inode) {
+		int best = -1;
+		for (int k = 0; k < n_igroups; k++) {
+			int g = (dir_rotor + k) % n_igroups;
+			struct inode_group *ig = &igroups[g];
+			if (ig->free == 0 || ig->free < avg_free) continue;
+			if (best < 0 || ig->dirs < igroups[best].dirs) best = g;
+		}
+		if (best >= 0) {
+			dir_rotor = (best + 1) % n_igroups;
+			return best;
+		}
+		return pg;
+	}
+
+	int max_dirs = n_dirs / n_igroups + inodes_per_group / 16;
+	int min_free = avg_free - inodes_per_group / 4;
+	for (int k = 0; k < n_igroups; k++) {
+		int g = (pg + k) % n_igroups;
+		struct inode_group *ig = &igroups[g];
+		if (ig->free > 0 && ig->free >= min_free && ig->dirs < max_dirs) return g;
+	}
+	return pg;
 }
 
 /**
  * Returns a free inode number
  *
+ * A file's inode is the first free one after its directory's inode,
+ * so that the inodes of a directory share few inode blocks. A
+ * directory's inode is the first free one in the group chosen by
+ * dir_group. Either search wraps around the end of the inode map.
+ *
+ * @param parent: inode number of the directory the inode goes in
+ * @param dir: true if the inode is for a directory
  * @return a free inode number or -ENOSPC if none available
  */
-static int get_free_inode(void)
+static int get_free_inode(int parent, bool dir)
 {
-	for (int i = 2; i < n_inodes; i++) {
-		if (!FD_ISSET(i, inode_map)) {
-			FD_SET(i, inode_map);
-			return i;
+	int inum = -ENOSPC;
+	lock_mutex(&alloc_lock, &alloc_stats);
+	int goal = dir ? dir_group(parent) * inodes_per_group : parent;
+	int i = bitmap_summary_find_zero(inode_sum, goal);
+	//inodes 0 and 1 are never handed out
+	if (i >= 0 && i < 2) i = bitmap_summary_find_zero(inode_sum, 2);
+	if (i >= 2) {
+		map_update(inode_map, inode_map_base, i, true);
+		n_free_inodes--;
+		igroups[i / inodes_per_group].free--;
+		if (dir) {
+			igroups[i / inodes_per_group].dirs++;
+			n_dirs++;
 		}
+		inum = i;
 	}
-	return -ENOSPC;
+	pthread_mutex_unlock(&alloc_lock);
+	return inum;
 }
 
 /**
  * Return an inode to the free list.
  *
  * @param  inum the inode number
+ * @param  dir true if the inode was a directory
  */
-static void return_inode(int inum)
+static void return_inode(int inum, bool dir)
 {
-	FD_CLR(inum, inode_map);
+	lock_mutex(&alloc_lock, &alloc_stats);
+	if (bitmap_test(inode_map, inum)) {
+		map_update(inode_map, inode_map_base, inum, false);
+		n_free_inodes++;
+		igroups[inum / inodes_per_group].free++;
+		if (dir) {
+			igroups[inum / inodes_per_group].dirs--;
+			n_dirs--;
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
 }
 
+/**
+ * Mark the block holding an inode as dirty, with old_size, the size
+ * older binaries read, brought in line with size. Called under a
+ * journal handle.
+ *
+ * @param inum the inode number
+ */
 static void update_inode(int inum)
 {
-	if (disk->ops->write(disk, inode_base + inum / INODES_PER_BLK, 1, &inodes[inum - (inum % INODES_PER_BLK)]) < 0)
-		exit(1);
-	if (disk->ops->write(disk, inode_map_base, block_map_base - inode_map_base, inode_map) < 0)
-		exit(1);
+	struct fs_inode *inode = &inodes[inum];
+	lock_mutex(&meta_lock, &meta_stats);
+	inode->old_size = (inode->size > INT32_MAX) ? INT32_MAX : inode->size;
+	mark_dirty(inode_base + inum / inodes_per_blk, &inodes[inum - (inum % inodes_per_blk)]);
+	pthread_mutex_unlock(&meta_lock);
 }
 
 /**
@@ -353,7 +987,7 @@ static void update_inode(int inum)
  */
 static int find_free_dir(struct fs_dirent *de)
 {
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+	for (int i = 0; i < dirents_per_blk; i++) {
 		if (!de[i].valid) {
 			return i;
 		}
@@ -369,7 +1003,7 @@ static int find_free_dir(struct fs_dirent *de)
  */
 static int is_empty_dir(struct fs_dirent *de)
 {
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+	for (int i = 0; i < dirents_per_blk; i++) {
 		if (de[i].valid) {
 			return 0;
 		}
@@ -378,1109 +1012,4289 @@ static int is_empty_dir(struct fs_dirent *de)
 }
 
 /**
- * Copy stat from inode to sb
- * @param inode inode to be copied from
- * @param sb holder to hold copied stat
- * @param inode_idx inode_idx
+ * Free blocks needed to write back a number of held blocks: the
+ * blocks themselves and the pointer blocks they may need.
+ *
+ * @param nheld: the number of held blocks
+ * @return the number of free blocks
  */
-static void cpy_stat(struct fs_inode *inode, struct stat *sb) {
-	memset(sb, 0, sizeof(*sb));
-	sb->st_uid = inode->uid;
-	sb->st_gid = inode->gid;
-	sb->st_mode = (mode_t) inode->mode;
-	sb->st_atime = inode->mtime;
-	sb->st_ctime = inode->ctime;
-	sb->st_mtime = inode->mtime;
-	sb->st_size = inode->size;
-	sb->st_blksize = FS_BLOCK_SIZE;
-	sb->st_nlink = 1;
-	sb->st_blocks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+static int held_need(int nheld)
+{
+	return nheld == 0 ? 0 : nheld + nheld / ptrs_per_blk + 2;
 }
 
-/*
- * CS492: FUSE functions to implement are below.
-*/
-
 /**
- * init - this is called once by the FUSE framework at startup.
+ * Reserve free blocks for writing back the held blocks of an open
+ * inode once n more blocks are held.
  *
- * This is a good place to read in the super-block and set up any
- * global variables you need. You don't need to worry about the
- * argument or the return value.
+ * @param bc: the block map cache of the inode
+ * @param n: the number of blocks about to be held
+ * @return true if reserved, false if there are not enough free blocks
+ */
+static bool held_reserve(struct bmap_cache *bc, int n)
+{
+	int need = held_need(bc->nheld + n) - bc->reserved;
+	if (need <= 0) return true;
+	lock_mutex(&alloc_lock, &alloc_stats);
+	bool ok = (n_free_blks - n_reserved >= need);
+	if (ok) n_reserved += need;
+	pthread_mutex_unlock(&alloc_lock);
+	if (ok) bc->reserved += need;
+	return ok;
+}
+
+/**
+ * Give back the free blocks reserved for the held blocks of an inode.
  *
- * @param conn: fuse connection information - unused
- * @return: unused - returns NULL
+ * @param bc: the block map cache of the inode
+ */
+static void held_unreserve(struct bmap_cache *bc)
+{
+	lock_mutex(&alloc_lock, &alloc_stats);
+	n_reserved -= bc->reserved;
+	pthread_mutex_unlock(&alloc_lock);
+	bc->reserved = 0;
+}
+
+/**
+ * Find a held block of an inode.
  *
- * Note: if any block read operation fails, just exit(1) immediately.
-*/
-void* fs_init(struct fuse_conn_info *conn)
+ * @param bc: the block map cache of the inode
+ * @param lblk: the logical block
+ * @return index of the block in bc->held, or -1 - the index it
+ *   would be inserted at if it is not held
+ */
+static int held_search(struct bmap_cache *bc, int lblk)
 {
-	// read the superblock
-	struct fs_super sb;
-	//first_blk is 0 (superblock), nblks is 1 (reading one block)
-	if(disk->ops->read(disk, 0, 1, &sb) < 0){
-		exit(1);
+	int lo = 0, hi = bc->nheld;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (bc->held[mid].lblk < lblk) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return (lo < bc->nheld && bc->held[lo].lblk == lblk) ? lo : -1 - lo;
+}
 
-	root_inode = sb.root_inode;
-
-	/* The inode map and block map are directly after the superblock */
+/**
+ * Get the data held for a block of an inode.
+ *
+ * @param bc: the block map cache of the inode, or NULL
+ * @param lblk: the logical block
+ * @return the data, or NULL if the block is not held
+ */
+static char *held_find(struct bmap_cache *bc, int lblk)
+{
+	if (bc == NULL || bc->nheld == 0) return NULL;
+	int i = held_search(bc, lblk);
+	return (i >= 0) ? bc->held[i].data : NULL;
+}
 
-	// read inode map
-	//CS492: your code below
-	inode_map_base = 1; // This is correct.
-	inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE); //allocate memory
-	if(disk->ops->read(disk, inode_map_base, sb.inode_map_sz, inode_map) < 0){ //reading, if fail exit(1)
-		exit(1);
+/**
+ * Get the data held for a block of an inode, holding the block as
+ * a block of zeros if it is not held yet.
+ *
+ * @param bc: the block map cache of the inode
+ * @param lblk: the logical block
+ * @return the data, or NULL if out of memory
+ */
+static char *held_get(struct bmap_cache *bc, int lblk)
+{
+	int i = held_search(bc, lblk);
+	if (i >= 0) return bc->held[i].data;
+	i = -1 - i;
+	if (bc->nheld == bc->held_cap) {
+		int cap = bc->held_cap ? 2 * bc->held_cap : 16;
+		struct held_blk *held = realloc(bc->held, cap * sizeof(struct held_blk));
+		if (held == NULL) return NULL;
+		bc->held = held;
+		bc->held_cap = cap;
 	}
+	char *data = calloc(1, block_size);
+	if (data == NULL) return NULL;
+	memmove(&bc->held[i + 1], &bc->held[i], (bc->nheld - i) * sizeof(struct held_blk));
+	bc->held[i].lblk = lblk;
+	bc->held[i].data = data;
+	if (bc->nheld++ == 0) bc->held_since = time(NULL);
+	__atomic_add_fetch(&n_held, 1, __ATOMIC_RELAXED);
+	return data;
+}
 
-	// read block map
-	//CS492: your code below
-	block_map_base = 1 + sb.inode_map_sz;
-	block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE); //allocate memory
-	if(disk->ops->read(disk, block_map_base, sb.block_map_sz, block_map) < 0){ //reading, if fail exit(1)
-		exit(1);
+/**
+ * Forget the first n held blocks of an inode.
+ *
+ * @param bc: the block map cache of the inode
+ * @param n: the number of blocks
+ */
+static void held_remove(struct bmap_cache *bc, int n)
+{
+	for (int i = 0; i < n; i++) {
+		free(bc->held[i].data);
 	}
-	
-	/* The inode data is in the next set of blocks */
-	//CS492: your code below
-	inode_base = block_map_base + sb.block_map_sz;
-	n_inodes = sb.inode_region_sz * INODES_PER_BLK; //calculating how many inodes there are
-	inodes = malloc(sb.inode_region_sz * FS_BLOCK_SIZE); //allocate memory
-	if(disk->ops->read(disk, inode_base, sb.inode_region_sz, inodes) < 0){ //reading, if fail exit(1)
-		exit(1);
+	memmove(bc->held, bc->held + n, (bc->nheld - n) * sizeof(struct held_blk));
+	bc->nheld -= n;
+	__atomic_sub_fetch(&n_held, n, __ATOMIC_RELAXED);
+	if (bc->nheld == 0) {
+		free(bc->held);
+		bc->held = NULL;
+		bc->held_cap = 0;
 	}
+}
 
+/**
+ * Find the block map cache of an inode.
+ *
+ * @param inode: the inode
+ * @return the cache, or NULL if the inode is not open
+ */
+static struct bmap_cache *bmap_find(struct fs_inode *inode)
+{
+	return bmaps[inode - inodes];
+}
 
-	// number of blocks on device
-	n_blocks = sb.num_blocks;
-
-	// dirty metadata blocks
-	dirty_len = inode_base + sb.inode_region_sz;
-	dirty = calloc(dirty_len*sizeof(void*), 1);
+/**
+ * Size of a file as written, counting its held blocks. Called with
+ * the inode locked.
+ *
+ * @param inode: the inode
+ * @return the size in bytes
+ */
+static off_t file_size(struct fs_inode *inode)
+{
+	struct bmap_cache *bc = bmap_find(inode);
+	return (bc != NULL && bc->size > inode->size) ? bc->size : inode->size;
+}
 
-	return NULL;
+/**
+ * Grow a file to a size if it is smaller. The size on disk in the
+ * inode only grows as far as the first held block, so that a commit
+ * before the held blocks are written back never leaves the file
+ * ending in blocks that were never written; held_writeback grows it
+ * the rest of the way. Called with the inode locked for writing.
+ *
+ * @param inum: the inode number
+ * @param size: the new size in bytes, or 0 to just catch up the size on disk
+ */
+static void file_grow(int inum, off_t size)
+{
+	struct fs_inode *inode = &inodes[inum];
+	struct bmap_cache *bc = bmaps[inum];
+	off_t disk_size = size;
+	if (bc != NULL) {
+		if (size > bc->size) bc->size = size;
+		disk_size = bc->size;
+		if (bc->nheld > 0 && ((off_t) bc->held[0].lblk << block_shift) < disk_size) {
+			disk_size = (off_t) bc->held[0].lblk << block_shift;
+		}
+	}
+	if (disk_size > inode->size) inode->size = disk_size;
 }
 
-/* Note on path translation errors:
- * In addition to the method-specific errors listed below, almost
- * every method can return one of the following errors if it fails to
- * locate a file or directory corresponding to a specified path.
+/**
+ * Attach a block map cache to an inode being opened, or count
+ * another open of an inode that already has one. Called with the
+ * inode locked for writing.
  *
- * ENOENT - a component of the path is not present.
- * ENOTDIR - an intermediate component of the path (e.g. 'b' in
- *           /a/b/c) is not a directory
+ * @param inum: the inode number
+ * @return 0 if successful, or -ENOMEM
  */
+static int bmap_attach(int inum)
+{
+	if (bmaps[inum] == NULL) {
+		bmaps[inum] = calloc(1, sizeof(struct bmap_cache) +
+				(BMAP_INDIR2_PTRS + ptrs_per_blk) * sizeof(uint32_t*));
+		if (bmaps[inum] == NULL) return -ENOMEM;
+	}
+	bmaps[inum]->refs++;
+	return 0;
+}
 
-/* note on splitting the 'path' variable:
- * the value passed in by the FUSE framework is declared as 'const',
- * which means you can't modify it. The standard mechanisms for
- * splitting strings in C (strtok, strsep) modify the string in place,
- * so you have to copy the string and then free the copy when you're
- * done. One way of doing this:
+/**
+ * Drop the cached pointer blocks and the held blocks of an inode,
+ * e.g. because its blocks have been freed.
  *
- *    char *_path = strdup(path);
- *    int inum = translate(_path);
- *    free(_path);
+ * @param inode: the inode
  */
+static void bmap_reset(struct fs_inode *inode)
+{
+	struct bmap_cache *bc = bmap_find(inode);
+	if (bc == NULL) return;
+	for (int i = 0; i < BMAP_INDIR2_PTRS + ptrs_per_blk; i++) {
+		free(bc->ptrs[i]);
+		bc->ptrs[i] = NULL;
+	}
+	if (bc->nheld > 0) held_remove(bc, bc->nheld);
+	held_unreserve(bc);
+	bc->size = 0;
+}
 
 /**
- * getattr - get file or directory attributes. For a description of
- * the fields in 'struct stat', see 'man lstat'.
+ * Free the block map cache of an inode, with any held blocks.
+ * Called with the inode locked for writing.
  *
- * Note: you can handle some fields as follows:
- * st_nlink: always set to 1
- * st_atime, st_ctime: set to same value as st_mtime
+ * @param inum: the inode number
+ */
+static void bmap_free(int inum)
+{
+	if (bmaps[inum] == NULL) return;
+	bmap_reset(&inodes[inum]);
+	free(bmaps[inum]);
+	bmaps[inum] = NULL;
+}
+
+/**
+ * Detach the block map cache from an inode being closed, freeing
+ * it when the last open is closed. Held blocks that could not be
+ * written back at the close keep the cache attached with no opens,
+ * so they are not lost; they are written back at the next fsync,
+ * sync or unmount, or dropped if the file is removed. Called with
+ * the inode locked for writing.
  *
- * @param path: the file path
- * @param sb: pointer to stat struct
+ * @param inum: the inode number
+ */
+static void bmap_detach(int inum)
+{
+	struct bmap_cache *bc = bmaps[inum];
+	if (bc == NULL || --bc->refs > 0) return;
+	if (bc->nheld > 0 && !(inodes[inum].flags & FS_INODE_ORPHAN)) return;
+	bmap_free(inum);
+}
+
+/**
+ * Wait until no reply still to be sent splices from the blocks of a
+ * file. Called with the inode locked for writing, so no new pins are
+ * taken.
  *
- * @return: 0 if successful, or -error number
- * 	-ENOENT  - a component of the path is not present
- *	-ENOTDIR - an intermediate component of path not a directory
-*/
-static int fs_getattr(const char *path, struct stat *sb)
+ * @param inum: the inode number
+ */
+static void wait_unpinned(int inum)
 {
-	fs_init(NULL);
+	lock_mutex(&open_lock, &open_stats);
+	while (bmaps[inum] != NULL && bmaps[inum]->pins > 0) {
+		pthread_cond_wait(&unpin_cond, &open_lock);
+	}
+	pthread_mutex_unlock(&open_lock);
+}
 
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	struct fs_inode* inode = &inodes[inode_idx];
-	cpy_stat(inode, sb);
-	return SUCCESS;
+/**
+ * Free all block map caches.
+ */
+static void bmap_purge(void)
+{
+	for (int i = 0; bmaps != NULL && i < n_inodes; i++) {
+		bmap_free(i);
+	}
+	free(bmaps);
+	bmaps = NULL;
 }
 
 /**
- * opendir - open file directory
- *
- * You can save information about the open directory in fi->fh.
- * If you allocate memory, free it in fs_releasedir.
- *
- * @param path: the file path
- * @param fi: fuse file system information
+ * A block of block pointers being looked at or changed. The pointers
+ * are either in buf or, for an open inode, in the cached copy.
+ */
+struct ptr_blk {
+	uint32_t blk; /* block number, 0 if none loaded */
+	uint32_t *ptrs; /* the pointers */
+	bool dirty; /* whether ptrs has changed since loaded */
+	uint32_t *buf; /* block buffer for the pointers if not cached */
+};
+
+/**
+ * Get a block of block pointers into pb, unless it is the one
+ * already there. An unallocated block reads as all zeros. Several
+ * readers of an inode may load the same cache slot at once, so
+ * slots are loaded under bmap_lock.
  *
- * @return: 0 if successful, or -error number
- *	-ENOENT  - a component of the path is not present
- *	-ENOTDIR - an intermediate component of path not a directory
-*/
-static int fs_opendir(const char *path, struct fuse_file_info *fi)
+ * @param blk: the pointer block number
+ * @param pb: the pointer block, updated
+ * @param slot: cache slot for the block, or NULL if not cached
+ */
+static void fs_read_ptrs(uint32_t blk, struct ptr_blk *pb, uint32_t **slot)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
-	fi->fh = (uint64_t) inode_idx;
-	return SUCCESS;
+	if (blk == pb->blk && pb->ptrs != NULL) return;
+	pb->blk = blk;
+	pb->ptrs = pb->buf;
+	if (blk == 0) {
+		memset(pb->buf, 0, ptrs_per_blk * sizeof(uint32_t));
+		return;
+	}
+	if (slot == NULL) {
+		meta_read(blk, pb->ptrs);
+		return;
+	}
+	lock_mutex(&bmap_lock, &bmap_stats);
+	if (*slot == NULL && (*slot = malloc(block_size)) != NULL) {
+		meta_read(blk, *slot);
+	}
+	if (*slot != NULL) {
+		pb->ptrs = *slot;
+	} else {
+		meta_read(blk, pb->ptrs);
+	}
+	pthread_mutex_unlock(&bmap_lock);
 }
 
 /**
- * readdir - get directory contents
- *
- * For each entry in the directory, invoke the 'filler' function,
- * which is passed as a function pointer, as follows:
- * filler(buf, <name>, <statbuf>, 0)
- * where <statbuf> is a struct stat, just like in getattr.
+ * Get the cache slot for a pointer block of an inode.
  *
- * @param path: the directory path
- * @param ptr: filler buf pointer
- * @param filler filler function to call for each entry
- * @param offset: the file offset -- unused
- * @param fi: the fuse file information -- you do not have to use it
+ * @param bc: the block map cache of the inode, or NULL
+ * @param i: the slot number
+ * @return the slot, or NULL if the inode has no cache
+ */
+static uint32_t **bmap_slot(struct bmap_cache *bc, int i)
+{
+	return bc ? &bc->ptrs[i] : NULL;
+}
+
+/**
+ * Map a range of logical blocks of a file to physical blocks.
+ * Each indirect block on the way is read at most once, and not at
+ * all if the inode is open and the block is in its block map cache.
  *
- * @return: 0 if successful, or -error number
- * 	-ENOENT  - a component of the path is not present
- * 	-ENOTDIR - an intermediate component of path not a directory
-*/
-static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+ * @param inode: the file inode
+ * @param first: the first logical block
+ * @param n: the number of logical blocks
+ * @param blks: array for the n physical block numbers, 0 if not allocated
+ */
+static void fs_bmap(struct fs_inode *inode, int first, int n, uint32_t *blks)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	if (!S_ISDIR(inode->mode)) return -ENOTDIR;
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	struct stat sb;
-	if (disk->ops->read(disk, inode->direct[0], 1, entries) < 0) exit(1);
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (entries[i].valid) {
-			cpy_stat(&inodes[entries[i].inode], &sb);
-			filler(ptr, entries[i].name, &sb, 0);
+	struct bmap_cache *bc = bmap_find(inode);
+	uint32_t buf1[ptrs_per_blk], buf2[ptrs_per_blk];
+	struct ptr_blk indir1 = { .buf = buf1 }, indir2 = { .buf = buf2 };
+
+	for (int i = 0; i < n; i++) {
+		int lblk = first + i;
+		if (lblk < N_DIRECT) {
+			blks[i] = inode->direct[lblk];
+			continue;
+		}
+		lblk -= N_DIRECT;
+		if (lblk < ptrs_per_blk) {
+			fs_read_ptrs(inode->indir_1, &indir1, bmap_slot(bc, BMAP_INDIR1));
+			blks[i] = indir1.ptrs[lblk];
+			continue;
+		}
+		lblk -= ptrs_per_blk;
+		if (lblk < ptrs_per_blk * ptrs_per_blk) {
+			fs_read_ptrs(inode->indir_2, &indir2, bmap_slot(bc, BMAP_INDIR2));
+			int k = lblk >> ptrs_shift;
+			fs_read_ptrs(indir2.ptrs[k], &indir1, bmap_slot(bc, BMAP_INDIR2_PTRS + k));
+			blks[i] = indir1.ptrs[lblk & (ptrs_per_blk - 1)];
+		} else {
+			blks[i] = 0;
 		}
 	}
-	return SUCCESS;
 }
 
 /**
- * Release resources when directory is closed.
- * If you allocate memory in fs_opendir, free it here.
+ * Write back a block of block pointers.
  *
- * @param path: the directory path
- * @param fi: fuse file system information -- you do not have to use it
- *
- * @return: 0 if successful, or -error number
- *	-ENOENT  - a component of the path is not present
- *	-ENOTDIR - an intermediate component of path not a directory
-*/
-static int fs_releasedir(const char *path, struct fuse_file_info *fi)
+ * @param pb: the pointer block
+ */
+static void fs_write_ptrs(struct ptr_blk *pb)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
-	fi->fh = (uint64_t) -1;
-	return SUCCESS;
+	meta_write(pb->blk, pb->ptrs);
+	pb->dirty = false;
 }
 
-static int set_attributes_and_update(struct fs_dirent *de, char *name, mode_t mode, bool isDir)
+/**
+ * Get the pointer block that a pointer refers to, allocating it
+ * if the pointer is 0. Writes back the block currently in pb
+ * first if it has changed.
+ *
+ * @param ptr: pointer to the pointer block number, updated on allocation
+ * @param pb: the pointer block, updated
+ * @param slot: cache slot for the block, or NULL if not cached
+ * @param goal: block number to try first when allocating
+ * @return 0 if successful, or -ENOSPC
+ */
+static int fs_get_ptrs(uint32_t *ptr, struct ptr_blk *pb, uint32_t **slot, int goal)
 {
-	//get free directory and inode
-	int freed = find_free_dir(de);
-	int freei = get_free_inode();
-	int freeb = isDir ? get_free_blk() : 0;
-	if (freed < 0 || freei < 0 || freeb < 0) return -ENOSPC;
-	struct fs_dirent *dir = &de[freed];
-	struct fs_inode *inode = &inodes[freei];
-	strcpy(dir->name, name);
-	dir->inode = freei;
-	dir->valid = true;
-	inode->uid = getuid();
-	inode->gid = getgid();
-	inode->mode = mode;
-	inode->ctime = inode->mtime = time(NULL);
-	inode->size = 0;
-	inode->direct[0] = freeb;
-	//update map and inode
-	update_inode(freei);
-	update_blk();
-	return SUCCESS;
+	if (*ptr != 0 && *ptr == pb->blk) return 0;
+	if (pb->dirty) fs_write_ptrs(pb);
+	if (*ptr == 0) {
+		//new pointer block is written from memory, no need to zero it on disk
+		int freeb = get_free_blk(goal, false);
+		if (freeb < 0) return -ENOSPC;
+		*ptr = freeb;
+		pb->ptrs = pb->buf;
+		if (slot != NULL && (*slot = malloc(block_size)) != NULL) {
+			pb->ptrs = *slot;
+		}
+		memset(pb->ptrs, 0, ptrs_per_blk * sizeof(uint32_t));
+		pb->blk = *ptr;
+		pb->dirty = true;
+		return 0;
+	}
+	fs_read_ptrs(*ptr, pb, slot);
+	return 0;
 }
 
 /**
- * mknod - create a new regular file with permissions (mode & 01777).
- * Behavior undefined when mode bits other than the low 9 bits are used.
+ * Map a range of logical blocks of a file to physical blocks,
+ * allocating data and indirect blocks that do not exist yet. New
+ * data blocks are allocated as extents: each goes after the block
+ * before it in the file if possible, and otherwise a new extent is
+ * sized to the rest of the range or, for a file that has grown
+ * larger than that, to the file, so files growing by doubling get
+ * doubling extents. A caller that knows how far the file will grow
+ * can ask for a larger extent instead. Blocks of the last extent
+ * that the range did not need are freed again. A new pointer block
+ * is placed past the extent and the room the file is expected to
+ * grow into, so it does not split the data it maps.
  *
- * @param path: the file path
- * @param mode: indicating block or character-special file
- * @param dev: the character or block I/O device specification - you do not have to use it
+ * New data blocks are not zeroed on disk; they are flagged in
+ * fresh so the caller writes them in full. Pointer blocks of an
+ * open inode are changed in its block map cache and written through.
  *
- * @return: 0 if successful, or -error number
- * 	-ENOTDIR  - component of path not a directory
- * 	-EEXIST   - file already exists
- * 	-ENOSPC   - free inode not available
- * 	-ENOSPC   - results in >32 entries in directory
-*/
-static int fs_mknod(const char *path, mode_t mode, dev_t dev)
+ * @param inode: the file inode
+ * @param first: the first logical block
+ * @param n: the number of logical blocks
+ * @param blks: array for the n physical block numbers
+ * @param fresh: array of n flags, true if the block was just allocated
+ * @param extent: number of blocks from first the file will soon have,
+ *   to size new extents by, or 0 to size them to the range and the file
+ * @return number of blocks mapped, less than n if out of space
+ */
+static int fs_balloc(struct fs_inode *inode, int first, int n, uint32_t *blks, bool *fresh,
+		int extent)
 {
-	//get current and parent inodes
-	mode |= S_IFREG;
-	if (!S_ISREG(mode) || strcmp(path, "/") == 0) return -EINVAL;
-	char *_path = strdup(path);
-	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
-	int parent_inode_idx = translate_1(_path, name);
-	if (inode_idx >= 0) return -EEXIST;
-	if (parent_inode_idx < 0) return parent_inode_idx;
-	//read parent info
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+	struct bmap_cache *bc = bmap_find(inode);
+	uint32_t buf1[ptrs_per_blk], buf2[ptrs_per_blk];
+	struct ptr_blk indir1 = { .buf = buf1 }, indir2 = { .buf = buf2 };
+	int size_blks = (file_size(inode) + block_size - 1) >> block_shift;
+
+	//start next to the block before the range, or in the inode's group
+	uint32_t goal = 0;
+	if (first > 0) {
+		fs_bmap(inode, first - 1, 1, &goal);
+		if (goal != 0) goal++;
+	}
+	if (goal == 0 && grouped) goal = group_data(inode_bgroup(inode - inodes));
 
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	//assign inode and directory and update
-	int res = set_attributes_and_update(entries, name, mode, false);
-	if (res < 0) return res;
+	//the extent being handed out
+	int ext_next = 0, ext_left = 0;
 
-	//write entries buffer into disk
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	return SUCCESS;
+	int i;
+	for (i = 0; i < n; i++) {
+		int lblk = first + i;
+		int room = size_blks < ALLOC_MAX_WINDOW ? size_blks : ALLOC_MAX_WINDOW;
+		int window = (extent > 0) ? extent - i : room;
+		if (window < n - i) window = n - i;
+
+		//new pointer blocks go past the room the data grows into, not at goal
+		uint32_t ptr_goal = 0;
+		if (ext_left > 0) {
+			ptr_goal = ext_next + ext_left + room;
+		} else if (goal != 0) {
+			ptr_goal = goal + window + room;
+		}
+		if (ptr_goal >= (uint32_t) n_blocks) ptr_goal = 0;
+
+		uint32_t *ptr;
+		bool *ptr_dirty = &indir1.dirty;
+		if (lblk < N_DIRECT) {
+			ptr = &inode->direct[lblk];
+			ptr_dirty = NULL; //inode is written by caller
+		} else if ((lblk -= N_DIRECT) < ptrs_per_blk) {
+			if (fs_get_ptrs(&inode->indir_1, &indir1, bmap_slot(bc, BMAP_INDIR1), ptr_goal) < 0) break;
+			ptr = &indir1.ptrs[lblk];
+		} else if ((lblk -= ptrs_per_blk) < ptrs_per_blk * ptrs_per_blk) {
+			uint32_t old2 = inode->indir_2;
+			if (fs_get_ptrs(&inode->indir_2, &indir2, bmap_slot(bc, BMAP_INDIR2), ptr_goal) < 0) break;
+			if (inode->indir_2 != old2) ptr_goal = inode->indir_2 + 1;
+			int k = lblk >> ptrs_shift;
+			uint32_t *ptr2 = &indir2.ptrs[k];
+			uint32_t old = *ptr2;
+			if (fs_get_ptrs(ptr2, &indir1, bmap_slot(bc, BMAP_INDIR2_PTRS + k), ptr_goal) < 0) break;
+			if (*ptr2 != old) indir2.dirty = true;
+			ptr = &indir1.ptrs[lblk & (ptrs_per_blk - 1)];
+		} else {
+			break; //past maximum file size
+		}
+
+		fresh[i] = (*ptr == 0);
+		if (fresh[i]) {
+			if (ext_left == 0) {
+				//a file that grew up to its own pointer block steps over it
+				while (goal != 0 && (goal == inode->indir_1 || goal == inode->indir_2 ||
+						goal == indir1.blk)) {
+					goal++;
+				}
+				ext_next = get_free_run(goal, n - i, window, &ext_left);
+				if (ext_next < 0) {
+					ext_left = 0;
+					break;
+				}
+			}
+			*ptr = ext_next++;
+			ext_left--;
+			if (ptr_dirty != NULL) *ptr_dirty = true;
+		}
+		blks[i] = *ptr;
+		goal = blks[i] + 1;
+	}
+
+	if (indir1.dirty) fs_write_ptrs(&indir1);
+	if (indir2.dirty) fs_write_ptrs(&indir2);
+	while (ext_left-- > 0) {
+		return_blk(ext_next++);
+	}
+	return i;
 }
 
 /**
- * mkdir - create a directory with the given mode. Behavior undefined
- * when mode bits other than the low 9 bits are used.
- *
- * @param path: path to directory
- * @param mode: the mode for the new directory
+ * Write back the held blocks of an open inode. Disk blocks for each
+ * run of consecutive held blocks are allocated as one extent, so a
+ * file written in many small pieces still gets contiguous blocks,
+ * and each run of contiguous blocks is written with one device write
+ * per HELD_WRITE_BLKS blocks, each under a journal handle of its own
+ * that also grows the file over them. The held blocks of a removed
+ * file are left alone, since they are dropped with it. The block map
+ * cache of a closed file that only stayed for its held blocks is
+ * freed once they are all written. Called with the inode locked for
+ * writing and no handle open.
  *
+ * @param inum: the inode number
  * @return: 0 if successful, or -error number
- * 	-ENOTDIR  - component of path not a directory
- * 	-EEXIST   - file already exists
- * 	-ENOSPC   - free inode not available
- * 	-ENOSPC   - results in >32 entries in directory
+ *	-ENOMEM  - no buffer for the writes
+ *	-ENOSPC  - out of space; the blocks not written stay held
+ */
+static int held_writeback(int inum)
+{
+	struct fs_inode *inode = &inodes[inum];
+	struct bmap_cache *bc = bmaps[inum];
+	if (bc == NULL || bc->nheld == 0 || (inode->flags & FS_INODE_ORPHAN)) return SUCCESS;
+	char *buf = malloc(HELD_WRITE_BLKS * block_size);
+	if (buf == NULL) return -ENOMEM;
+
+	//the blocks allocated below are the ones reserved
+	held_unreserve(bc);
+	int res = SUCCESS;
+	while (bc->nheld > 0) {
+		int run = 1;
+		while (run < bc->nheld && bc->held[run].lblk == bc->held[0].lblk + run) {
+			run++;
+		}
+		int n = run < HELD_WRITE_BLKS ? run : HELD_WRITE_BLKS;
+		uint32_t blks[n];
+		bool fresh[n];
+		handle_begin(map_credits(n));
+		int nmapped = fs_balloc(inode, bc->held[0].lblk, n, blks, fresh, run);
+		for (int i = 0, k; i < nmapped; i += k) {
+			memcpy(buf, bc->held[i].data, block_size);
+			for (k = 1; i + k < nmapped && blks[i + k] == blks[i] + k; k++) {
+				memcpy(buf + k * block_size, bc->held[i + k].data, block_size);
+			}
+			if (disk->ops->write(disk, blks[i], k, buf) < 0) exit(1);
+		}
+		if (nmapped > 0) held_remove(bc, nmapped);
+		file_grow(inum, 0);
+		update_inode(inum);
+		handle_end(map_credits(n));
+		if (nmapped < n) {
+			res = -ENOSPC;
+			break;
+		}
+	}
+	free(buf);
+	if (bc->nheld > 0) held_reserve(bc, 0);
+	if (bc->refs == 0 && bc->nheld == 0) bmap_free(inum);
+	return res;
+}
+
+/**
+ * Write back the held blocks of all open inodes, or of those that
+ * have held blocks for a while. Each inode is looked at with its lock
+ * held, since other threads may be writing to it.
  *
- * Note: fs_mkdir is the same as fs_mknod except that fs_mknod creates
- * a regular file while fs_mkdir creates a directory.  See also the
- * last argument of set_attributes_and_update.
-*/
-static int fs_mkdir(const char *path, mode_t mode)
+ * @param age: seconds an inode's blocks must have been held for, 0
+ *   to write back all of them
+ * @return the number of inodes whose blocks were written back
+ */
+static int held_writeback_all(int age)
 {
-	//CS492: your code here
-	//get current and parent inodes
-	mode |= S_IFDIR;
-	if (!S_ISDIR(mode) || strcmp(path, "/") == 0) return -EINVAL;
-	char *_path = strdup(path);
-	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
-	int parent_inode_idx = translate_1(_path, name);
-	if (inode_idx >= 0) return -EEXIST;
-	if (parent_inode_idx < 0) return parent_inode_idx;
-	//read parent info
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+	int n = 0;
+	if (__atomic_load_n(&n_held, __ATOMIC_RELAXED) == 0) return 0;
+	for (int i = 0; bmaps != NULL && i < n_inodes; i++) {
+		inode_lock(i, true);
+		struct bmap_cache *bc = bmaps[i];
+		if (bc != NULL && bc->nheld > 0 && time(NULL) - bc->held_since >= age) {
+			held_writeback(i);
+			n++;
+		}
+		inode_unlock(i);
+	}
+	return n;
+}
 
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	//assign inode and directory and update
-	int res = set_attributes_and_update(entries, name, mode, true);
-	if (res < 0) return res;
+/**
+ * The flusher thread: every FLUSH_CHECK seconds, write back the
+ * blocks that files have held for FLUSH_INTERVAL, and commit the
+ * metadata if it has waited as long or the held blocks were just
+ * written back, so that writes reach the disk
+ * even when no later operation comes along to push them out. It
+ * takes ns_lock for reading, as the entry points do.
+ *
+ * @param arg: unused
+ * @return: NULL
+ */
+static void *fs_flusher(void *arg)
+{
+	lock_mutex(&meta_lock, &meta_stats);
+	while (!flusher_stopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += FLUSH_CHECK;
+		pthread_cond_timedwait(&flusher_wake, &meta_lock, &until);
+		if (flusher_stopping) break;
+		pthread_mutex_unlock(&meta_lock);
+
+		lock_read(&ns_lock, &ns_stats);
+		int written = held_writeback_all(FLUSH_INTERVAL);
+		pthread_rwlock_unlock(&ns_lock);
+
+		lock_mutex(&meta_lock, &meta_stats);
+		bool due = written > 0 || time(NULL) - last_flush >= FLUSH_INTERVAL;
+		if ((n_dirty > 0 || journal_pending() > 0) && due && commit_locked() < 0) {
+			//the next fsync or unmount returns the error
+			meta_err = -EIO;
+		}
+	}
+	pthread_mutex_unlock(&meta_lock);
+	return NULL;
+}
 
-	//write entries buffer into disk
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	return SUCCESS;
+/**
+ * Start the flusher thread.
+ */
+static void flusher_start(void)
+{
+	flusher_stopping = false;
+	flusher_running = (pthread_create(&flusher, NULL, fs_flusher, NULL) == 0);
 }
 
-static void fs_truncate_dir(uint32_t *de) {
-	for (int i = 0; i < N_DIRECT; i++) {
-		if (de[i]) return_blk(de[i]);
-		de[i] = 0;
-	}
+/**
+ * Stop the flusher thread, if it is running.
+ */
+static void flusher_stop(void)
+{
+	if (!flusher_running) return;
+	lock_mutex(&meta_lock, &meta_stats);
+	flusher_stopping = true;
+	pthread_cond_signal(&flusher_wake);
+	pthread_mutex_unlock(&meta_lock);
+	pthread_join(flusher, NULL);
+	flusher_running = false;
 }
 
-static void fs_truncate_indir1(int blk_num) {
-	uint32_t entries[PTRS_PER_BLK];
-	memset(entries, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0)
-		exit(1);
-	//clear each blk and wipe from blk_map
-	for (int i = 0; i < PTRS_PER_BLK; i++) {
-		if (entries[i]) return_blk(entries[i]);
-		entries[i] = 0;
+/**
+ * Hash a directory entry name for the directory index (FNV-1a).
+ *
+ * @param name: the entry name
+ * @return the hash
+ */
+static uint32_t dx_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char*) name; *p; p++) {
+		h = (h ^ *p) * 16777619u;
 	}
+	return h;
 }
 
-static void fs_truncate_indir2(int blk_num) {
-	uint32_t entries[PTRS_PER_BLK];
-	memset(entries, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0)
-		exit(1);
-	//clear each double link
-	for (int i = 0; i < PTRS_PER_BLK; i++) {
-		if (entries[i]) fs_truncate_indir1(entries[i]);
-		entries[i] = 0;
+/**
+ * Find the index entry covering a hash in an index node.
+ *
+ * @param node: the index node
+ * @param hash: the name hash
+ * @return position of the last entry whose hash is <= hash
+ */
+static int dx_search(struct fs_dx_node *node, uint32_t hash)
+{
+	int lo = 1, hi = node->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (node->entries[mid].hash <= hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return lo - 1;
 }
 
 /**
- * truncate - truncate file to exactly 'len' bytes.
+ * Insert an entry into an index node that is not full.
  *
- * Errors:
- *   ENOENT  - file does not exist
- *   ENOTDIR - component of path not a directory
- *   EINVAL  - length invalid (only supports 0)
- *   EISDIR	 - path is a directory (only files)
+ * @param node: the index node
+ * @param pos: position for the new entry
+ * @param hash: lowest hash covered by the new entry
+ * @param blk: logical block the new entry points to
+ */
+static void dx_insert(struct fs_dx_node *node, int pos, uint32_t hash, uint32_t blk)
+{
+	memmove(&node->entries[pos + 1], &node->entries[pos],
+			(node->count - pos) * sizeof(struct fs_dx_entry));
+	node->entries[pos].hash = hash;
+	node->entries[pos].blk = blk;
+	node->count++;
+}
+
+/**
+ * Read a block of a directory.
  *
- * @param path the file path
- * @param len the length
- * @return 0 if successful, or error value
+ * @param dir: the directory inode
+ * @param lblk: the logical block
+ * @param buf: buffer for the block
  */
-static int fs_truncate(const char *path, off_t len)
+static void dir_read(struct fs_inode *dir, int lblk, void *buf)
 {
-	if (len != 0) return -EINVAL; /* invalid argument */
+	uint32_t blk;
+	fs_bmap(dir, lblk, 1, &blk);
+	meta_read(blk, buf);
+}
 
-	//get inode
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	if (S_ISDIR(inode->mode)) return -EISDIR;
+/**
+ * Write a block of a directory.
+ *
+ * @param dir: the directory inode
+ * @param lblk: the logical block
+ * @param buf: the block contents
+ */
+static void dir_write(struct fs_inode *dir, int lblk, void *buf)
+{
+	uint32_t blk;
+	fs_bmap(dir, lblk, 1, &blk);
+	meta_write(blk, buf);
+}
 
-	//clear direct
-	fs_truncate_dir(inode->direct);
+/**
+ * Read an index node of a directory, from the start of its block.
+ *
+ * @param dir: the directory inode
+ * @param lblk: the logical block
+ * @param node: the index node
+ */
+static void dx_read(struct fs_inode *dir, int lblk, struct fs_dx_node *node)
+{
+	char block[block_size];
+	dir_read(dir, lblk, block);
+	memcpy(node, block, sizeof(*node));
+}
 
-	//clear indirect1
-	if (inode->indir_1) {
-		fs_truncate_indir1(inode->indir_1);
-		return_blk(inode->indir_1);
-	}
-	inode->indir_1 = 0;
+/**
+ * Write an index node of a directory; the rest of its block is zero.
+ *
+ * @param dir: the directory inode
+ * @param lblk: the logical block
+ * @param node: the index node
+ */
+static void dx_write(struct fs_inode *dir, int lblk, struct fs_dx_node *node)
+{
+	char block[block_size];
+	memset(block, 0, block_size);
+	memcpy(block, node, sizeof(*node));
+	dir_write(dir, lblk, block);
+}
 
-	//clear indirect2
-	if (inode->indir_2) {
-		fs_truncate_indir2(inode->indir_2);
-		return_blk(inode->indir_2);
-	}
-	inode->indir_2 = 0;
+/**
+ * Add an empty block to the end of an indexed directory.
+ *
+ * @param inum: the directory inode number
+ * @return logical number of the new block, or -ENOSPC
+ */
+static int dir_grow(int inum)
+{
+	struct fs_inode *dir = &inodes[inum];
+	int lblk = dir->size >> block_shift;
+	uint32_t blk;
+	bool fresh;
+	if (fs_balloc(dir, lblk, 1, &blk, &fresh, 0) < 1) return -ENOSPC;
+	char zero[block_size];
+	memset(zero, 0, block_size);
+	meta_write(blk, zero);
+	dir->size += block_size;
+	update_inode(inum);
+	return lblk;
+}
 
-	inode->size = 0;
+/**
+ * Remove the last block of an indexed directory, undoing dir_grow,
+ * along with a pointer block that only mapped it.
+ *
+ * @param inum: the directory inode number
+ */
+static void dir_shrink(int inum)
+{
+	struct fs_inode *dir = &inodes[inum];
+	uint32_t buf1[ptrs_per_blk], buf2[ptrs_per_blk];
+	struct ptr_blk indir1 = { .buf = buf1 }, indir2 = { .buf = buf2 };
+
+	//pointer blocks are changed on disk, so drop any cached copies
+	bmap_reset(dir);
+	dir->size -= block_size;
+	int lblk = dir->size >> block_shift;
+	if (lblk < N_DIRECT) {
+		return_blk(dir->direct[lblk]);
+		dir->direct[lblk] = 0;
+	} else if ((lblk -= N_DIRECT) < ptrs_per_blk) {
+		fs_read_ptrs(dir->indir_1, &indir1, NULL);
+		return_blk(indir1.ptrs[lblk]);
+		indir1.ptrs[lblk] = 0;
+		if (lblk == 0) {
+			return_blk(dir->indir_1);
+			dir->indir_1 = 0;
+		} else {
+			fs_write_ptrs(&indir1);
+		}
+	} else {
+		lblk -= ptrs_per_blk;
+		int k = lblk >> ptrs_shift;
+		fs_read_ptrs(dir->indir_2, &indir2, NULL);
+		fs_read_ptrs(indir2.ptrs[k], &indir1, NULL);
+		return_blk(indir1.ptrs[lblk & (ptrs_per_blk - 1)]);
+		indir1.ptrs[lblk & (ptrs_per_blk - 1)] = 0;
+		if ((lblk & (ptrs_per_blk - 1)) != 0) {
+			fs_write_ptrs(&indir1);
+		} else {
+			return_blk(indir2.ptrs[k]);
+			indir2.ptrs[k] = 0;
+			if (k == 0) {
+				return_blk(dir->indir_2);
+				dir->indir_2 = 0;
+			} else {
+				fs_write_ptrs(&indir2);
+			}
+		}
+	}
+	update_inode(inum);
+}
 
-	//update at the end for efficiency
-	update_inode(inode_idx);
-	update_blk();
+/**
+ * Path from the root of a directory index to a leaf.
+ */
+struct dx_path {
+	struct fs_dx_node root; /* the root, block 0 */
+	struct fs_dx_node node; /* the index node, if root.depth is 1 */
+	int root_pos; /* entry followed in the root */
+	int node_pos; /* entry followed in the index node */
+	uint32_t node_blk; /* logical block of the index node */
+	uint32_t leaf_blk; /* logical block of the leaf */
+};
 
-	return SUCCESS;
+/**
+ * Walk the index of a directory down to the leaf covering a hash.
+ *
+ * @param dir: the indexed directory inode
+ * @param hash: the name hash
+ * @param path: the path to fill in
+ */
+static void dx_walk(struct fs_inode *dir, uint32_t hash, struct dx_path *path)
+{
+	dx_read(dir, 0, &path->root);
+	path->root_pos = dx_search(&path->root, hash);
+	path->leaf_blk = path->root.entries[path->root_pos].blk;
+	if (path->root.depth > 0) {
+		path->node_blk = path->leaf_blk;
+		dx_read(dir, path->node_blk, &path->node);
+		path->node_pos = dx_search(&path->node, hash);
+		path->leaf_blk = path->node.entries[path->node_pos].blk;
+	}
 }
 
 /**
- * unlink - delete a file
+ * Find the inode of an entry in a directory. An indexed directory
+ * is searched in the one leaf that can hold the name.
  *
- * @param path: path to file
+ * @param dir: the directory inode
+ * @param name: the entry name
+ * @return the entry inode, or 0 if not found
+ */
+static int dir_find(struct fs_inode *dir, char *name)
+{
+	struct fs_dirent entries[dirents_per_blk];
+	if (dir->flags & FS_INODE_INDEXED) {
+		struct dx_path path;
+		dx_walk(dir, dx_hash(name), &path);
+		dir_read(dir, path.leaf_blk, entries);
+	} else {
+		meta_read(dir->direct[0], entries);
+	}
+	return find_in_dir(entries, name);
+}
+
+/**
+ * Turn a single-block directory into an indexed one: its entries
+ * move to a new leaf block and block 0 becomes the index root.
  *
- * @return 0 if successful, or error value
- *	-ENOENT   - file does not exist
- * 	-ENOTDIR  - component of path not a directory
- * 	-EISDIR   - cannot unlink a directory
-*/
-static int fs_unlink(const char *path)
+ * @param inum: the directory inode number
+ * @return 0 if successful, or -ENOSPC
+ */
+static int dx_create(int inum)
 {
-	//truncate first
-	int res = fs_truncate(path, 0);
-	if (res < 0) return res;
+	struct fs_inode *dir = &inodes[inum];
+	struct fs_dirent entries[dirents_per_blk];
+	meta_read(dir->direct[0], entries);
+
+	dir->size = block_size;
+	int leaf = dir_grow(inum);
+	if (leaf < 0) {
+		dir->size = 0;
+		return leaf;
+	}
+	dir_write(dir, leaf, entries);
+
+	struct fs_dx_node root;
+	memset(&root, 0, sizeof(root));
+	root.magic = FS_DX_MAGIC;
+	root.count = 1;
+	root.entries[0].blk = leaf;
+	dx_write(dir, 0, &root);
+	dir->flags |= FS_INODE_INDEXED;
+	update_inode(inum);
+	return 0;
+}
 
-	//get inodes and check
-	char *_path = strdup(path);
-	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
-	int parent_inode_idx = translate_1(_path, name);
-	struct fs_inode *inode = &inodes[inode_idx];
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (inode_idx < 0 || parent_inode_idx < 0) return -ENOENT;
-	if (S_ISDIR(inode->mode)) return -EISDIR;
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+/** leaf entries being split, for sorting by hash */
+struct dx_sort {
+	uint32_t hash;
+	int i;
+};
 
-	//remove entire entry from parent dir
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
-			memset(&entries[i], 0, sizeof(struct fs_dirent));
+/**
+ * Compare leaf entries by hash.
+ */
+static int cmp_dx_sort(const void *a, const void *b)
+{
+	uint32_t x = ((const struct dx_sort*) a)->hash;
+	uint32_t y = ((const struct dx_sort*) b)->hash;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Split a full leaf of an indexed directory, moving the upper half
+ * of its hash range to a new leaf. The split falls between two
+ * different hashes so that equal hashes stay in one leaf.
+ *
+ * @param inum: the directory inode number
+ * @param path: path to the full leaf, updated to the leaf covering hash
+ * @param entries: the full leaf, updated to the leaf covering hash
+ * @param hash: hash of the name to be added
+ * @return 0 if successful, or -ENOSPC
+ */
+static int dx_split(int inum, struct dx_path *path, struct fs_dirent *entries, uint32_t hash)
+{
+	struct fs_inode *dir = &inodes[inum];
+	struct fs_dx_node *root = &path->root;
+	struct fs_dx_node *parent = root->depth > 0 ? &path->node : root;
+
+	// find the split point nearest the middle
+	struct dx_sort sorted[dirents_per_blk];
+	for (int i = 0; i < dirents_per_blk; i++) {
+		sorted[i].hash = dx_hash(entries[i].name);
+		sorted[i].i = i;
+	}
+	qsort(sorted, dirents_per_blk, sizeof(sorted[0]), cmp_dx_sort);
+	int split = -1;
+	for (int d = 0; d < dirents_per_blk / 2 && split < 0; d++) {
+		int m = dirents_per_blk / 2 + d;
+		if (m < dirents_per_blk && sorted[m - 1].hash != sorted[m].hash) {
+			split = m;
+		} else if (sorted[m - 2 * d - 1].hash != sorted[m - 2 * d].hash) {
+			split = m - 2 * d;
+		}
+	}
+	if (split < 0) return -ENOSPC;
+	uint32_t boundary = sorted[split].hash;
+
+	// make sure the index has room for the new leaf before growing
+	int new_blks = 1;
+	if (parent->count == DX_PER_BLK) {
+		if (root->depth > 0 && root->count == DX_PER_BLK) return -ENOSPC;
+		new_blks += (root->depth == 0) ? 2 : 1;
+	}
+	int blks[3];
+	for (int i = 0; i < new_blks; i++) {
+		blks[i] = dir_grow(inum);
+		if (blks[i] < 0) {
+			//give back the blocks added so far
+			while (i-- > 0) dir_shrink(inum);
+			return -ENOSPC;
 		}
 	}
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
 
-	//clear inode
-	memset(inode, 0, sizeof(struct fs_inode));
-	return_inode(inode_idx);
+	// move the upper half to the new leaf
+	struct fs_dirent upper[dirents_per_blk];
+	memset(upper, 0, sizeof(upper));
+	for (int k = split; k < dirents_per_blk; k++) {
+		int i = sorted[k].i;
+		upper[k - split] = entries[i];
+		memset(&entries[i], 0, sizeof(struct fs_dirent));
+	}
+
+	// a full root without index nodes moves down into a new index node
+	if (parent->count == DX_PER_BLK && root->depth == 0) {
+		path->node = *root;
+		path->node_blk = blks[1];
+		path->node_pos = path->root_pos;
+		root->depth = 1;
+		root->count = 1;
+		root->entries[0].hash = 0;
+		root->entries[0].blk = blks[1];
+		path->root_pos = 0;
+		parent = &path->node;
+		blks[1] = blks[2];
+	}
 
-	//update
-	update_inode(inode_idx);
-	update_blk();
+	// a full index node is split in two
+	if (parent->count == DX_PER_BLK) {
+		struct fs_dx_node node2;
+		memset(&node2, 0, sizeof(node2));
+		node2.magic = FS_DX_MAGIC;
+		int half = DX_PER_BLK / 2;
+		node2.count = DX_PER_BLK - half;
+		memcpy(node2.entries, &parent->entries[half], node2.count * sizeof(struct fs_dx_entry));
+		parent->count = half;
+		dx_insert(root, path->root_pos + 1, node2.entries[0].hash, blks[1]);
+		if (path->node_pos >= half) {
+			dx_write(dir, path->node_blk, &path->node);
+			path->node = node2;
+			path->node_blk = blks[1];
+			path->node_pos -= half;
+			path->root_pos++;
+		} else {
+			dx_write(dir, blks[1], &node2);
+		}
+	}
 
-	return SUCCESS;
+	dx_insert(parent, (parent == root ? path->root_pos : path->node_pos) + 1, boundary, blks[0]);
+	if (root->depth > 0) dx_write(dir, path->node_blk, &path->node);
+	dx_write(dir, 0, root);
+
+	// leave the caller with the leaf that covers hash
+	if (hash >= boundary) {
+		dir_write(dir, path->leaf_blk, entries);
+		memcpy(entries, upper, sizeof(upper));
+		path->leaf_blk = blks[0];
+	} else {
+		dir_write(dir, blks[0], upper);
+	}
+	return 0;
 }
 
 /**
- * rmdir - remove a directory
- *
- * @param path: the path of the directory
- *
- * @return: 0 if successful, or -error number
- * 	-ENOENT   - file does not exist
- *  	-ENOTDIR  - component of path not a directory
- *  	-ENOTDIR  - path not a directory
- *  	-ENOEMPTY - directory not empty
+ * Add an entry to a directory. A single-block directory that is
+ * full becomes indexed; a full leaf of an indexed directory is split.
  *
- * Note: this is similar to deleting a file, except that we delete
- * a directory.
-*/
-static int fs_rmdir(const char *path)
+ * @param inum: the directory inode number
+ * @param name: the entry name
+ * @param entry_inum: the entry inode
+ * @return 0 if successful, or -ENOSPC
+ */
+static int dir_add(int inum, char *name, int entry_inum)
 {
-	//can not remove root
-	if (strcmp(path, "/") == 0) return -EINVAL;
-
-	//get inodes and check
-	//CS492: your code below
-	char *_path = strdup(path);
-	char name[FS_FILENAME_SIZE];
-	int inode_idx = translate(_path);
-	int parent_inode_idx = translate_1(_path, name);
-	struct fs_inode *inode = &inodes[inode_idx];
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-
-	//checking if the directories are actually directories
-	if (inode_idx < 0 || parent_inode_idx < 0) return -ENOENT;
-	if (!S_ISDIR(inode->mode)) return -ENOTDIR;
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+	struct fs_inode *dir = &inodes[inum];
+	struct fs_dirent entries[dirents_per_blk];
+	if (!(dir->flags & FS_INODE_INDEXED)) {
+		meta_read(dir->direct[0], entries);
+		int i = find_free_dir(entries);
+		if (i >= 0) {
+			strcpy(entries[i].name, name);
+			entries[i].inode = entry_inum;
+			entries[i].valid = true;
+			meta_write(dir->direct[0], entries);
+			return 0;
+		}
+		int res = dx_create(inum);
+		if (res < 0) return res;
+	}
 
-	//check if dir if empty
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, inode->direct[0], 1, entries) < 0)
-		exit(1);
-	int res = is_empty_dir(entries);
-	if (res == 0) return -ENOTEMPTY;
+	uint32_t hash = dx_hash(name);
+	struct dx_path path;
+	dx_walk(dir, hash, &path);
+	dir_read(dir, path.leaf_blk, entries);
+	int i = find_free_dir(entries);
+	if (i < 0) {
+		int res = dx_split(inum, &path, entries, hash);
+		if (res < 0) return res;
+		i = find_free_dir(entries);
+	}
+	strcpy(entries[i].name, name);
+	entries[i].inode = entry_inum;
+	entries[i].valid = true;
+	dir_write(dir, path.leaf_blk, entries);
+	return 0;
+}
 
-	//remove entry from parent dir
-	//CS492: your code below
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+/**
+ * Remove an entry from a directory.
+ *
+ * @param dir: the directory inode
+ * @param name: the entry name
+ * @return the inode of the removed entry, or -ENOENT
+ */
+static int dir_remove(struct fs_inode *dir, char *name)
+{
+	struct fs_dirent entries[dirents_per_blk];
+	struct dx_path path;
+	if (dir->flags & FS_INODE_INDEXED) {
+		dx_walk(dir, dx_hash(name), &path);
+		dir_read(dir, path.leaf_blk, entries);
+	} else {
+		meta_read(dir->direct[0], entries);
+	}
+	for (int i = 0; i < dirents_per_blk; i++) {
 		if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
+			int inum = entries[i].inode;
 			memset(&entries[i], 0, sizeof(struct fs_dirent));
+			if (dir->flags & FS_INODE_INDEXED) {
+				dir_write(dir, path.leaf_blk, entries);
+			} else {
+				meta_write(dir->direct[0], entries);
+			}
+			return inum;
 		}
 	}
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-		exit(1);
-
-	//return blk and clear inode
-	return_blk(inode->direct[0]);
-	memset(inode, 0, sizeof(struct fs_inode));
-	return_inode(inode_idx);
-
-	//update
-	update_inode(inode_idx);
-	update_blk();
-
-	return SUCCESS;
+	return -ENOENT;
 }
 
 /**
- * rename - rename a file or directory. You can assume the destination
- * and the source share the same path-prefix so the renaming changes
- * the name without moving the file or directory into another file or
+ * Call a function for each block of dirents in a directory, in
+ * block order. Index blocks of an indexed directory are skipped.
+ *
+ * @param dir: the directory inode
+ * @param fn: function called with each block and arg; a nonzero
+ *   return stops the scan
+ * @param arg: argument for fn
+ * @return the nonzero value returned by fn, or 0
+ */
+static int dir_scan(struct fs_inode *dir, int (*fn)(struct fs_dirent*, void*), void *arg)
+{
+	struct fs_dirent entries[dirents_per_blk];
+	if (!(dir->flags & FS_INODE_INDEXED)) {
+		meta_read(dir->direct[0], entries);
+		return fn(entries, arg);
+	}
+	int nblks = dir->size >> block_shift;
+	uint32_t blks[nblks];
+	fs_bmap(dir, 0, nblks, blks);
+	for (int i = 1; i < nblks; i++) {
+		meta_read(blks[i], entries);
+		if (((struct fs_dx_node*) entries)->magic == FS_DX_MAGIC) continue;
+		int res = fn(entries, arg);
+		if (res != 0) return res;
+	}
+	return 0;
+}
+
+/**
+ * Look up a single directory entry in a directory. Results,
+ * including failed lookups, are remembered in the dentry cache.
+ *
+ * Errors
+ *   -EIO     - error reading block
+ *   -ENOENT  - a component of the path is not present.
+ *   -ENOTDIR - intermediate component of path not a directory
+ *
+ */
+static int lookup(int inum, char *name)
+{
+	int inode = dcache_lookup(inum, name);
+	if (inode == DCACHE_MISS) {
+		inode = dir_find(&inodes[inum], name);
+		dcache_insert(inum, name, inode);
+	}
+	return inode == 0 ? -ENOENT : inode;
+}
+
+/**
+ * Parse path name into tokens at most nnames tokens after
+ * normalizing paths by removing '.' and '..' elements.
+ *
+ * If names is NULL, path is not altered and function  returns
+ * an upper bound on the path count. Otherwise, path is altered by strtok() and
+ * function returns names in the names array, which point to
+ * elements of path string.
+ *
+ * @param path: the directory path
+ * @param names: the argument token array or NULL
+ * @param nnames: the maximum number of names, 0 = unlimited
+ * @return the number of path name tokens
+ */
+static int parse(char *path, char *names[], int nnames)
+{
+	if (names == NULL) {
+		// upper bound on the count without altering path
+		int count = 1;
+		for (char *p = path; *p; p++) {
+			if (*p == '/') count++;
+		}
+		return count;
+	}
+	char *lasts = NULL;
+	int count = 0;
+	char *token = strtok_r(path, "/", &lasts);
+	while (token != NULL) {
+		int len = strlen(token);
+		if (len > FS_FILENAME_SIZE - 1) return -EINVAL;
+		if (strcmp(token, "..") == 0) {
+			if (count > 0) count--;
+		} else if (strcmp(token, ".") != 0) {
+			//if the number of names in the path exceed the maximum
+			if (nnames != 0 && count >= nnames) return -1;
+			names[count++] = token;
+		}
+		token = strtok_r(NULL, "/", &lasts);
+	}
+	return count;
+}
+
+/**
+ * Resolve a path to the inode of its last component, or of the
+ * directory containing its last component if leaf is not NULL.
+ *
+ * @param path: the file path
+ * @param leaf: pointer to space for FS_FILENAME_SIZE leaf name or NULL
+ * @return inode of path node or error, -EINVAL if leaf is wanted but
+ *   the path is the root
+ */
+static int resolve(char *path, char *leaf)
+{
+	if (strcmp(path, "/") == 0 || strlen(path) == 0) return leaf ? -EINVAL : root_inode;
+	int inode_idx = root_inode;
+	//split a copy of the path into names
+	char _path[strlen(path) + 1];
+	strcpy(_path, path);
+	char *names[parse(_path, NULL, 0)];
+	int num_names = parse(_path, names, 0);
+	//if a name is too long, return an error, error type to be fixed if necessary
+	if (num_names < 0) return -ENOTDIR;
+	if (num_names == 0) return leaf ? -EINVAL : root_inode;
+	if (leaf != NULL) num_names--;
+	//lookup inode
+	for (int i = 0; i < num_names; i++) {
+		//if token is not a directory return error
+		if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
+		//lookup and record inode
+		inode_idx = lookup(inode_idx, names[i]);
+		if (inode_idx < 0) return -ENOENT;
+	}
+	if (leaf != NULL) strcpy(leaf, names[num_names]);
+	return inode_idx;
+}
+
+/**
+ * Return inode number for specified file or
  * directory.
  *
- * Note that this is a simplified version of the UNIX rename
- * functionality - see 'man 2 rename' for full semantics. In
- * particular, the full version can move across directories, replace a
- * destination file, and replace an empty directory with a full one.
+ * Errors
+ *   -ENOENT  - a component of the path is not present.
+ *   -ENOTDIR - an intermediate component of path not a directory
  *
- * @param src_path: the source path
- * @param dst_path: the destination path
+ * @param path: the file path
+ * @return inode of path node or error
+ */
+static int translate(char *path)
+{
+	return resolve(path, NULL);
+}
+
+/**
+ *  Return inode number for path to specified file
+ *  or directory, and a leaf name that may not yet
+ *  exist.
  *
- * @return: 0 if successful, or -error number
- * 	-ENOENT   - source file or directory does not exist
- * 	-ENOTDIR  - component of source or target path not a directory
- * 	-EEXIST   - destination already exists
- * 	-EINVAL   - source and destination not in the same directory
+ * Errors
+ *   -ENOENT  - a component of the path is not present.
+ *   -ENOTDIR - an intermediate component of path not a directory
+ *
+ * @param path: the file path
+ * @param leaf: pointer to space for FS_FILENAME_SIZE leaf name
+ * @return inode of path node or error
+ */
+static int translate_1(char *path, char *leaf)
+{
+	return resolve(path, leaf);
+}
+
+/**
+ * Double the open file table. The new entries are allocated as one
+ * chunk, starting at entry 0 or at a power of 2 of at least 64.
+ * Called with open_lock held.
+ *
+ * @return true if successful, false if out of memory
+ */
+static bool open_files_grow(void)
+{
+	int n = n_open_files ? 2 * n_open_files : 64;
+	struct open_file **table = realloc(open_files, n * sizeof(struct open_file*));
+	if (table == NULL) return false;
+	open_files = table;
+	struct open_file *entries = calloc(n - n_open_files, sizeof(struct open_file));
+	if (entries == NULL) return false;
+	for (int i = n_open_files; i < n; i++) {
+		table[i] = &entries[i - n_open_files];
+		table[i]->next_free = (i + 1 < n) ? i + 1 : -1;
+	}
+	open_files_free = n_open_files;
+	n_open_files = n;
+	return true;
+}
+
+/**
+ * Free the open file table.
+ */
+static void open_files_purge(void)
+{
+	for (int i = 0; i < n_open_files; i = i ? 2 * i : 64) {
+		free(open_files[i]);
+	}
+	free(open_files);
+	open_files = NULL;
+	n_open_files = 0;
+	open_files_free = -1;
+}
+
+/**
+ * Add an entry for a newly opened file to the open file table,
+ * doubling the table if it is full.
+ *
+ * @param inum the inode number of the file
+ * @return index of the entry, or -ENOMEM
+ */
+static int open_file_new(int inum)
+{
+	lock_mutex(&open_lock, &open_stats);
+	if (open_files_free < 0 && !open_files_grow()) {
+		pthread_mutex_unlock(&open_lock);
+		return -ENOMEM;
+	}
+	int fh = open_files_free;
+	open_files_free = open_files[fh]->next_free;
+	memset(open_files[fh], 0, sizeof(struct open_file));
+	open_files[fh]->inum = inum;
+	open_files[fh]->ra_window = RA_MIN_BLKS;
+	pthread_mutex_unlock(&open_lock);
+	return fh;
+}
+
+/**
+ * Find the open file table entry of an open file.
+ *
+ * @param fi the fuse file info, with the entry index in fi->fh
+ * @return the entry, or NULL if fi does not refer to an open file
+ */
+static struct open_file *open_file_get(struct fuse_file_info *fi)
+{
+	struct open_file *of = NULL;
+	if (fi == NULL) return NULL;
+	lock_mutex(&open_lock, &open_stats);
+	if (fi->fh < (uint64_t) n_open_files && open_files[fi->fh]->inum != 0) {
+		of = open_files[fi->fh];
+	}
+	pthread_mutex_unlock(&open_lock);
+	return of;
+}
+
+/**
+ * Return an open file table entry to the free list.
+ *
+ * @param fh the index of the entry
+ */
+static void open_file_free(int fh)
+{
+	lock_mutex(&open_lock, &open_stats);
+	open_files[fh]->inum = 0;
+	open_files[fh]->next_free = open_files_free;
+	open_files_free = fh;
+	pthread_mutex_unlock(&open_lock);
+}
+
+/** blocks of a file being freed from its end */
+struct tail_free {
+	int map; /* block map block of the block freed last, -1 if none */
+	int nmaps; /* number of times the block map block changed */
+	int budget; /* most block map block changes allowed */
+};
+
+/**
+ * Free a block of a file being freed from its end, unless it would
+ * change one more block map block than the budget allows.
+ *
+ * @param tf: the blocks being freed
+ * @param blk: the block number
+ * @return true if the block was freed
+ */
+static bool free_one(struct tail_free *tf, uint32_t blk)
+{
+	int map = blk >> (block_shift + 3);
+	if (map != tf->map) {
+		if (tf->nmaps == tf->budget) return false;
+		tf->map = map;
+		tf->nmaps++;
+	}
+	return_blk(blk);
+	return true;
+}
+
+/**
+ * Free the blocks of an array of block pointers from its end.
+ *
+ * @param tf: the blocks being freed
+ * @param ptrs: the pointers, cleared as their blocks are freed
+ * @param n: the number of pointers
+ * @return the number of pointers at the start of the array that may
+ *   still be in use, 0 if all were freed
+ */
+static int free_ptrs(struct tail_free *tf, uint32_t *ptrs, int n)
+{
+	for (; n > 0; n--) {
+		if (ptrs[n - 1] != 0 && !free_one(tf, ptrs[n - 1])) return n;
+		ptrs[n - 1] = 0;
+	}
+	return 0;
+}
+
+/**
+ * Free the blocks mapped by a pointer block from its end, then the
+ * pointer block itself. A pointer block left partly used is written
+ * back.
+ *
+ * @param tf: the blocks being freed
+ * @param ptr: pointer to the pointer block number, cleared once freed
+ * @param depth: 1 for a block of data block pointers, 2 for a block
+ *   of pointers to those
+ * @return true if the pointer block and all it maps were freed
+ */
+static bool free_indir(struct tail_free *tf, uint32_t *ptr, int depth)
+{
+	if (*ptr == 0) return true;
+	uint32_t entries[ptrs_per_blk];
+	meta_read(*ptr, entries);
+	int n = ptrs_per_blk;
+	if (depth == 1) {
+		n = free_ptrs(tf, entries, n);
+	} else {
+		while (n > 0 && free_indir(tf, &entries[n - 1], 1)) n--;
+	}
+	if (n > 0 || !free_one(tf, *ptr)) {
+		meta_write(*ptr, entries);
+		return false;
+	}
+	*ptr = 0;
+	return true;
+}
+
+/**
+ * Free blocks of a file from its end until freeing another would
+ * change more block map blocks than allowed, so that the change fits
+ * the credits of one journal handle (see free_credits). The block
+ * map cache must already have been dropped.
+ *
+ * @param inode: the inode
+ * @param nmaps: the most block map block changes allowed
+ * @return true if the inode still has blocks
+ */
+static bool fs_free_tail(struct fs_inode *inode, int nmaps)
+{
+	struct tail_free tf = { .map = -1, .budget = nmaps };
+	return !free_indir(&tf, &inode->indir_2, 2) || !free_indir(&tf, &inode->indir_1, 1) ||
+			free_ptrs(&tf, inode->direct, N_DIRECT) > 0;
+}
+
+/**
+ * Free all the data and indirect blocks of a file or directory, one
+ * journal handle at a time so that a large file never overflows a
+ * transaction. Until the last block is freed the inode is flagged
+ * FS_INODE_TRUNC, and a crash part way through leaves the rest to be
+ * freed at the next mount. Called with the inode locked for writing
+ * and no handle open.
+ *
+ * @param inum the inode number, left with no blocks and size 0
+ */
+static void fs_free_blocks(int inum)
+{
+	struct fs_inode *inode = &inodes[inum];
+	bool more;
+	bmap_reset(inode);
+	do {
+		handle_begin(free_credits());
+		more = fs_free_tail(inode, HANDLE_BLKS);
+		inode->size = 0;
+		if (more) {
+			inode->flags |= FS_INODE_TRUNC;
+		} else {
+			inode->flags &= ~FS_INODE_TRUNC;
+		}
+		update_inode(inum);
+		handle_end(free_credits());
+	} while (more);
+}
+
+/**
+ * Free an inode removed from its directory, with its blocks, once
+ * nothing uses it any more: it is flagged as an orphan, no open file
+ * refers to it, and the kernel has forgotten it. Called with no
+ * journal handle open.
+ *
+ * @param inum: the inode number
+ */
+static void inode_put(int inum)
+{
+	struct fs_inode *inode = &inodes[inum];
+	inode_lock(inum, true);
+	bool unused = (inode->flags & FS_INODE_ORPHAN) &&
+			(bmaps[inum] == NULL || bmaps[inum]->refs == 0) &&
+			__atomic_load_n(&lookups[inum], __ATOMIC_ACQUIRE) == 0;
+	if (unused) {
+		bool dir = S_ISDIR(inode->mode);
+		bmap_free(inum);
+		fs_free_blocks(inum);
+		handle_begin(INODE_CREDITS);
+		memset(inode, 0, sizeof(struct fs_inode));
+		update_inode(inum);
+		return_inode(inum, dir);
+		handle_end(INODE_CREDITS);
+	}
+	inode_unlock(inum);
+}
+
+/**
+ * Flag an inode that has just been removed from its directory as an
+ * orphan. The flag is saved with the inode, so an orphan still in use
+ * when the system stops is freed at the next mount. Called under the
+ * journal handle of the removal; the caller frees the inode with
+ * inode_put once the handle has ended, unless it is still open or
+ * known to the kernel.
+ *
+ * @param inum: the inode number
+ */
+static void inode_orphan(int inum)
+{
+	inode_lock(inum, true);
+	inodes[inum].flags |= FS_INODE_ORPHAN;
+	update_inode(inum);
+	inode_unlock(inum);
+}
+
+/**
+ * Copy stat from inode to sb
+ * @param inode inode to be copied from
+ * @param sb holder to hold copied stat
+ * @param inode_idx inode_idx
+ */
+static void cpy_stat(struct fs_inode *inode, struct stat *sb) {
+	memset(sb, 0, sizeof(*sb));
+	sb->st_uid = inode->uid;
+	sb->st_gid = inode->gid;
+	sb->st_mode = (mode_t) inode->mode;
+	sb->st_atime = inode->mtime;
+	sb->st_ctime = inode->ctime;
+	sb->st_mtime = inode->mtime;
+	sb->st_size = file_size(inode);
+	sb->st_blksize = block_size;
+	sb->st_nlink = 1;
+	sb->st_blocks = (sb->st_size + block_size - 1) >> block_shift;
+}
+
+/*
+ * CS492: FUSE functions to implement are below.
 */
-static int fs_rename(const char *src_path, const char *dst_path)
+
+/**
+ * Use blocks of a size: address the disk in them and work out the
+ * counts that depend on the block size.
+ *
+ * @param log_block_size: log2 of the block size / FS_BLOCK_SIZE
+ */
+static void set_block_size(int log_block_size)
 {
-	//deep copy both path
-	char *_src_path = strdup(src_path);
-	char *_dst_path = strdup(dst_path);
-	//get inodes
-	int src_inode_idx = translate(_src_path);
-	int dst_inode_idx = translate(_dst_path);
-	//if src inode does not exist return error
-	if (src_inode_idx < 0) return src_inode_idx;
-	//if dst already exist return error
-	if (dst_inode_idx >= 0) return -EEXIST;
-
-	//get parent directory inode
-	char src_name[FS_FILENAME_SIZE];
-	char dst_name[FS_FILENAME_SIZE];
-	int src_parent_inode_idx = translate_1(_src_path, src_name);
-	int dst_parent_inode_idx = translate_1(_dst_path, dst_name);
-	//src and dst should be in the same directory (same parent)
-	if (src_parent_inode_idx != dst_parent_inode_idx) return -EINVAL;
-	int parent_inode_idx = src_parent_inode_idx;
-	if (parent_inode_idx < 0) return parent_inode_idx;
+	int size = FS_BLOCK_SIZE << log_block_size;
+	if (disk->ops->set_block_size != NULL ? disk->ops->set_block_size(disk, size) < 0
+			: size != BLOCK_SIZE) {
+		fprintf(stderr, "device cannot use %d byte blocks\n", size);
+		exit(1);
+	}
+	block_size = size;
+	block_shift = __builtin_ctz(size);
+	dirents_per_blk = DIRENTS_PER_BLK(size);
+	inodes_per_blk = INODES_PER_BLK(size);
+	ptrs_per_blk = PTRS_PER_BLK(size);
+	ptrs_shift = __builtin_ctz(ptrs_per_blk);
+	bits_per_blk = BITS_PER_BLK(size);
+
+	max_file_blks = N_DIRECT + ptrs_per_blk + ptrs_per_blk * ptrs_per_blk;
+	max_file_size = (off_t) max_file_blks << block_shift;
+
+	free(zero_blks);
+	zero_blks = calloc(ZERO_RUN_BLKS, size);
+	if (zero_blks == NULL) {
+		fprintf(stderr, "cannot allocate block buffers\n");
+		exit(1);
+	}
+}
 
-	//read parent dir inode
-	struct fs_inode *parent_inode = &inodes[parent_inode_idx];
-	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+/**
+ * Read the superblock, which is the first FS_BLOCK_SIZE bytes of
+ * block 0.
+ *
+ * @param sb: the superblock
+ */
+static void read_super(struct fs_super *sb)
+{
+	char block[block_size];
+	if (disk->ops->read(disk, 0, 1, block) < 0) exit(1);
+	memcpy(sb, block, sizeof(*sb));
+}
+
+/**
+ * Write the superblock; the rest of block 0 is zero.
+ *
+ * @param sb: the superblock
+ */
+static void write_super(struct fs_super *sb)
+{
+	char block[block_size];
+	memset(block, 0, block_size);
+	memcpy(block, sb, sizeof(*sb));
+	if (disk->ops->write(disk, 0, 1, block) < 0) exit(1);
+}
 
-	struct fs_dirent entries[DIRENTS_PER_BLK];
-	memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-	if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0) exit(1);
+/**
+ * Read the maps and inode tables of an image in the block group
+ * layout into the resident inode map, block map and inode array,
+ * in group order.
+ *
+ * @param sb: the superblock
+ */
+static void read_groups(struct fs_super *sb)
+{
+	n_bgroups = sb->num_groups;
+	blocks_per_group = sb->blocks_per_group;
+	inodes_per_group = sb->inodes_per_group;
+	if (n_bgroups == 0 || blocks_per_group == 0 || blocks_per_group % bits_per_blk != 0 ||
+			inodes_per_group == 0 || inodes_per_group % inodes_per_blk != 0 ||
+			inodes_per_group > bits_per_blk ||
+			(long) n_bgroups * blocks_per_group < n_blocks ||
+			(long) (n_bgroups - 1) * blocks_per_group >= n_blocks) {
+		fprintf(stderr, "bad block group geometry in superblock\n");
+		exit(1);
+	}
+	group_bmap_blks = blocks_per_group / bits_per_blk;
+	group_itable_blks = inodes_per_group / inodes_per_blk;
+	n_inodes = n_bgroups * inodes_per_group;
+	inode_map_base = 1;
+	block_map_base = inode_map_base + n_bgroups;
+	inode_base = block_map_base + n_bgroups * group_bmap_blks;
+
+	group_imaps = malloc((size_t) n_bgroups * block_size);
+	inode_map = calloc((n_inodes + 63) / 64, sizeof(uint64_t));
+	block_map = malloc((size_t) n_bgroups * group_bmap_blks * block_size);
+	inodes = malloc((size_t) n_inodes * sizeof(struct fs_inode));
+	if (group_imaps == NULL || inode_map == NULL || block_map == NULL || inodes == NULL) {
+		fprintf(stderr, "cannot allocate block group metadata\n");
+		exit(1);
+	}
 
-	//make change to buff
-	for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-		if (entries[i].valid && strcmp(entries[i].name, src_name) == 0) {
-			memset(entries[i].name, 0, sizeof(entries[i].name));
-			strcpy(entries[i].name, dst_name);
+	for (int g = 0; g < n_bgroups; g++) {
+		char *imap = group_imaps + (size_t) g * block_size;
+		char *bmap = (char*) block_map + (size_t) g * group_bmap_blks * block_size;
+		if (disk->ops->read(disk, group_start(g), group_bmap_blks, bmap) < 0 ||
+				disk->ops->read(disk, group_start(g) + group_bmap_blks, 1, imap) < 0 ||
+				disk->ops->read(disk, group_start(g) + group_bmap_blks + 1, group_itable_blks,
+						&inodes[g * inodes_per_group]) < 0) {
+			exit(1);
+		}
+		for (int i = 0; i < inodes_per_group; i++) {
+			if (bitmap_test(imap, i)) bitmap_set(inode_map, g * inodes_per_group + i);
 		}
 	}
+}
+
+/**
+ * init - this is called once by the FUSE framework at startup.
+ *
+ * This is a good place to read in the super-block and set up any
+ * global variables you need. You don't need to worry about the
+ * argument or the return value.
+ *
+ * The superblock, both bitmaps and the inode region are read once
+ * here and stay resident; every other operation works on the
+ * in-memory copies, marking changed blocks in the dirty array, so
+ * they never need to be re-read. Once the image is ready the flusher
+ * thread is started.
+ *
+ * @param conn: fuse connection information, NULL if not mounted
+ * @return: unused - returns NULL
+ *
+ * Note: if any block read operation fails, just exit(1) immediately.
+*/
+void* fs_init(struct fuse_conn_info *conn)
+{
+	// metadata stays resident for the life of the mount, so a
+	// second call (e.g. -cmdline and fuse both calling init) must
+	// release the previous copies rather than leak them
+	flusher_stop();
+	if (dirty != NULL) {
+		held_writeback_all(0);
+		flush_metadata();
+	}
+	journal_close();
+	bitmap_summary_free(inode_sum);
+	bitmap_summary_free(block_sum);
+	free(igroups);
+	free(group_imaps);
+	group_imaps = NULL;
+	free(blk_hints);
+	free(inode_map);
+	free(block_map);
+	free(inodes);
+	free(dirty);
+	free(lookups);
+	bmap_purge();
+	inode_locks_purge();
+	open_files_purge();
+	dcache_purge();
+	locks_init();
+
+	// reads in the low-level loop hand back ranges of the image file
+	// for the kernel to splice, and write data may arrive in a pipe
+	if (conn != NULL) {
+		conn->want |= conn->capable &
+				(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+
+	// read the superblock, then switch to the block size it gives
+	struct fs_super sb;
+	set_block_size(0);
+	read_super(&sb);
+	if(sb.magic != FS_MAGIC){
+		fprintf(stderr, "bad magic number in superblock: 0x%x\n", sb.magic);
+		exit(1);
+	}
+	if (sb.log_block_size > FS_MAX_LOG_BLOCK_SIZE) {
+		fprintf(stderr, "bad block size in superblock: %u\n", sb.log_block_size);
+		exit(1);
+	}
+	set_block_size(sb.log_block_size);
+
+	root_inode = sb.root_inode;
+
+	// number of blocks on device
+	if (sb.num_blocks > FS_MAX_BLOCKS) {
+		fprintf(stderr, "too many blocks in superblock: %u\n", sb.num_blocks);
+		exit(1);
+	}
+	if (sb.num_blocks > disk->ops->num_blocks(disk)) {
+		fprintf(stderr, "superblock has %u blocks, device only %lld\n", sb.num_blocks,
+				(long long) disk->ops->num_blocks(disk));
+		exit(1);
+	}
+	n_blocks = sb.num_blocks;
+
+	// replay the last metadata transaction if it was not completely
+	// written home, before any metadata is read, once the journal is
+	// known to lie within the image
+	if (sb.journal_len != 0 && (sb.journal_start == 0 ||
+			(int64_t) sb.journal_start + sb.journal_len > n_blocks)) {
+		fprintf(stderr, "journal at block %u, length %u, is outside the image\n",
+				sb.journal_start, sb.journal_len);
+		exit(1);
+	}
+	if (sb.journal_len != 0 &&
+			journal_open(disk, sb.journal_start, sb.journal_len, block_size) < 0) {
+		fprintf(stderr, "bad journal at block %u\n", sb.journal_start);
+		exit(1);
+	}
+
+	grouped = (sb.features & FS_FEAT_GROUPS) != 0;
+	if (grouped) {
+		read_groups(&sb);
+	} else {
+		/* The inode map and block map are directly after the superblock */
+		n_bgroups = 1;
+		blocks_per_group = n_blocks;
+		inodes_per_group = INODE_GROUP_BLKS * inodes_per_blk;
+
+		// read inode map
+		//CS492: your code below
+		inode_map_base = 1; // This is correct.
+		inode_map = malloc((size_t) sb.inode_map_sz * block_size); //allocate memory
+		if(disk->ops->read(disk, inode_map_base, sb.inode_map_sz, inode_map) < 0){ //reading, if fail exit(1)
+			exit(1);
+		}
+
+		// read block map
+		//CS492: your code below
+		block_map_base = 1 + sb.inode_map_sz;
+		block_map = malloc((size_t) sb.block_map_sz * block_size); //allocate memory
+		if(disk->ops->read(disk, block_map_base, sb.block_map_sz, block_map) < 0){ //reading, if fail exit(1)
+			exit(1);
+		}
+	
+		/* The inode data is in the next set of blocks */
+		//CS492: your code below
+		inode_base = block_map_base + sb.block_map_sz;
+		n_inodes = sb.inode_region_sz * inodes_per_blk; //calculating how many inodes there are
+		inodes = malloc((size_t) sb.inode_region_sz * block_size); //allocate memory
+		if(disk->ops->read(disk, inode_base, sb.inode_region_sz, inodes) < 0){ //reading, if fail exit(1)
+			exit(1);
+		}
+	}
+	bmaps = calloc(n_inodes, sizeof(struct bmap_cache*));
+	lookups = calloc(n_inodes, sizeof(unsigned long));
+	inode_locks_init();
+
+	// new extents of the files of each group are looked for from the
+	// start of its data blocks
+	blk_hints = calloc(n_bgroups, sizeof(int));
+	for (int g = 0; grouped && g < n_bgroups; g++) {
+		blk_hints[g] = group_data(g);
+	}
+
+	// images without FS_FEAT_SIZE64 keep sizes in old_size, the only
+	// size older binaries know, and files must stay within it until
+	// the image is upgraded with fs_upgrade
+	if (!(sb.features & FS_FEAT_SIZE64)) {
+		for (int i = 0; i < n_inodes; i++) {
+			inodes[i].size = inodes[i].old_size;
+		}
+		if (max_file_size > INT32_MAX) max_file_size = INT32_MAX;
+	}
+
+	// mark the image as in use until it is unmounted cleanly
+	if (sb.state != 0) {
+		sb.state = 0;
+		write_super(&sb);
+	}
+
+	// summaries of the maps, so that allocation need not scan them
+	inode_sum = bitmap_summary_create(inode_map, n_inodes);
+	block_sum = bitmap_summary_create(block_map, n_blocks);
+	if (inode_sum == NULL || block_sum == NULL) {
+		fprintf(stderr, "cannot allocate bitmap summaries\n");
+		exit(1);
+	}
+
+	// free counts come from the maps themselves: the counts saved in
+	// the superblock are left stale by binaries that do not know them
+	n_free_blks = bitmap_summary_count_zero(block_sum);
+	n_free_inodes = bitmap_summary_count_zero(inode_sum);
+
+	// free inodes and directories in each inode group
+	n_igroups = (n_inodes + inodes_per_group - 1) / inodes_per_group;
+	igroups = calloc(n_igroups, sizeof(struct inode_group));
+	if (igroups == NULL) {
+		fprintf(stderr, "cannot allocate inode groups\n");
+		exit(1);
+	}
+	n_dirs = 0;
+	dir_rotor = 0;
+	for (int i = 0; i < n_inodes; i++) {
+		struct inode_group *ig = &igroups[i / inodes_per_group];
+		if (!bitmap_test(inode_map, i)) {
+			ig->free++;
+		} else if (S_ISDIR(inodes[i].mode)) {
+			ig->dirs++;
+			n_dirs++;
+		}
+	}
+
+	// dirty metadata blocks
+	dirty_len = inode_base + n_inodes / inodes_per_blk;
+	dirty = calloc(dirty_len*sizeof(void*), 1);
+	n_dirty = 0;
+	last_flush = time(NULL);
+	n_handles = credits_held = 0;
+	commit_wanted = false;
+
+	// every journal handle must fit in a transaction on its own
+	int credits = map_credits(HANDLE_BLKS);
+	if (credits < free_credits()) credits = free_credits();
+	if (credits < NS_CREDITS) credits = NS_CREDITS;
+	if (journal_active() && journal_space() < credits) {
+		fprintf(stderr, "journal at block %u is too small: %d blocks per transaction, %d needed\n",
+				sb.journal_start, journal_space(), credits);
+		exit(1);
+	}
+
+	// free the inodes that were removed while still in use when the
+	// image was last mounted, and the rest of the blocks of files
+	// being truncated
+	for (int i = 0; i < n_inodes; i++) {
+		if (!bitmap_test(inode_map, i)) continue;
+		if (inodes[i].flags & FS_INODE_ORPHAN) {
+			inode_put(i);
+		} else if (inodes[i].flags & FS_INODE_TRUNC) {
+			inode_lock(i, true);
+			fs_free_blocks(i);
+			inode_unlock(i);
+		}
+	}
+
+	flusher_start();
+	return NULL;
+}
+
+/**
+ * destroy - this is called once by the FUSE framework at unmount.
+ *
+ * Stops the flusher thread, writes back held blocks, commits dirty
+ * metadata, flushes the device, records the free block and inode
+ * counts in the superblock and marks
+ * the image as cleanly unmounted. If the metadata could not be
+ * written, the image stays marked as in use.
+ *
+ * @param private_data: unused
+ */
+void fs_destroy(void *private_data)
+{
+	flusher_stop();
+	held_writeback_all(0);
+	int res = flush_metadata();
+	if (journal_close() < 0) res = -EIO;
+	if (res < 0) {
+		fprintf(stderr, "cannot write metadata at unmount\n");
+		return;
+	}
+
+	struct fs_super sb;
+	read_super(&sb);
+	sb.free_blocks = n_free_blks;
+	sb.free_inodes = n_free_inodes;
+	sb.state = FS_CLEAN;
+	write_super(&sb);
+	if (disk->ops->flush(disk, 0, n_blocks) < 0) exit(1);
+}
+
+/* Note on path translation errors:
+ * In addition to the method-specific errors listed below, almost
+ * every method can return one of the following errors if it fails to
+ * locate a file or directory corresponding to a specified path.
+ *
+ * ENOENT - a component of the path is not present.
+ * ENOTDIR - an intermediate component of the path (e.g. 'b' in
+ *           /a/b/c) is not a directory
+ */
+
+/* note on splitting the 'path' variable:
+ * the value passed in by the FUSE framework is declared as 'const',
+ * which means you can't modify it. The standard mechanisms for
+ * splitting strings in C (strtok, strsep) modify the string in place,
+ * so you have to copy the string and then free the copy when you're
+ * done. One way of doing this:
+ *
+ *    char *_path = strdup(path);
+ *    int inum = translate(_path);
+ *    free(_path);
+ */
+
+/**
+ * Get the attributes of an inode.
+ *
+ * @param inum: the inode number
+ * @param sb: pointer to stat struct
+ * @return: 0
+ */
+static int ino_getattr(int inum, struct stat *sb)
+{
+	inode_lock(inum, false);
+	cpy_stat(&inodes[inum], sb);
+	inode_unlock(inum);
+	return SUCCESS;
+}
+
+/**
+ * getattr - get file or directory attributes. For a description of
+ * the fields in 'struct stat', see 'man lstat'.
+ *
+ * Note: you can handle some fields as follows:
+ * st_nlink: always set to 1
+ * st_atime, st_ctime: set to same value as st_mtime
+ *
+ * @param path: the file path
+ * @param sb: pointer to stat struct
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT  - a component of the path is not present
+ *	-ENOTDIR - an intermediate component of path not a directory
+*/
+static int fs_getattr(const char *path, struct stat *sb)
+{
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	return ino_getattr(inode_idx, sb);
+}
+
+/**
+ * opendir - open file directory
+ *
+ * You can save information about the open directory in fi->fh.
+ * If you allocate memory, free it in fs_releasedir.
+ *
+ * @param path: the file path
+ * @param fi: fuse file system information
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOENT  - a component of the path is not present
+ *	-ENOTDIR - an intermediate component of path not a directory
+*/
+static int fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
+	fi->fh = (uint64_t) inode_idx;
+	return SUCCESS;
+}
+
+/** filler and its buffer, for fill_dir_blk */
+struct fill_args {
+	void *ptr;
+	fuse_fill_dir_t filler;
+};
+
+/**
+ * Pass the entries of a directory block to a readdir filler.
+ *
+ * @param de: ptr to first entry in the block
+ * @param arg: the fill_args
+ * @return 0 to go on to the next block
+ */
+static int fill_dir_blk(struct fs_dirent *de, void *arg)
+{
+	struct fill_args *args = arg;
+	struct stat sb;
+	for (int i = 0; i < dirents_per_blk; i++) {
+		if (de[i].valid) {
+			inode_lock(de[i].inode, false);
+			cpy_stat(&inodes[de[i].inode], &sb);
+			inode_unlock(de[i].inode);
+			args->filler(args->ptr, de[i].name, &sb, 0);
+		}
+	}
+	return 0;
+}
+
+/**
+ * readdir - get directory contents
+ *
+ * For each entry in the directory, invoke the 'filler' function,
+ * which is passed as a function pointer, as follows:
+ * filler(buf, <name>, <statbuf>, 0)
+ * where <statbuf> is a struct stat, just like in getattr.
+ *
+ * @param path: the directory path
+ * @param ptr: filler buf pointer
+ * @param filler filler function to call for each entry
+ * @param offset: the file offset -- unused
+ * @param fi: the fuse file information -- you do not have to use it
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT  - a component of the path is not present
+ * 	-ENOTDIR - an intermediate component of path not a directory
+ *
+ * Note: the blocks of an indexed directory are read in block order,
+ * not in hash order.
+*/
+static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	struct fs_inode *inode = &inodes[inode_idx];
+	if (!S_ISDIR(inode->mode)) return -ENOTDIR;
+	struct fill_args args = { ptr, filler };
+	dir_scan(inode, fill_dir_blk, &args);
+	return SUCCESS;
+}
+
+/**
+ * Release resources when directory is closed.
+ * If you allocate memory in fs_opendir, free it here.
+ *
+ * @param path: the directory path
+ * @param fi: fuse file system information -- you do not have to use it
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOENT  - a component of the path is not present
+ *	-ENOTDIR - an intermediate component of path not a directory
+*/
+static int fs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	if (!S_ISDIR(inodes[inode_idx].mode)) return -ENOTDIR;
+	fi->fh = (uint64_t) -1;
+	return SUCCESS;
+}
+
+/**
+ * Allocate and initialize an inode, and add an entry for it to a
+ * directory.
+ *
+ * @param parent: the directory inode number
+ * @param name: the entry name
+ * @param mode: the mode of the new inode, including its type
+ * @param isDir: true to give the new inode an empty directory block
+ * @return: the new inode number, or -ENOSPC
+ */
+static int set_attributes_and_update(int parent, char *name, mode_t mode, bool isDir)
+{
+	//get free inode and directory block
+	int freei = get_free_inode(parent, isDir);
+	if (freei < 0) return -ENOSPC;
+	int goal = grouped ? group_data(inode_bgroup(freei)) : 0;
+	int freeb = isDir ? get_free_blk(goal, true) : 0;
+	if (freeb < 0) {
+		return_inode(freei, isDir);
+		return -ENOSPC;
+	}
+	int res = dir_add(parent, name, freei);
+	if (res < 0) {
+		if (freeb) return_blk(freeb);
+		return_inode(freei, isDir);
+		return res;
+	}
+	struct fs_inode *inode = &inodes[freei];
+	memset(inode, 0, sizeof(struct fs_inode));
+	inode->uid = getuid();
+	inode->gid = getgid();
+	inode->mode = mode;
+	inode->ctime = inode->mtime = time(NULL);
+	inode->size = 0;
+	inode->direct[0] = freeb;
+	//update map and inode
+	update_inode(freei);
+	return freei;
+}
+
+/**
+ * Create a file or directory in a directory.
+ *
+ * @param parent: the directory inode number
+ * @param name: the entry name, shorter than FS_FILENAME_SIZE
+ * @param mode: the mode, including S_IFREG or S_IFDIR
+ * @return: the new inode number, or -error number
+ * 	-ENOTDIR  - parent not a directory
+ * 	-EEXIST   - file already exists
+ * 	-ENOSPC   - free inode not available
+ * 	-ENOSPC   - no space for the directory to grow
+ */
+static int ino_create(int parent, char *name, mode_t mode)
+{
+	if (!S_ISDIR(inodes[parent].mode)) return -ENOTDIR;
+	if (lookup(parent, name) >= 0) return -EEXIST;
+	handle_begin(NS_CREDITS);
+	int inum = set_attributes_and_update(parent, name, mode, S_ISDIR(mode));
+	handle_end(NS_CREDITS);
+	if (inum < 0) return inum;
+	dcache_invalidate(parent, name);
+	return inum;
+}
+
+/**
+ * mknod - create a new regular file with permissions (mode & 01777).
+ * Behavior undefined when mode bits other than the low 9 bits are used.
+ *
+ * @param path: the file path
+ * @param mode: indicating block or character-special file
+ * @param dev: the character or block I/O device specification - you do not have to use it
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOTDIR  - component of path not a directory
+ * 	-EEXIST   - file already exists
+ * 	-ENOSPC   - free inode not available
+ * 	-ENOSPC   - no space for the directory to grow
+*/
+static int fs_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	//get current and parent inodes
+	mode |= S_IFREG;
+	if (!S_ISREG(mode) || strcmp(path, "/") == 0) return -EINVAL;
+	char *_path = strdup(path);
+	char name[FS_FILENAME_SIZE];
+	int parent_inode_idx = translate_1(_path, name);
+	free(_path);
+	if (parent_inode_idx < 0) return parent_inode_idx;
+
+	//assign inode and directory and update
+	int res = ino_create(parent_inode_idx, name, mode);
+	return (res < 0) ? res : SUCCESS;
+}
+
+/**
+ * mkdir - create a directory with the given mode. Behavior undefined
+ * when mode bits other than the low 9 bits are used.
+ *
+ * @param path: path to directory
+ * @param mode: the mode for the new directory
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOTDIR  - component of path not a directory
+ * 	-EEXIST   - file already exists
+ * 	-ENOSPC   - free inode not available
+ * 	-ENOSPC   - no space for the directory to grow
+ *
+ * Note: fs_mkdir is the same as fs_mknod except that fs_mknod creates
+ * a regular file while fs_mkdir creates a directory.
+*/
+static int fs_mkdir(const char *path, mode_t mode)
+{
+	//CS492: your code here
+	//get current and parent inodes
+	mode |= S_IFDIR;
+	if (!S_ISDIR(mode) || strcmp(path, "/") == 0) return -EINVAL;
+	char *_path = strdup(path);
+	char name[FS_FILENAME_SIZE];
+	int parent_inode_idx = translate_1(_path, name);
+	free(_path);
+	if (parent_inode_idx < 0) return parent_inode_idx;
+
+	//assign inode and directory and update
+	int res = ino_create(parent_inode_idx, name, mode);
+	return (res < 0) ? res : SUCCESS;
+}
+
+/**
+ * Truncate a file to exactly 'len' bytes.
+ *
+ * @param inum: the inode number
+ * @param len: the length, only 0 is supported
+ * @return: 0 if successful, or -EINVAL or -EISDIR
+ */
+static int ino_truncate(int inum, off_t len)
+{
+	if (len != 0) return -EINVAL;
+	struct fs_inode *inode = &inodes[inum];
+	if (S_ISDIR(inode->mode)) return -EISDIR;
+
+	inode_lock(inum, true);
+	wait_unpinned(inum);
+	fs_free_blocks(inum);
+	inode_unlock(inum);
+	return SUCCESS;
+}
+
+/**
+ * truncate - truncate file to exactly 'len' bytes.
+ *
+ * Errors:
+ *   ENOENT  - file does not exist
+ *   ENOTDIR - component of path not a directory
+ *   EINVAL  - length invalid (only supports 0)
+ *   EISDIR	 - path is a directory (only files)
+ *
+ * @param path the file path
+ * @param len the length
+ * @return 0 if successful, or error value
+ */
+static int fs_truncate(const char *path, off_t len)
+{
+	if (len != 0) return -EINVAL; /* invalid argument */
+
+	//get inode
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	return ino_truncate(inode_idx, len);
+}
+
+/**
+ * Remove a file from a directory. The file is freed now, or when it
+ * is no longer in use.
+ *
+ * @param parent: the directory inode number
+ * @param name: the entry name
+ * @return 0 if successful, or -ENOENT, -ENOTDIR or -EISDIR
+ */
+static int ino_unlink(int parent, char *name)
+{
+	if (!S_ISDIR(inodes[parent].mode)) return -ENOTDIR;
+	int inum = lookup(parent, name);
+	if (inum < 0) return inum;
+	if (S_ISDIR(inodes[inum].mode)) return -EISDIR;
+
+	//remove entire entry from parent dir
+	handle_begin(NS_CREDITS);
+	dir_remove(&inodes[parent], name);
+	dcache_invalidate(parent, name);
+	inode_orphan(inum);
+	handle_end(NS_CREDITS);
+	inode_put(inum);
+	return SUCCESS;
+}
+
+/**
+ * unlink - delete a file
+ *
+ * @param path: path to file
+ *
+ * @return 0 if successful, or error value
+ *	-ENOENT   - file does not exist
+ * 	-ENOTDIR  - component of path not a directory
+ * 	-EISDIR   - cannot unlink a directory
+*/
+static int fs_unlink(const char *path)
+{
+	char *_path = strdup(path);
+	char name[FS_FILENAME_SIZE];
+	int parent_inode_idx = translate_1(_path, name);
+	free(_path);
+	if (parent_inode_idx < 0) return parent_inode_idx;
+	return ino_unlink(parent_inode_idx, name);
+}
+
+/**
+ * Check whether a directory block has any entries.
+ *
+ * @param de ptr to first entry in the block
+ * @param arg unused
+ * @return 1 if the block has entries, 0 if not
+ */
+static int dir_blk_in_use(struct fs_dirent *de, void *arg)
+{
+	return !is_empty_dir(de);
+}
+
+/**
+ * Remove an empty directory from its parent directory.
+ *
+ * @param parent: the parent directory inode number
+ * @param name: the entry name
+ * @return: 0 if successful, or -ENOENT, -ENOTDIR or -ENOTEMPTY
+ */
+static int ino_rmdir(int parent, char *name)
+{
+	if (!S_ISDIR(inodes[parent].mode)) return -ENOTDIR;
+	int inum = lookup(parent, name);
+	if (inum < 0) return inum;
+	struct fs_inode *inode = &inodes[inum];
+	if (!S_ISDIR(inode->mode)) return -ENOTDIR;
+
+	//check if dir if empty
+	if (dir_scan(inode, dir_blk_in_use, NULL) != 0) return -ENOTEMPTY;
+
+	//remove entry from parent dir
+	handle_begin(NS_CREDITS);
+	dir_remove(&inodes[parent], name);
+	dcache_invalidate(parent, name);
+	dcache_invalidate_dir(inum);
+	inode_orphan(inum);
+	handle_end(NS_CREDITS);
+	inode_put(inum);
+	return SUCCESS;
+}
+
+/**
+ * rmdir - remove a directory
+ *
+ * @param path: the path of the directory
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - file does not exist
+ *  	-ENOTDIR  - component of path not a directory
+ *  	-ENOTDIR  - path not a directory
+ *  	-ENOEMPTY - directory not empty
+ *
+ * Note: this is similar to deleting a file, except that we delete
+ * a directory.
+*/
+static int fs_rmdir(const char *path)
+{
+	//can not remove root
+	if (strcmp(path, "/") == 0) return -EINVAL;
+
+	//get inodes and check
+	//CS492: your code below
+	char *_path = strdup(path);
+	char name[FS_FILENAME_SIZE];
+	int parent_inode_idx = translate_1(_path, name);
+	free(_path);
+	if (parent_inode_idx < 0) return -ENOENT;
+	return ino_rmdir(parent_inode_idx, name);
+}
+
+/**
+ * Rename an entry within a directory.
+ *
+ * @param parent: the directory inode number
+ * @param src_name: the entry name
+ * @param dst_name: the new name
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - source does not exist
+ * 	-ENOTDIR  - parent not a directory
+ * 	-EEXIST   - destination already exists
+ * 	-ENOSPC   - no space for the directory to grow
+ */
+static int ino_rename(int parent, char *src_name, char *dst_name)
+{
+	struct fs_inode *parent_inode = &inodes[parent];
+	if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+	int inum = lookup(parent, src_name);
+	if (inum < 0) return inum;
+	if (lookup(parent, dst_name) >= 0) return -EEXIST;
+
+	//the new name may hash to another leaf, so remove and re-add;
+	//the old name can always go back in the slot it just freed
+	handle_begin(NS_CREDITS);
+	dir_remove(parent_inode, src_name);
+	int res = dir_add(parent, dst_name, inum);
+	if (res < 0) dir_add(parent, src_name, inum);
+	handle_end(NS_CREDITS);
+	if (res < 0) return res;
+	dcache_invalidate(parent, src_name);
+	dcache_invalidate(parent, dst_name);
+	return SUCCESS;
+}
+
+/**
+ * rename - rename a file or directory. You can assume the destination
+ * and the source share the same path-prefix so the renaming changes
+ * the name without moving the file or directory into another file or
+ * directory.
+ *
+ * Note that this is a simplified version of the UNIX rename
+ * functionality - see 'man 2 rename' for full semantics. In
+ * particular, the full version can move across directories, replace a
+ * destination file, and replace an empty directory with a full one.
+ *
+ * @param src_path: the source path
+ * @param dst_path: the destination path
+ *
+ * @return: 0 if successful, or -error number
+ * 	-ENOENT   - source file or directory does not exist
+ * 	-ENOTDIR  - component of source or target path not a directory
+ * 	-EEXIST   - destination already exists
+ * 	-EINVAL   - source and destination not in the same directory
+*/
+static int fs_rename(const char *src_path, const char *dst_path)
+{
+	//deep copy both path
+	char *_src_path = strdup(src_path);
+	char *_dst_path = strdup(dst_path);
+	//get parent directory inodes
+	char src_name[FS_FILENAME_SIZE];
+	char dst_name[FS_FILENAME_SIZE];
+	int src_parent_inode_idx = translate_1(_src_path, src_name);
+	int dst_parent_inode_idx = translate_1(_dst_path, dst_name);
+	free(_src_path);
+	free(_dst_path);
+	if (src_parent_inode_idx < 0) return src_parent_inode_idx;
+
+	//src and dst should be in the same directory (same parent)
+	if (src_parent_inode_idx != dst_parent_inode_idx) return -EINVAL;
+	return ino_rename(src_parent_inode_idx, src_name, dst_name);
+}
+
+/**
+ * Change the permissions of an inode; its type stays the same.
+ *
+ * @param inum: the inode number
+ * @param mode: the new permissions
+ * @return: 0
+ */
+static int ino_chmod(int inum, mode_t mode)
+{
+	struct fs_inode *inode = &inodes[inum];
+	inode_lock(inum, true);
+	//protect system from other modes
+	mode |= S_ISDIR(inode->mode) ? S_IFDIR : S_IFREG;
+	//change through reference
+	handle_begin(INODE_CREDITS);
+	inode->mode = mode;
+	update_inode(inum);
+	handle_end(INODE_CREDITS);
+	inode_unlock(inum);
+	return SUCCESS;
+}
+
+/**
+ * chmod - change file permissions
+ *
+ * @param path: the file or directory path
+ * @param mode: the mode_t mode value -- see man 'chmod'
+ * for description
+ *
+ *  @return: 0 if successful, or -error number
+ *  	-ENOENT   - file does not exist
+ *  	-ENOTDIR  - component of path not a directory
+*/
+static int fs_chmod(const char *path, mode_t mode)
+{
+	char* _path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	return ino_chmod(inode_idx, mode);
+}
+
+/**
+ * Change the modification time of an inode.
+ *
+ * @param inum: the inode number
+ * @param mtime: the new modification time
+ * @return: 0
+ */
+static int ino_utime(int inum, time_t mtime)
+{
+	inode_lock(inum, true);
+	handle_begin(INODE_CREDITS);
+	inodes[inum].mtime = mtime;
+	update_inode(inum);
+	handle_end(INODE_CREDITS);
+	inode_unlock(inum);
+	return SUCCESS;
+}
+
+/**
+ * utime - change modification time.
+ *
+ * @param path the file or directory path.
+ * @param ut utimbuf - see man 'utime' for description.
+ * @return 0 if successful, or error value
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ */
+int fs_utime(const char *path, struct utimbuf *ut)
+{
+	//similar to chmod except changing modification time instead of file permissions
+	char* _path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if(inode_idx < 0){
+		return inode_idx;
+	}
+	return ino_utime(inode_idx, ut->modtime);
+}
+
+/**
+ * Open a file by inode number, saving the index of its open file
+ * table entry in fi->fh.
+ *
+ * @param inum: the inode number
+ * @param fi: file info data
+ * @return: 0 if successful, or -EISDIR or -ENOMEM
+ */
+static int ino_open(int inum, struct fuse_file_info *fi)
+{
+	if (S_ISDIR(inodes[inum].mode)) return -EISDIR;
+	int fh = open_file_new(inum);
+	if (fh < 0) return fh;
+	inode_lock(inum, true);
+	int res = bmap_attach(inum);
+	inode_unlock(inum);
+	if (res < 0) {
+		open_file_free(fh);
+		return -ENOMEM;
+	}
+	fi->fh = (uint64_t) fh;
+	return SUCCESS;
+}
+
+/**
+ * Open a filesystem file or directory path. The path is resolved
+ * once here; read, write and release find the file through the
+ * open file table entry saved in fi->fh. The inode gets a block
+ * map cache, so that reads and writes need not re-read its pointer
+ * blocks.
+ *
+ * @param path: the path
+ * @param fuse: file info data
+ *
+ * @return: 0 if successful, or -error number
+ *	-ENOENT   - file does not exist
+ *	-ENOTDIR  - component of path not a directory
+ *	-EISDIR   - path is a directory
+ *	-ENOMEM   - open file table cannot grow
+*/
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+	char *_path = strdup(path);
+	int inode_idx = translate(_path);
+	free(_path);
+	if (inode_idx < 0) return inode_idx;
+	return ino_open(inode_idx, fi);
+}
+
+/**
+ * Read part of a run of physically contiguous blocks. Whole blocks
+ * are read straight into buf with a single device read; a partial
+ * first or last block goes through a block buffer.
+ *
+ * @param blk: the first physical block of the run, 0 if not allocated
+ * @param nblks: number of blocks in the run
+ * @param buf: the buffer for the data
+ * @param offset: offset of the data within the first block
+ * @param len: number of bytes to read
+ */
+static void fs_read_run(uint32_t blk, int nblks, char *buf, size_t offset, size_t len)
+{
+	char block[block_size];
+
+	//unallocated blocks read as zeros
+	if (blk == 0) {
+		memset(buf, 0, len);
+		return;
+	}
+
+	//partial first block
+	if (offset != 0 || len < block_size) {
+		size_t n = block_size - offset < len ? block_size - offset : len;
+		if (disk->ops->read(disk, blk, 1, block) < 0) exit(1);
+		memcpy(buf, block + offset, n);
+		buf += n;
+		len -= n;
+		blk++;
+		nblks--;
+	}
+
+	//whole blocks
+	int nwhole = len >> block_shift;
+	if (nwhole > 0) {
+		if (disk->ops->read(disk, blk, nwhole, buf) < 0) exit(1);
+		buf += nwhole * block_size;
+		len -= nwhole * block_size;
+		blk += nwhole;
+	}
+
+	//partial last block
+	if (len > 0) {
+		if (disk->ops->read(disk, blk, 1, block) < 0) exit(1);
+		memcpy(buf, block, len);
+	}
+}
+
+/**
+ * Read ahead of a sequential reader into the block cache.
+ *
+ * A read that starts where the previous one on the same open file
+ * ended is sequential. Once a sequential reader is into the second
+ * half of the blocks already read ahead, the next window of blocks
+ * is prefetched, and the window doubles up to RA_MAX_BLKS. A read
+ * anywhere else halves the window, down to RA_MIN_BLKS, and starts
+ * over.
+ *
+ * @param of: the open file
+ * @param inode: the file inode
+ * @param offset: offset of the read just done
+ * @param len: length of the read just done
+ */
+static void fs_readahead(struct open_file *of, struct fs_inode *inode, off_t offset, size_t len)
+{
+	//reads on the same open file may run at once; settle the window
+	//under open_lock, then read ahead without it
+	lock_mutex(&open_lock, &open_stats);
+	bool sequential = (offset == of->ra_next);
+	of->ra_next = offset + len;
+	int start = 0, n = 0;
+	if (!sequential) {
+		of->ra_window = of->ra_window / 2 < RA_MIN_BLKS ? RA_MIN_BLKS : of->ra_window / 2;
+		of->ra_end = 0;
+	} else {
+		int last = (offset + len - 1) >> block_shift;
+		if (of->ra_end - last <= of->ra_window / 2) {
+			start = of->ra_end > last ? of->ra_end : last + 1;
+			n = ((file_size(inode) + block_size - 1) >> block_shift) - start;
+			if (n > of->ra_window) n = of->ra_window;
+		}
+		if (n > 0) {
+			of->ra_end = start + n;
+			of->ra_window = of->ra_window * 2 > RA_MAX_BLKS ? RA_MAX_BLKS : of->ra_window * 2;
+		}
+	}
+	pthread_mutex_unlock(&open_lock);
+	if (n <= 0) return;
+
+	//prefetch each run of contiguous blocks, skipping holes
+	uint32_t blks[n];
+	fs_bmap(inode, start, n, blks);
+	for (int i = 0, run; i < n; i += run) {
+		run = 1;
+		while (i + run < n && blks[i] != 0 && blks[i + run] == blks[i] + run) {
+			run++;
+		}
+		if (blks[i] != 0 && cache_prefetch(disk, blks[i], run) == E_UNAVAIL) {
+			return; //no cache to read into
+		}
+	}
+}
+
+/**
+ * Read part of a block that has no disk block: the data held for it
+ * in memory, or zeros if it is not held.
+ *
+ * @param bc: block map cache of the file, or NULL
+ * @param lblk: the logical block
+ * @param buf: the buffer for the data
+ * @param offset: offset of the data within the block
+ * @param len: number of bytes to read
+ */
+static void fs_read_hole(struct bmap_cache *bc, int lblk, char *buf, size_t offset, size_t len)
+{
+	char *data = held_find(bc, lblk);
+	if (data != NULL) {
+		memcpy(buf, data + offset, len);
+	} else {
+		memset(buf, 0, len);
+	}
+}
+
+/**
+ * read - read data from an open file.
+ *
+ * @param path: the path to the file -- unused, the file is found through fi
+ * @param buf: the buffer to keep the data
+ * @param len: the number of bytes to read
+ * @param offset: the location to start reading at
+ * @param fi: fuse file info, fi->fh set by fs_open
+ *
+ * @return: return exactly the number of bytes requested, except:
+ * - if offset >= file len, return 0
+ * - if offset+len > file len, return bytes from offset to EOF
+ * - on error, return <0
+ * 	-EBADF   - fi does not refer to an open file
+ * 	-EIO     - error reading block
+ *
+ * Note: the blocks to read are mapped first, and then each run of
+ * physically contiguous blocks is read with one device read; blocks
+ * not written back yet are read from memory. After
+ * that, a sequential reader gets the blocks after them read ahead.
+*/
+static int fs_read(const char *path, char *buf, size_t len, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	if (of == NULL) return -EBADF;
+	struct fs_inode *inode = &inodes[of->inum];
+	inode_lock(of->inum, false);
+	off_t size = file_size(inode);
+	if(offset >= size){
+		inode_unlock(of->inum);
+		return 0;
+	}
+
+	//len need to read
+	if(size - offset < len){
+		len = size - offset;
+	}
+
+	//map the blocks to read
+	int first = offset >> block_shift;
+	int nblks = ((offset + len - 1) >> block_shift) - first + 1;
+	uint32_t blks[nblks];
+	fs_bmap(inode, first, nblks, blks);
+
+	//read each run of contiguous blocks
+	size_t blk_offset = offset & (block_size - 1);
+	size_t len_read = 0;
+	for (int i = 0; i < nblks; ) {
+		int n = 1;
+		while (i + n < nblks && blks[i] != 0 && blks[i + n] == blks[i] + n) {
+			n++;
+		}
+		size_t run_len = (size_t) n * block_size - blk_offset;
+		if (run_len > len - len_read) {
+			run_len = len - len_read;
+		}
+		if (blks[i] != 0) {
+			fs_read_run(blks[i], n, buf + len_read, blk_offset, run_len);
+		} else {
+			fs_read_hole(bmaps[of->inum], first + i, buf + len_read, blk_offset, run_len);
+		}
+		len_read += run_len;
+		blk_offset = 0;
+		i += n;
+	}
+
+	fs_readahead(of, inode, offset, len_read);
+	inode_unlock(of->inum);
+	return (int) len_read;
+}
+
+/**
+ * Free a buffer vector made by fs_read_buf.
+ *
+ * @param bufv: the buffer vector, or NULL
+ */
+static void free_bufvec(struct fuse_bufvec *bufv)
+{
+	if (bufv == NULL) return;
+	for (size_t i = 0; i < bufv->count; i++) {
+		free(bufv->buf[i].mem);
+	}
+	free(bufv);
+}
+
+/**
+ * Read data from an open file into a buffer vector, with one buffer
+ * per run of physically contiguous blocks. If the caller can pin the
+ * file and the device can say where a run lies in the image file,
+ * the run's buffer names that part of the image file instead of
+ * holding a copy, so FUSE can splice the data to the kernel without
+ * it passing through this process. Other runs, holes and blocks not
+ * written back yet, are read into memory, and only those reads are
+ * followed by readahead into the block cache.
+ *
+ * A buffer naming the image file is only read after this returns,
+ * when the reply is sent, so the file is pinned until then: truncate
+ * waits for read_unpin before freeing blocks another file could then
+ * be given.
+ *
+ * @param fi: fuse file info, fi->fh set by fs_open
+ * @param bufp: set to the buffer vector, freed by the caller
+ * @param len: the number of bytes to read
+ * @param offset: the location to start reading at
+ * @param pinned: NULL to copy every run, or set to whether the file
+ *   was pinned, in which case the caller calls read_unpin once the
+ *   reply is sent
+ *
+ * @return: 0 if successful, with as many bytes in the buffers as
+ *   fs_read would return, or <0 on error
+ * 	-EBADF   - fi does not refer to an open file
+ * 	-ENOMEM  - buffers cannot be allocated
+*/
+static int read_bufvec(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t len,
+		off_t offset, bool *pinned)
+{
+	struct open_file *of = open_file_get(fi);
+	if (of == NULL) return -EBADF;
+	if (pinned != NULL) *pinned = false;
+	struct fs_inode *inode = &inodes[of->inum];
+	inode_lock(of->inum, false);
+	off_t size = file_size(inode);
+	if (offset >= size) {
+		len = 0;
+	} else if (size - offset < len) {
+		len = size - offset;
+	}
+	if (len == 0) {
+		inode_unlock(of->inum);
+		*bufp = malloc(sizeof(struct fuse_bufvec));
+		if (*bufp == NULL) return -ENOMEM;
+		**bufp = FUSE_BUFVEC_INIT(0);
+		return 0;
+	}
+
+	//map the blocks to read, and count the runs
+	int first = offset >> block_shift;
+	int nblks = ((offset + len - 1) >> block_shift) - first + 1;
+	uint32_t blks[nblks];
+	fs_bmap(inode, first, nblks, blks);
+	int nruns = 1;
+	for (int i = 1; i < nblks; i++) {
+		if (blks[i - 1] == 0 || blks[i] != blks[i - 1] + 1) {
+			nruns++;
+		}
+	}
+	struct fuse_bufvec *bufv = calloc(1, sizeof(struct fuse_bufvec) +
+			(nruns - 1) * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		inode_unlock(of->inum);
+		return -ENOMEM;
+	}
+
+	//a buffer for each run of contiguous blocks
+	size_t blk_offset = offset & (block_size - 1);
+	size_t len_read = 0;
+	bool mapped = false;
+	for (int i = 0; i < nblks; ) {
+		int n = 1;
+		while (i + n < nblks && blks[i] != 0 && blks[i + n] == blks[i] + n) {
+			n++;
+		}
+		size_t run_len = (size_t) n * block_size - blk_offset;
+		if (run_len > len - len_read) {
+			run_len = len - len_read;
+		}
+		struct fuse_buf *b = &bufv->buf[bufv->count++];
+		b->size = run_len;
+		int fd;
+		off_t pos;
+		if (pinned != NULL && blks[i] != 0 && disk->ops->map != NULL &&
+				disk->ops->map(disk, blks[i], n, false, &fd, &pos) == SUCCESS) {
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->fd = fd;
+			b->pos = pos + blk_offset;
+			mapped = true;
+		} else if ((b->mem = malloc(run_len)) != NULL) {
+			b->fd = -1;
+			if (blks[i] != 0) {
+				fs_read_run(blks[i], n, b->mem, blk_offset, run_len);
+			} else {
+				fs_read_hole(bmaps[of->inum], first + i, b->mem, blk_offset, run_len);
+			}
+		} else {
+			inode_unlock(of->inum);
+			free_bufvec(bufv);
+			return -ENOMEM;
+		}
+		len_read += run_len;
+		blk_offset = 0;
+		i += n;
+	}
+
+	if (mapped) {
+		lock_mutex(&open_lock, &open_stats);
+		bmaps[of->inum]->pins++;
+		pthread_mutex_unlock(&open_lock);
+		*pinned = true;
+	} else {
+		fs_readahead(of, inode, offset, len_read);
+	}
+	inode_unlock(of->inum);
+	*bufp = bufv;
+	return 0;
+}
+
+/**
+ * Drop the pin read_bufvec put on a file once the reply that splices
+ * from its blocks has been sent.
+ *
+ * @param fi: fuse file info of the read
+ */
+static void read_unpin(struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	lock_mutex(&open_lock, &open_stats);
+	if (--bmaps[of->inum]->pins == 0) {
+		pthread_cond_broadcast(&unpin_cond);
+	}
+	pthread_mutex_unlock(&open_lock);
+}
+
+/**
+ * read_buf - read data from an open file into a buffer vector. The
+ * high-level API sends the reply after this returns with no call
+ * back once it is sent, so the file cannot be pinned and every run
+ * is copied; the low-level loop splices.
+ *
+ * @param path: the path to the file -- unused, the file is found through fi
+ * @param bufp: set to the buffer vector, freed by the caller
+ * @param len: the number of bytes to read
+ * @param offset: the location to start reading at
+ * @param fi: fuse file info, fi->fh set by fs_open
+ *
+ * @return: 0 if successful, or <0 on error, as for read_bufvec
+*/
+static int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t len,
+		off_t offset, struct fuse_file_info *fi)
+{
+	return read_bufvec(fi, bufp, len, offset, NULL);
+}
+
+/**
+ * Copy the next bytes of a write's data into memory.
+ *
+ * @param src: the data, advanced past the bytes copied
+ * @param dst: the buffer for the bytes
+ * @param len: number of bytes to copy
+ */
+static void buf_get(struct fuse_bufvec *src, void *dst, size_t len)
+{
+	struct fuse_bufvec dstv = FUSE_BUFVEC_INIT(len);
+	dstv.buf[0].mem = dst;
+	if (fuse_buf_copy(&dstv, src, 0) != (ssize_t) len) exit(1);
+}
+
+/**
+ * Write whole blocks from the next bytes of a write's data. Data
+ * still in a pipe is spliced straight into the image file where the
+ * device allows it; data in memory is written from where it is.
+ *
+ * @param blk: the first physical block
+ * @param nblks: number of blocks
+ * @param src: the data, advanced past the bytes written
+ */
+static void fs_write_whole(uint32_t blk, int nblks, struct fuse_bufvec *src)
+{
+	size_t len = (size_t) nblks * block_size;
+	struct fuse_buf *b = &src->buf[src->idx];
+	int fd;
+	off_t pos;
+
+	if (!(b->flags & FUSE_BUF_IS_FD) && b->size - src->off >= len) {
+		if (disk->ops->write(disk, blk, nblks, (char*) b->mem + src->off) < 0) exit(1);
+		src->off += len;
+		if (src->off == b->size) {
+			src->idx++;
+			src->off = 0;
+		}
+		return;
+	}
+	if ((b->flags & FUSE_BUF_IS_FD) && disk->ops->map != NULL &&
+			disk->ops->map(disk, blk, nblks, true, &fd, &pos) == SUCCESS) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fd;
+		dst.buf[0].pos = pos;
+		if (fuse_buf_copy(&dst, src, 0) != (ssize_t) len) exit(1);
+		return;
+	}
+
+	//data split across buffers, or a device that cannot be mapped
+	int chunk_blks = WRITE_CHUNK_SIZE > block_size ? WRITE_CHUNK_SIZE >> block_shift : 1;
+	char chunk[(size_t) chunk_blks * block_size];
+	for (int i = 0; i < nblks; i += chunk_blks) {
+		int n = nblks - i < chunk_blks ? nblks - i : chunk_blks;
+		buf_get(src, chunk, (size_t) n * block_size);
+		if (disk->ops->write(disk, blk + i, n, chunk) < 0) exit(1);
+	}
+}
+
+/**
+ * Write part of a run of physically contiguous blocks. Whole blocks
+ * are written with fs_write_whole. A partial first or last block is
+ * read and modified, unless it was just allocated, in which case the
+ * rest of the block is zero filled.
+ *
+ * @param blk: the first physical block of the run
+ * @param nblks: number of blocks in the run
+ * @param src: the data to write, advanced past the bytes written
+ * @param offset: offset of the data within the first block
+ * @param len: number of bytes to write
+ * @param fresh: flags for the blocks of the run, true if just allocated
+ */
+static void fs_write_run(uint32_t blk, int nblks, struct fuse_bufvec *src, size_t offset,
+		size_t len, const bool *fresh)
+{
+	char block[block_size];
+
+	//partial first block
+	if (offset != 0 || len < block_size) {
+		size_t n = block_size - offset < len ? block_size - offset : len;
+		if (fresh[0]) {
+			memset(block, 0, block_size);
+		} else if (disk->ops->read(disk, blk, 1, block) < 0) {
+			exit(1);
+		}
+		buf_get(src, block + offset, n);
+		if (disk->ops->write(disk, blk, 1, block) < 0) exit(1);
+		len -= n;
+		blk++;
+		fresh++;
+	}
+
+	//whole blocks
+	int nwhole = len >> block_shift;
+	if (nwhole > 0) {
+		fs_write_whole(blk, nwhole, src);
+		len -= nwhole * block_size;
+		blk += nwhole;
+		fresh += nwhole;
+	}
+
+	//partial last block
+	if (len > 0) {
+		if (fresh[0]) {
+			memset(block, 0, block_size);
+		} else if (disk->ops->read(disk, blk, 1, block) < 0) {
+			exit(1);
+		}
+		buf_get(src, block, len);
+		if (disk->ops->write(disk, blk, 1, block) < 0) exit(1);
+	}
+}
+
+/**
+ * Write data held in a buffer vector to an open file. The data may
+ * be in memory or still in a pipe from the kernel, in which case
+ * whole blocks are spliced into the image rather than copied.
+ *
+ * @param path: the file path -- unused, the file is found through fi
+ * @param src: the data to write
+ * @param offset: the offset to starting writing at
+ * @param fi: the Fuse file info for writing, fi->fh set by fs_open
+ *
+ * @return: It should return exactly the number of bytes requested, except on error.
+ *
+ * 	-EBADF   - fi does not refer to an open file
+ *	-ENOSPC  - no block could be allocated
+ *	-ENOMEM  - no memory to hold the data in
+ *	-EFBIG   - offset at or past the maximum file size
+ *
+ * Note: writing at an offset past the end of the file writes
+ * nothing; files with holes are not created.
+ *
+ * Note: blocks that have no disk block yet are not allocated here.
+ * Their data is held in memory until the file is flushed, fsynced
+ * or closed, or too much data is held, and then the held blocks
+ * are allocated together (see held_writeback).
+*/
+static int fs_write_buf(const char *path, struct fuse_bufvec *src, off_t offset,
+		struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	if (of == NULL) return -EBADF;
+	int inode_idx = of->inum;
+	struct fs_inode *inode = &inodes[inode_idx];
+	size_t len = fuse_buf_size(src);
+	if (len == 0) return 0;
+	if (offset >= max_file_size) return -EFBIG;
+	if (len > max_file_size - offset) len = max_file_size - offset;
+	inode_lock(inode_idx, true);
+	if (offset > file_size(inode)) {
+		inode_unlock(inode_idx);
+		return 0;
+	}
+	__atomic_store_n(&of->written, true, __ATOMIC_RELAXED);
+
+	//map the blocks to write; blocks with no disk block yet are held
+	//in memory if free blocks can be reserved for writing them back
+	struct bmap_cache *bc = bmaps[inode_idx];
+	int first = offset >> block_shift;
+	int nblks = ((offset + len - 1) >> block_shift) - first + 1;
+	uint32_t blks[nblks];
+	bool fresh[nblks];
+	fs_bmap(inode, first, nblks, blks);
+	int nnew = 0;
+	for (int i = 0; i < nblks; i++) {
+		if (blks[i] == 0 && held_find(bc, first + i) == NULL) nnew++;
+	}
+	bool hold = (bc != NULL && held_reserve(bc, nnew));
+	if (hold) {
+		memset(fresh, 0, sizeof(fresh));
+	} else {
+		//allocate below, after the blocks held so far
+		int res = held_writeback(inode_idx);
+		if (res < 0) {
+			inode_unlock(inode_idx);
+			return res;
+		}
+	}
+
+	//write each run of contiguous blocks, and each held block, in
+	//pieces of HANDLE_BLKS blocks that each allocate their blocks and
+	//grow the file under a journal handle of their own
+	size_t blk_offset = offset & (block_size - 1);
+	size_t len_written = 0;
+	bool stop = false;
+	for (int p = 0; p < nblks && !stop; p += HANDLE_BLKS) {
+		int np = nblks - p < HANDLE_BLKS ? nblks - p : HANDLE_BLKS;
+		int credits = hold ? INODE_CREDITS : map_credits(np);
+		handle_begin(credits);
+		if (!hold) {
+			int nmapped = fs_balloc(inode, first + p, np, blks + p, fresh + p,
+					nblks > HANDLE_BLKS ? nblks - p : 0);
+			if (nmapped < np) {
+				np = nmapped;
+				stop = true;
+			}
+		}
+		for (int i = p; i < p + np; ) {
+			int n = 1;
+			while (i + n < p + np && blks[i] != 0 && blks[i + n] == blks[i] + n) {
+				n++;
+			}
+			size_t run_len = (size_t) n * block_size - blk_offset;
+			if (run_len > len - len_written) {
+				run_len = len - len_written;
+			}
+			if (blks[i] != 0) {
+				fs_write_run(blks[i], n, src, blk_offset, run_len, &fresh[i]);
+			} else {
+				char *data = held_get(bc, first + i);
+				if (data == NULL) {
+					stop = true;
+					break;
+				}
+				buf_get(src, data + blk_offset, run_len);
+			}
+			len_written += run_len;
+			blk_offset = 0;
+			i += n;
+		}
+		file_grow(inode_idx, offset + len_written);
+		update_inode(inode_idx);
+		handle_end(credits);
+	}
+	if (len_written == 0) {
+		inode_unlock(inode_idx);
+		return hold ? -ENOMEM : -ENOSPC;
+	}
+
+	//don't let held blocks pile up, or sit in memory for long
+	if (hold && bc->nheld > 0 &&
+			((off_t) __atomic_load_n(&n_held, __ATOMIC_RELAXED) << block_shift > HELD_MAX_SIZE ||
+			time(NULL) - bc->held_since >= FLUSH_INTERVAL)) {
+		held_writeback(inode_idx);
+	}
+	inode_unlock(inode_idx);
+
+	return (int) len_written;
+}
+
+/**
+ * write - write data to a file
+ *
+ * @param path: the file path -- unused, the file is found through fi
+ * @param buf: the buffer to write
+ * @param len: the number of bytes to write
+ * @param offset: the offset to starting writing at
+ * @param fi: the Fuse file info for writing, fi->fh set by fs_open
+ *
+ * @return: It should return exactly the number of bytes requested, except on error.
+ *
+ * 	-EBADF   - fi does not refer to an open file
+ *	-EINVAL  - if 'offset' is greater than current file length.
+ *  			(POSIX semantics support the creation of files with
+ *  			"holes" in them, but we don't)
+*/
+static int fs_write(const char *path, const char *buf, size_t len,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+	src.buf[0].mem = (void*) buf;
+	return fs_write_buf(path, &src, offset, fi);
+}
+
+/**
+ * Write zeros to the blocks just allocated in a mapped range, with
+ * one device write per run of contiguous new blocks.
+ *
+ * @param blks: the physical block numbers
+ * @param fresh: flags for the blocks, true if just allocated
+ * @param n: the number of blocks
+ */
+static void fs_zero_fresh(const uint32_t *blks, const bool *fresh, int n)
+{
+	for (int i = 0, run; i < n; i += run) {
+		run = 1;
+		if (!fresh[i]) continue;
+		while (i + run < n && run < ZERO_RUN_BLKS && fresh[i + run] &&
+				blks[i + run] == blks[i] + run) {
+			run++;
+		}
+		if (disk->ops->write(disk, blks[i], run, zero_blks) < 0) exit(1);
+	}
+}
+
+/**
+ * Allocate the blocks of a range of a file ahead of writing it. The
+ * range is allocated as one extent where there is room, so that it
+ * can later be read with a few large reads; new blocks are zeroed.
+ *
+ * @param inum: the file inode number
+ * @param mode: 0 to grow the file to cover the range, or
+ *   FALLOC_FL_KEEP_SIZE to leave its size alone
+ * @param offset: start of the range
+ * @param len: length of the range
+ * @return: 0 if successful, or -error number
+ *	-EOPNOTSUPP - mode other than the above
+ *	-EINVAL     - offset or len invalid
+ *	-ENODEV     - not a regular file
+ *	-EFBIG      - range past the maximum file size
+ *	-ENOSPC     - out of space; blocks allocated so far are kept
+ */
+static int ino_fallocate(int inum, int mode, off_t offset, off_t len)
+{
+	if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0) return -EINVAL;
+	struct fs_inode *inode = &inodes[inum];
+	if (!S_ISREG(inode->mode)) return -ENODEV;
+	if (offset >= max_file_size || len > max_file_size - offset) return -EFBIG;
+
+	inode_lock(inum, true);
+	int res = held_writeback(inum);
+	if (res < 0) {
+		inode_unlock(inum);
+		return res;
+	}
+	//each step maps and zeroes its blocks under a journal handle
+	int last = (offset + len - 1) >> block_shift;
+	for (int first = offset >> block_shift; first <= last; ) {
+		int n = last - first + 1 < HANDLE_BLKS ? last - first + 1 : HANDLE_BLKS;
+		uint32_t blks[n];
+		bool fresh[n];
+		handle_begin(map_credits(n));
+		int nmapped = fs_balloc(inode, first, n, blks, fresh, last - first + 1);
+		fs_zero_fresh(blks, fresh, nmapped);
+		update_inode(inum);
+		handle_end(map_credits(n));
+		if (nmapped < n) {
+			res = -ENOSPC;
+			break;
+		}
+		first += n;
+	}
+	if (res == SUCCESS && !(mode & FALLOC_FL_KEEP_SIZE)) {
+		handle_begin(INODE_CREDITS);
+		file_grow(inum, offset + len);
+		update_inode(inum);
+		handle_end(INODE_CREDITS);
+	}
+	inode_unlock(inum);
+	return res;
+}
+
+/**
+ * fallocate - allocate space for an open file.
+ *
+ * @param path: the file path -- unused, the file is found through fi
+ * @param mode: 0 or FALLOC_FL_KEEP_SIZE
+ * @param offset: start of the range to allocate
+ * @param len: length of the range
+ * @param fi: fuse file info, fi->fh set by fs_open
+ * @return: 0 if successful, -EBADF if fi does not refer to an open
+ *   file, or an error from ino_fallocate
+ */
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+		struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	if (of == NULL) return -EBADF;
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		__atomic_store_n(&of->written, true, __ATOMIC_RELAXED);
+	}
+	return ino_fallocate(of->inum, mode, offset, len);
+}
+
+/**
+ * flush - called on each close of an open file. If the file has
+ * been written since it was last flushed, write back its held blocks
+ * and flush the device so that its data is durable no later than
+ * close. The device flush is an fdatasync of the whole image file
+ * whatever the range, so the whole device is flushed.
+ *
+ * @param path: path to the file -- unused
+ * @param fi: the fuse file info, fi->fh set by fs_open
+ *
+ * @return: 0 if successful, or -error number
+ *	-EBADF    - fi does not refer to an open file
+ *	-EIO      - the data could not be written back
+ *	-ENOSPC   - no space for the held blocks
+ */
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	if (of == NULL) return -EBADF;
+	if (!__atomic_exchange_n(&of->written, false, __ATOMIC_RELAXED)) return SUCCESS;
+	inode_lock(of->inum, true);
+	int res = held_writeback(of->inum);
+	inode_unlock(of->inum);
+	if (res < 0) return res;
+	return (disk->ops->flush(disk, 0, n_blocks) < 0) ? -EIO : SUCCESS;
+}
+
+/**
+ * Release resources created by pending open call, flushing the
+ * file's data if it was written and not flushed since. The last
+ * close of a file that has been removed frees it.
+ *
+ * @param path: path to the file -- unused
+ * @param fi: the fuse file info, fi->fh set by fs_open
+ *
+ * @return: 0 if successful, or -error number
+ *	-EBADF    - fi does not refer to an open file
+ *	-EIO      - the data could not be written back
+*/
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	if (of == NULL) return -EBADF;
+	int result = fs_flush(path, fi);
+	int inum = of->inum;
+	inode_lock(inum, true);
+	bmap_detach(inum);
+	inode_unlock(inum);
+	open_file_free(fi->fh);
+	fi->fh = (uint64_t) -1;
+	inode_put(inum);
+	return result;
+}
+
+/**
+ * fsync - write back changes to a file.
+ *
+ * Held blocks of the file are allocated and written first, or those
+ * of every file for anything but a regular file (e.g. "/" from the
+ * sync command). Then any metadata waiting to be written is written
+ * and the device flushed once: a journal commit flushes the whole
+ * device, data included, before the transaction counts as committed;
+ * otherwise the device is flushed here.
+ *
+ * @param path: path to the file
+ * @param datasync: nonzero if only the data needs to be flushed -
+ *   metadata is flushed anyway since the data cannot be found without it
+ * @param fi: the fuse file info, or NULL to look up path
+ *
+ * @return: 0 if successful, or -error number
+ *	-EIO      - the changes could not be written back
+*/
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	struct open_file *of = open_file_get(fi);
+	int inum;
+	if (of != NULL) {
+		inum = of->inum;
+		__atomic_store_n(&of->written, false, __ATOMIC_RELAXED);
+	} else {
+		char *_path = strdup(path);
+		inum = translate(_path);
+		free(_path);
+		if (inum < 0) return inum;
+	}
+
+	if (S_ISREG(inodes[inum].mode)) {
+		inode_lock(inum, true);
+		int res = held_writeback(inum);
+		inode_unlock(inum);
+		if (res < 0) return res;
+	} else {
+		held_writeback_all(0);
+	}
+	bool meta = metadata_pending();
+	if (flush_metadata() < 0) return -EIO;
+	if (meta && journal_active()) {
+		return SUCCESS;
+	}
+	return (disk->ops->flush(disk, 0, n_blocks) < 0) ? -EIO : SUCCESS;
+}
+
+/**
+ * statfs - get file system statistics. See 'man 2 statfs' for
+ * description of 'struct statvfs'.
+ *
+ * @param path: the path to the file (ignored)
+ * @param st: pointer to the destination statvfs struct
+ *
+ * @return: 0 if successful
+ *
+ * Errors
+ *   none -  Needs to work
+*/
+static int fs_statfs(const char *path, struct statvfs *st)
+{
+	/* needs to return the following fields (set others to zero):
+	 *   f_bsize = block_size
+	 *   f_blocks = total image - metadata
+	 *   f_bfree = f_blocks - blocks used
+	 *   f_bavail = f_bfree
+	 *   f_namelen = <whatever your max namelength is>
+	 *   f_files = number of inodes
+	 *   f_ffree = f_favail = free inodes
+	 */
+
+	//clear original stats
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = block_size;
+	if (grouped) {
+		st->f_blocks = (fsblkcnt_t) (n_blocks - 1 -
+				n_bgroups * (group_bmap_blks + 1 + group_itable_blks));
+	} else {
+		st->f_blocks = (fsblkcnt_t) (n_blocks - root_inode - inode_base);
+	}
+	st->f_bfree = (fsblkcnt_t) num_free_blk();
+	st->f_bavail = st->f_bfree;
+	st->f_files = (fsfilcnt_t) n_inodes;
+	lock_mutex(&alloc_lock, &alloc_stats);
+	st->f_ffree = (fsfilcnt_t) n_free_inodes;
+	pthread_mutex_unlock(&alloc_lock);
+	st->f_favail = st->f_ffree;
+	st->f_namemax = FS_FILENAME_SIZE - 1;
+
+	return 0;
+}
+
+/*
+ * Thread-safe entry points. Each operation runs with ns_lock held,
+ * for writing if it adds, removes or renames directory entries and
+ * for reading otherwise; the operations take the finer locks they
+ * need themselves.
+ */
+
+static int mt_getattr(const char *path, struct stat *sb)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_getattr(path, sb);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_opendir(const char *path, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_opendir(path, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_readdir(path, ptr, filler, offset, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_releasedir(path, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	lock_write(&ns_lock, &ns_stats);
+	int res = fs_mknod(path, mode, dev);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_mkdir(const char *path, mode_t mode)
+{
+	lock_write(&ns_lock, &ns_stats);
+	int res = fs_mkdir(path, mode);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_unlink(const char *path)
+{
+	lock_write(&ns_lock, &ns_stats);
+	int res = fs_unlink(path);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_rmdir(const char *path)
+{
+	lock_write(&ns_lock, &ns_stats);
+	int res = fs_rmdir(path);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_rename(const char *src_path, const char *dst_path)
+{
+	lock_write(&ns_lock, &ns_stats);
+	int res = fs_rename(src_path, dst_path);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_chmod(const char *path, mode_t mode)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_chmod(path, mode);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_utime(const char *path, struct utimbuf *ut)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_utime(path, ut);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_truncate(const char *path, off_t len)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_truncate(path, len);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_open(const char *path, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_open(path, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_read(const char *path, char *buf, size_t len, off_t offset,
+		struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_read(path, buf, len, offset, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_write(const char *path, const char *buf, size_t len,
+		off_t offset, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_write(path, buf, len, offset, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_read_buf(const char *path, struct fuse_bufvec **bufp, size_t len,
+		off_t offset, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_read_buf(path, bufp, len, offset, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_write_buf(const char *path, struct fuse_bufvec *src, off_t offset,
+		struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_write_buf(path, src, offset, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_fallocate(const char *path, int mode, off_t offset, off_t len,
+		struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_fallocate(path, mode, offset, len, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_flush(const char *path, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_flush(path, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_release(const char *path, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_release(path, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_fsync(path, datasync, fi);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+static int mt_statfs(const char *path, struct statvfs *st)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = fs_statfs(path, st);
+	pthread_rwlock_unlock(&ns_lock);
+	return res;
+}
+
+/**
+ * Operations vector. Please don't rename it, as the
+ * skeleton code in main.c assumes it is named 'fs_ops'.
+ * Since the entry points are thread-safe, fsx492 can run
+ * without -s.
+ */
+struct fuse_operations fs_ops = {
+	.init = fs_init,
+	.destroy = fs_destroy,
+	.getattr = mt_getattr,
+	.opendir = mt_opendir,
+	.readdir = mt_readdir,
+	.releasedir = mt_releasedir,
+	.mknod = mt_mknod,
+	.mkdir = mt_mkdir,
+	.unlink = mt_unlink,
+	.rmdir = mt_rmdir,
+	.rename = mt_rename,
+	.chmod = mt_chmod,
+	.utime = mt_utime,
+	.truncate = mt_truncate,
+	.open = mt_open,
+	.read = mt_read,
+	.write = mt_write,
+	.read_buf = mt_read_buf,
+	.write_buf = mt_write_buf,
+	.fallocate = mt_fallocate,
+	.flush = mt_flush,
+	.release = mt_release,
+	.fsync = mt_fsync,
+	.statfs = mt_statfs,
+};
+
+/*
+ * Low-level entry points. The kernel names files by inode number, so
+ * no path is ever resolved; FUSE_ROOT_ID and the root inode number
+ * trade places. Every entry in a reply counts as a lookup until the
+ * kernel forgets it, and an inode removed while the kernel still
+ * knows it is kept until then. Reads, writes, fallocates, flushes,
+ * releases and fsyncs are handed to a pool of threads that reply
+ * once the I/O is done, so the threads taking requests from the kernel never wait
+ * for the disk. The ops take ns_lock like the thread-safe entry
+ * points above, or call them.
+ */
+
+/** threads doing the I/O of reads, writes, fallocates, flushes and fsyncs */
+enum { LL_WORKERS = 8 };
+
+/** seconds the kernel may cache attributes and entries */
+static const double ll_timeout = 1.0;
+
+/** pool running the I/O requests, NULL if there is none */
+static struct workq *ll_workq;
+
+/**
+ * Convert between kernel and FSX492 inode numbers.
+ *
+ * @param ino: a kernel or FSX492 inode number
+ * @return: the inode number in the other numbering
+ */
+static fuse_ino_t ll_swap(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID) return root_inode;
+	if (ino == (fuse_ino_t) root_inode) return FUSE_ROOT_ID;
+	return ino;
+}
 
-	//write buff to inode
-	if (disk->ops->write(disk, parent_inode->direct[0], 1, entries)) exit(1);
+/**
+ * Copy a name from the kernel, checking that it fits in a dirent.
+ *
+ * @param name: the name
+ * @param leaf: space for FS_FILENAME_SIZE name
+ * @return: 0 if successful, or -ENAMETOOLONG
+ */
+static int ll_name(const char *name, char *leaf)
+{
+	if (strlen(name) >= FS_FILENAME_SIZE) return -ENAMETOOLONG;
+	strcpy(leaf, name);
 	return SUCCESS;
 }
 
 /**
- * chmod - change file permissions
- *
- * @param path: the file or directory path
- * @param mode: the mode_t mode value -- see man 'chmod'
- * for description
+ * Fill in the entry for an inode being replied to the kernel, and
+ * count the lookup. Called with ns_lock held.
  *
- *  @return: 0 if successful, or -error number
- *  	-ENOENT   - file does not exist
- *  	-ENOTDIR  - component of path not a directory
-*/
-static int fs_chmod(const char *path, mode_t mode)
+ * @param inum: the inode number
+ * @param e: the entry to fill in
+ */
+static void ll_entry(int inum, struct fuse_entry_param *e)
 {
-	char* _path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	//protect system from other modes
-	mode |= S_ISDIR(inode->mode) ? S_IFDIR : S_IFREG;
-	//change through reference
-	inode->mode = mode;
-	update_inode(inode_idx);
- 	return SUCCESS;
+	memset(e, 0, sizeof(*e));
+	ino_getattr(inum, &e->attr);
+	e->ino = e->attr.st_ino = ll_swap(inum);
+	e->attr_timeout = e->entry_timeout = ll_timeout;
+	__atomic_add_fetch(&lookups[inum], 1, __ATOMIC_ACQ_REL);
 }
 
 /**
- * utime - change modification time.
+ * Drop lookups of an inode, freeing it if it has been removed and
+ * this was the last reference.
  *
- * @param path the file or directory path.
- * @param ut utimbuf - see man 'utime' for description.
- * @return 0 if successful, or error value
- *   -ENOENT   - file does not exist
- *   -ENOTDIR  - component of path not a directory
+ * @param inum: the inode number
+ * @param nlookup: the number of lookups to drop
  */
-int fs_utime(const char *path, struct utimbuf *ut)
+static void ll_drop(int inum, unsigned long nlookup)
 {
-	//similar to chmod except changing modification time instead of file permissions
-	char* _path = strdup(path);
-	int inode_idx = translate(_path);
-	if(inode_idx < 0){
-		return inode_idx;
+	if (inum == root_inode) return; //never counted, never freed
+	lock_read(&ns_lock, &ns_stats);
+	if (__atomic_sub_fetch(&lookups[inum], nlookup, __ATOMIC_ACQ_REL) == 0) {
+		inode_put(inum);
 	}
-	struct fs_inode *inode = &inodes[inode_idx];
-	//protect system from other modes
-	//mode |= S_ISDIR(inode->mode) ? S_IFDIR : S_IFREG;
-	//setting inode mtime to ut modtime
-	inode->mtime = ut->modtime;
-	update_inode(inode_idx);
-	return SUCCESS;
+	pthread_rwlock_unlock(&ns_lock);
 }
 
 /**
- * Open a filesystem file or directory path.
- *
- * @param path: the path
- * @param fuse: file info data
+ * Reply with an entry, or with an error. An entry the kernel did not
+ * get is not counted.
  *
- * @return: 0 if successful, or -error number
- *	-ENOENT   - file does not exist
- *	-ENOTDIR  - component of path not a directory
-*/
-static int fs_open(const char *path, struct fuse_file_info *fi)
+ * @param req: the request
+ * @param res: the inode number, or -error number
+ * @param e: the entry, filled in by ll_entry if res is an inode
+ */
+static void ll_reply_entry(fuse_req_t req, int res, struct fuse_entry_param *e)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	if (S_ISDIR(inodes[inode_idx].mode)) return -EISDIR;
-	fi->fh = (uint64_t) inode_idx;
-	return SUCCESS;
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+	} else if (fuse_reply_entry(req, e) != 0) {
+		ll_drop(res, 1);
+	}
 }
 
-static void fs_read_blk(int blk_num, char *buf, size_t len, size_t offset) {
-	//CS492: your code here
-	char entries[BLOCK_SIZE];
-	memset(entries, 0, BLOCK_SIZE);
-	if(disk->ops->read(disk, blk_num, 1, entries) < 0){
-		exit(1);
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char leaf[FS_FILENAME_SIZE];
+	struct fuse_entry_param e;
+	int res = ll_name(name, leaf);
+	lock_read(&ns_lock, &ns_stats);
+	if (res == SUCCESS) {
+		int dir = ll_swap(parent);
+		res = S_ISDIR(inodes[dir].mode) ? lookup(dir, leaf) : -ENOTDIR;
 	}
-	memcpy(entries + offset, buf, len);
-	// if(disk->ops->write(disk, blk_num, 1, entries) < 0){
-	// 	exit(1);
-	// }
+	if (res >= 0) ll_entry(res, &e);
+	pthread_rwlock_unlock(&ns_lock);
+	ll_reply_entry(req, res, &e);
 }
 
-static size_t fs_read_dir(size_t inode_idx, char *buf, size_t len, size_t offset) {
-	struct fs_inode *inode = &inodes[inode_idx];
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_read = len;
-	while (blk_num < N_DIRECT && len_to_read > 0) {
-		size_t cur_len_to_read = len_to_read > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_read;
-		size_t temp = blk_offset + cur_len_to_read;
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	ll_drop(ll_swap(ino), nlookup);
+	fuse_reply_none(req);
+}
 
-		if (!inode->direct[blk_num]) {
-			return len - len_to_read;
-		}
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++) {
+		ll_drop(ll_swap(forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
 
-		fs_read_blk(inode->direct[blk_num], buf, temp, blk_offset);
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat sb;
+	lock_read(&ns_lock, &ns_stats);
+	ino_getattr(ll_swap(ino), &sb);
+	pthread_rwlock_unlock(&ns_lock);
+	sb.st_ino = ino;
+	fuse_reply_attr(req, &sb, ll_timeout);
+}
 
-		buf += temp;
-		len_to_read -= temp;
-		blk_num++;
-		blk_offset = 0;
+/**
+ * Change the attributes FSX492 keeps: the permissions, the size
+ * (truncating to 0 only) and the modification time. Owners cannot
+ * be changed; access times are not kept and changing them is ignored.
+ */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	int inum = ll_swap(ino);
+	int res = SUCCESS;
+	struct stat sb;
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) res = -EPERM;
+	lock_read(&ns_lock, &ns_stats);
+	if (res == SUCCESS && (to_set & FUSE_SET_ATTR_MODE)) {
+		res = ino_chmod(inum, attr->st_mode);
 	}
-	return len - len_to_read;
+	if (res == SUCCESS && (to_set & FUSE_SET_ATTR_SIZE)) {
+		res = ino_truncate(inum, attr->st_size);
+	}
+	if (res == SUCCESS && (to_set & FUSE_SET_ATTR_MTIME_NOW)) {
+		res = ino_utime(inum, time(NULL));
+	} else if (res == SUCCESS && (to_set & FUSE_SET_ATTR_MTIME)) {
+		res = ino_utime(inum, attr->st_mtime);
+	}
+	if (res == SUCCESS) ino_getattr(inum, &sb);
+	pthread_rwlock_unlock(&ns_lock);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	sb.st_ino = ino;
+	fuse_reply_attr(req, &sb, ll_timeout);
 }
 
-static size_t fs_read_indir1(size_t blk, char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) exit(1);
-
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_read = len;
-	while (blk_num < PTRS_PER_BLK && len_to_read > 0) {
-		size_t cur_len_to_read = len_to_read > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_read;
-		size_t temp = blk_offset + cur_len_to_read;
+/**
+ * Create a file or directory and reply with its entry.
+ *
+ * @param req: the request
+ * @param parent: the directory
+ * @param name: the new name
+ * @param mode: the mode, including S_IFREG or S_IFDIR
+ */
+static void ll_make(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	char leaf[FS_FILENAME_SIZE];
+	struct fuse_entry_param e;
+	int res = ll_name(name, leaf);
+	lock_write(&ns_lock, &ns_stats);
+	if (res == SUCCESS) res = ino_create(ll_swap(parent), leaf, mode);
+	if (res >= 0) ll_entry(res, &e);
+	pthread_rwlock_unlock(&ns_lock);
+	ll_reply_entry(req, res, &e);
+}
 
-		if (!blk_indices[blk_num]) {
-			return len - len_to_read;
-		}
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, dev_t rdev)
+{
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EPERM); //only regular files
+		return;
+	}
+	ll_make(req, parent, name, mode);
+}
 
-		fs_read_blk(blk_indices[blk_num], buf, temp, blk_offset);
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	ll_make(req, parent, name, (mode & ~S_IFMT) | S_IFDIR);
+}
 
-		buf += temp;
-		len_to_read -= temp;
-		blk_num++;
-		blk_offset = 0;
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char leaf[FS_FILENAME_SIZE];
+	int res = ll_name(name, leaf);
+	if (res == SUCCESS) {
+		lock_write(&ns_lock, &ns_stats);
+		res = ino_unlink(ll_swap(parent), leaf);
+		pthread_rwlock_unlock(&ns_lock);
 	}
-	return len - len_to_read;
+	fuse_reply_err(req, -res);
 }
 
-static size_t fs_read_indir2(size_t blk, char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) return 0;
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char leaf[FS_FILENAME_SIZE];
+	int res = ll_name(name, leaf);
+	if (res == SUCCESS) {
+		lock_write(&ns_lock, &ns_stats);
+		res = ino_rmdir(ll_swap(parent), leaf);
+		pthread_rwlock_unlock(&ns_lock);
+	}
+	fuse_reply_err(req, -res);
+}
 
-	size_t blk_num = offset / INDIR1_SIZE;
-	size_t blk_offset = offset % INDIR1_SIZE;
-	size_t len_to_read = len;
-	while (blk_num < PTRS_PER_BLK && len_to_read > 0) {
-		size_t cur_len_to_read = len_to_read > INDIR1_SIZE ? (size_t) INDIR1_SIZE - blk_offset : len_to_read;
-		size_t temp = blk_offset + cur_len_to_read;
+/**
+ * Rename an entry within its directory. Moving an entry to another
+ * directory is not supported and fails with EXDEV, which makes mv
+ * copy it instead.
+ */
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname)
+{
+	char src_name[FS_FILENAME_SIZE], dst_name[FS_FILENAME_SIZE];
+	int res = ll_name(name, src_name);
+	if (res == SUCCESS) res = ll_name(newname, dst_name);
+	if (res == SUCCESS && newparent != parent) res = -EXDEV;
+	if (res == SUCCESS) {
+		lock_write(&ns_lock, &ns_stats);
+		res = ino_rename(ll_swap(parent), src_name, dst_name);
+		pthread_rwlock_unlock(&ns_lock);
+	}
+	fuse_reply_err(req, -res);
+}
 
-		if (!blk_indices[blk_num]) {
-			return len - len_to_read;
-		}
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	int res = ino_open(ll_swap(ino), fi);
+	pthread_rwlock_unlock(&ns_lock);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+	} else if (fuse_reply_open(req, fi) != 0) {
+		mt_release(NULL, fi); //the kernel will not release it
+	}
+}
 
-		temp = fs_read_indir1(blk_indices[blk_num], buf, temp, blk_offset);
+/** a request handed to the pool */
+struct ll_job {
+	fuse_req_t req;
+	struct fuse_file_info fi; /* copy of the request's file info */
+	size_t size; /* bytes to read, write or allocate */
+	off_t off; /* offset to read, write or allocate at */
+	int datasync; /* fsync flag */
+	int mode; /* fallocate mode */
+	char data[]; /* the data to write */
+};
 
-		buf += temp;
-		len_to_read -= temp;
-		blk_num++;
-		blk_offset = 0;
+/**
+ * Make a job for a request.
+ *
+ * @param req: the request
+ * @param fi: the file info of the request
+ * @param datalen: bytes of write data to make room for
+ * @return: the job, or NULL if it cannot be allocated, in which case
+ *   the request has been answered with ENOMEM
+ */
+static struct ll_job *ll_job_new(fuse_req_t req, struct fuse_file_info *fi, size_t datalen)
+{
+	struct ll_job *job = malloc(sizeof(struct ll_job) + datalen);
+	if (job == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return NULL;
 	}
-	return len - len_to_read;
+	memset(job, 0, sizeof(struct ll_job));
+	job->req = req;
+	job->fi = *fi;
+	return job;
 }
 
 /**
- * read - read data from an open file.
+ * Run a job in the pool, or right away if it cannot be queued.
  *
- * @param path: the path to the file
- * @param buf: the buffer to keep the data
- * @param len: the number of bytes to read
- * @param offset: the location to start reading at
- * @param fi: fuse file info
- *
- * @return: return exactly the number of bytes requested, except:
- * - if offset >= file len, return 0
- * - if offset+len > file len, return bytes from offset to EOF
- * - on error, return <0
- * 	-ENOENT  - file does not exist
- * 	-EISDIR  - file is in fact a directory
- * 	-ENOTDIR - component of path not a directory
- * 	-EIO     - error reading block
- *
- * Note: similar to fs_write, except that:
- * 1) we cannot read past the end of the file (so you need to add a test
- *    for that, that limits the len to be read in this case)
- * 2) there's no need to allocate or update anything since we are only
- *    reading the file.
-*/
-static int fs_read(const char *path, char *buf, size_t len, off_t offset,
-		    struct fuse_file_info *fi)
+ * @param fn: the job function, which replies and frees the job
+ * @param job: the job
+ */
+static void ll_run(void (*fn)(void*), struct ll_job *job)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0){
-		return inode_idx;
-	}
-	struct fs_inode *inode = &inodes[inode_idx];
-	if(S_ISDIR(inode->mode)){
-		return -EISDIR;
-	}
-	if(offset > inode->size){
-		return 0;
+	if (ll_workq == NULL || workq_add(ll_workq, fn, job) < 0) {
+		fn(job);
 	}
+}
 
-	//len need to read
-	size_t len_to_read;
-	if(inode->size - offset > len){
-		len_to_read = len;
-	} else{
-		len_to_read = inode->size - offset;
+/**
+ * Read data from an open file. Blocks of the image file go to the
+ * kernel without being copied here when the device can map them.
+ */
+static void ll_read_job(void *arg)
+{
+	struct ll_job *job = arg;
+	struct fuse_bufvec *bufv = NULL;
+	bool pinned;
+	lock_read(&ns_lock, &ns_stats);
+	int res = read_bufvec(&job->fi, &bufv, job->size, job->off, &pinned);
+	pthread_rwlock_unlock(&ns_lock);
+	if (res < 0) {
+		fuse_reply_err(job->req, -res);
+	} else {
+		fuse_reply_data(job->req, bufv, FUSE_BUF_SPLICE_MOVE);
+		if (pinned) read_unpin(&job->fi);
 	}
+	free_bufvec(bufv);
+	free(job);
+}
 
-	//read direct blocks
-	if(len_to_read > 0 && offset < DIR_SIZE){
-		//len finished read
-		size_t temp = fs_read_dir(inode_idx, buf, len_to_read, (size_t) offset);
-		len_to_read -= temp;
-		offset += temp;
-		buf += temp;
-	}
-	
-	//read indirect 1 blocks
-	if(len_to_read > 0 && offset < DIR_SIZE + INDIR1_SIZE){
-		//need to allocate indir_1
-		// if(!inode->indir_1){
-		// 	int freeb = get_free_blk();
-		// 	if(freeb < 0){
-		// 		return len - len_to_read;
-		// 		inode->indir_1 = freeb;
-		// 		update_inode(inode_idx);
-		// 	}
-		// }
-		size_t temp = fs_read_indir1(inode->indir_1, buf, len_to_read, (size_t) offset - DIR_SIZE);
-		len_to_read -= temp;
-		offset += temp;
-		buf += temp;
-	}
-
-	//read indirect 2 blocks
-	if(len_to_read > 0 && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE){
-		//need to allocate indir_2
-		// if(!inode-> indir_2){
-		// 	int freeb = get_free_blk();
-		// 	if (freeb < 0){
-		// 		return len - len_to_read;
-		// 	}
-		// 	inode->indir_2 = freeb;
-		// 	update_inode(inode_idx);
-		// }
-		//len finished read
-		size_t temp = fs_read_indir2(inode->indir_2, buf, len_to_read, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
-		len_to_read -= temp;
-		offset += len_to_read;
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct ll_job *job = ll_job_new(req, fi, 0);
+	if (job == NULL) return;
+	job->size = size;
+	job->off = off;
+	ll_run(ll_read_job, job);
+}
+
+static void ll_write_job(void *arg)
+{
+	struct ll_job *job = arg;
+	int res = mt_write(NULL, job->data, job->size, job->off, &job->fi);
+	if (res < 0) {
+		fuse_reply_err(job->req, -res);
+	} else {
+		fuse_reply_write(job->req, res);
 	}
-	
-	if(offset > inode->size){
-		inode->size = offset;
+	free(job);
+}
+
+/**
+ * Write data to an open file. The request's buffers, which may be a
+ * pipe, are reused once this returns, so the data is copied into the
+ * job.
+ */
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+		off_t off, struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(bufv);
+	struct ll_job *job = ll_job_new(req, fi, size);
+	if (job == NULL) return;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = job->data;
+	ssize_t res = fuse_buf_copy(&dst, bufv, 0);
+	if (res < 0) {
+		fuse_reply_err(req, (int) -res);
+		free(job);
+		return;
 	}
-	
-	//update inode and blk
-	//update(inode_idx);
-	//update_blk();
+	job->size = res;
+	job->off = off;
+	ll_run(ll_write_job, job);
+}
 
-	return (int) (len - len_to_read);
+static void ll_fallocate_job(void *arg)
+{
+	struct ll_job *job = arg;
+	fuse_reply_err(job->req, -mt_fallocate(NULL, job->mode, job->off, job->size, &job->fi));
+	free(job);
 }
 
-static void fs_write_blk(int blk_num, const char *buf, size_t len, size_t offset) {
-	char entries[BLOCK_SIZE];
-	memset(entries, 0, BLOCK_SIZE);
-	if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
-	memcpy(entries + offset, buf, len);
-	if (disk->ops->write(disk, blk_num, 1, entries) < 0) exit(1);
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+		off_t length, struct fuse_file_info *fi)
+{
+	struct ll_job *job = ll_job_new(req, fi, 0);
+	if (job == NULL) return;
+	job->mode = mode;
+	job->off = offset;
+	job->size = length;
+	ll_run(ll_fallocate_job, job);
 }
 
-static size_t fs_write_dir(size_t inode_idx, const char *buf, size_t len, size_t offset) {
-	struct fs_inode *inode = &inodes[inode_idx];
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_write = len;
-	while (blk_num < N_DIRECT && len_to_write > 0) {
-		size_t cur_len_to_write = len_to_write > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_write;
-		//size_t temp = blk_offset + cur_len_to_write;
-		size_t temp = cur_len_to_write;
-
-		if (!inode->direct[blk_num]) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			inode->direct[blk_num] = freeb;
-			update_inode(inode_idx);
-		}
-
-		fs_write_blk(inode->direct[blk_num], buf, temp, blk_offset);
-
-		buf += temp;
-		len_to_write -= temp;
-		blk_num++;
-		blk_offset = 0;
-	}
-	return len - len_to_write;
+static void ll_flush_job(void *arg)
+{
+	struct ll_job *job = arg;
+	fuse_reply_err(job->req, -mt_flush(NULL, &job->fi));
+	free(job);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ll_job *job = ll_job_new(req, fi, 0);
+	if (job != NULL) ll_run(ll_flush_job, job);
 }
 
-static size_t fs_write_indir1(size_t blk, const char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) exit(1);
+static void ll_release_job(void *arg)
+{
+	struct ll_job *job = arg;
+	fuse_reply_err(job->req, -mt_release(NULL, &job->fi));
+	free(job);
+}
 
-	size_t blk_num = offset / BLOCK_SIZE;
-	size_t blk_offset = offset % BLOCK_SIZE;
-	size_t len_to_write = len;
-	while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
-		size_t cur_len_to_write = len_to_write > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_write;
-		size_t temp = blk_offset + cur_len_to_write;
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ll_job *job = ll_job_new(req, fi, 0);
+	if (job != NULL) ll_run(ll_release_job, job);
+}
 
-		if (!blk_indices[blk_num]) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			blk_indices[blk_num] = freeb;
-			//write back
-			if (disk->ops->write(disk, blk, 1, blk_indices) < 0)
-				exit(1);
-		}
+static void ll_fsync_job(void *arg)
+{
+	struct ll_job *job = arg;
+	fuse_reply_err(job->req, -mt_fsync(NULL, job->datasync, &job->fi));
+	free(job);
+}
 
-		fs_write_blk(blk_indices[blk_num], buf, temp, blk_offset);
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	struct ll_job *job = ll_job_new(req, fi, 0);
+	if (job == NULL) return;
+	job->datasync = datasync;
+	ll_run(ll_fsync_job, job);
+}
 
-		buf += temp;
-		len_to_write -= temp;
-		blk_num++;
-		blk_offset = 0;
-	}
-	return len - len_to_write;
-}
-
-static size_t fs_write_indir2(size_t blk, const char *buf, size_t len, size_t offset) {
-	uint32_t blk_indices[PTRS_PER_BLK];
-	memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-	if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) return 0;
-
-	size_t blk_num = offset / INDIR1_SIZE;
-	size_t blk_offset = offset % INDIR1_SIZE;
-	size_t len_to_write = len;
-	while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
-		size_t cur_len_to_write = len_to_write > INDIR1_SIZE ? (size_t) INDIR1_SIZE - blk_offset : len_to_write;
-		size_t temp = blk_offset + cur_len_to_write;
-		len_to_write -= temp;
-		if (!blk_indices[blk_num]) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			blk_indices[blk_num] = freeb;
-			//write back
-			if (disk->ops->write(disk, blk, 1, blk_indices) < 0)
-				exit(1);
-		}
-
-		temp = fs_write_indir1(blk_indices[blk_num], buf, temp, blk_offset);
-		if (temp == 0) return len - len_to_write;
-		buf += temp;
-		blk_num++;
-		blk_offset = 0;
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	lock_read(&ns_lock, &ns_stats);
+	bool dir = S_ISDIR(inodes[ll_swap(ino)].mode);
+	pthread_rwlock_unlock(&ns_lock);
+	if (!dir) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
 	}
-	return len - len_to_write;
+	fuse_reply_open(req, fi);
 }
 
+/** reply buffer for ll_dir_blk */
+struct ll_dir_args {
+	fuse_req_t req;
+	char *buf;
+	size_t size; /* size of buf */
+	size_t len; /* bytes of buf filled */
+	off_t off; /* number of entries to skip */
+	off_t n; /* number of entries seen */
+};
+
 /**
- * write - write data to a file
- *
- * @param path: the file path
- * @param buf: the buffer to write
- * @param len: the number of bytes to write
- * @param offset: the offset to starting writing at
- * @param fi: the Fuse file info for writing
- *
- * @return: It should return exactly the number of bytes requested, except on error.
+ * Add the entries of a directory block to a readdir reply. The
+ * offset of an entry is its position in the directory, counting
+ * from 1, so a reply can resume after the last entry that fitted.
  *
- * 	-ENOENT  - file does not exist
- * 	-EISDIR  - file is in fact a directory
- *	-ENOTDIR - component of path not a directory
- *	-EINVAL  - if 'offset' is greater than current file length.
- *  			(POSIX semantics support the creation of files with
- *  			"holes" in them, but we don't)
-*/
-static int fs_write(const char *path, const char *buf, size_t len,
-		     off_t offset, struct fuse_file_info *fi)
+ * @param de: ptr to first entry in the block
+ * @param arg: the ll_dir_args
+ * @return 1 once the reply is full, 0 to go on to the next block
+ */
+static int ll_dir_blk(struct fs_dirent *de, void *arg)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	struct fs_inode *inode = &inodes[inode_idx];
-	if (S_ISDIR(inode->mode)) return -EISDIR;
-	if (offset > inode->size) return 0;
-
-	//len need to write
-	size_t len_to_write = len;
-
-	//write direct blocks
-	if (len_to_write > 0 && offset < DIR_SIZE) {
-		//len finished write
-		size_t temp = fs_write_dir(inode_idx, buf, len_to_write, (size_t) offset);
-		len_to_write -= temp;
-		offset += temp;
-		buf += temp;
+	struct ll_dir_args *args = arg;
+	struct stat sb;
+	memset(&sb, 0, sizeof(sb));
+	for (int i = 0; i < dirents_per_blk; i++) {
+		if (!de[i].valid || ++args->n <= args->off) continue;
+		inode_lock(de[i].inode, false);
+		sb.st_mode = inodes[de[i].inode].mode;
+		inode_unlock(de[i].inode);
+		sb.st_ino = ll_swap(de[i].inode);
+		size_t len = fuse_add_direntry(args->req, args->buf + args->len,
+				args->size - args->len, de[i].name, &sb, args->n);
+		if (len > args->size - args->len) return 1;
+		args->len += len;
 	}
+	return 0;
+}
 
-	//write indirect 1 blocks
-	if (len_to_write > 0 && offset < DIR_SIZE + INDIR1_SIZE) {
-		//need to allocate indir_1
-		if (!inode->indir_1) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			inode->indir_1 = freeb;
-			update_inode(inode_idx);
-		}
-		size_t temp = fs_write_indir1(inode->indir_1, buf, len_to_write, (size_t) offset - DIR_SIZE);
-		len_to_write -= temp;
-		offset += temp;
-		buf += temp;
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct ll_dir_args args = { req, malloc(size), size, 0, off, 0 };
+	if (args.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-
-	//write indirect 2 blocks
-	if (len_to_write > 0 && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE) {
-		//need to allocate indir_2
-		if (!inode->indir_2) {
-			int freeb = get_free_blk();
-			if (freeb < 0) return len - len_to_write;
-			inode->indir_2 = freeb;
-			update_inode(inode_idx);
-		}
-		//len finshed write
-		size_t temp = fs_write_indir2(inode->indir_2, buf, len_to_write, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
-		len_to_write -= temp;
-		offset += len_to_write;
+	lock_read(&ns_lock, &ns_stats);
+	struct fs_inode *dir = &inodes[ll_swap(ino)];
+	bool is_dir = S_ISDIR(dir->mode);
+	if (is_dir) dir_scan(dir, ll_dir_blk, &args);
+	pthread_rwlock_unlock(&ns_lock);
+	if (!is_dir) {
+		fuse_reply_err(req, ENOTDIR);
+	} else {
+		fuse_reply_buf(req, args.buf, args.len);
 	}
+	free(args.buf);
+}
 
-	if (offset > inode->size) inode->size = offset;
-
-	//update inode and blk
-	update_inode(inode_idx);
-	update_blk();
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
 
-	return (int) (len - len_to_write);
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+	mt_statfs(NULL, &st);
+	fuse_reply_statfs(req, &st);
 }
 
 /**
- * Release resources created by pending open call.
- *
- * @param path: path to the file
- * @param fi: the fuse file info
- *
- * @return: 0 if successful, or -error number
- *	-ENOENT   - file does not exist
- *	-ENOTDIR  - component of path not a directory
-*/
-static int fs_release(const char *path, struct fuse_file_info *fi)
+ * Read the image and start the I/O threads.
+ */
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
 {
-	char *_path = strdup(path);
-	int inode_idx = translate(_path);
-	if (inode_idx < 0) return inode_idx;
-	if (S_ISDIR(inodes[inode_idx].mode)) return -EISDIR;
-	fi->fh = (uint64_t) -1;
-	return SUCCESS;
+	fs_init(conn);
+	ll_workq = workq_create(LL_WORKERS);
 }
 
 /**
- * statfs - get file system statistics. See 'man 2 statfs' for
- * description of 'struct statvfs'.
- *
- * @param path: the path to the file (ignored)
- * @param st: pointer to the destination statvfs struct
- *
- * @return: 0 if successful
- *
- * Errors
- *   none -  Needs to work
-*/
-static int fs_statfs(const char *path, struct statvfs *st)
+ * Finish the queued I/O, then write everything back.
+ */
+static void ll_destroy(void *userdata)
 {
-	/* needs to return the following fields (set others to zero):
-	 *   f_bsize = BLOCK_SIZE
-	 *   f_blocks = total image - metadata
-	 *   f_bfree = f_blocks - blocks used
-	 *   f_bavail = f_bfree
-	 *   f_namelen = <whatever your max namelength is>
-	 */
-
-	//clear original stats
-	memset(st, 0, sizeof(*st));
-	st->f_bsize = FS_BLOCK_SIZE;
-	st->f_blocks = (fsblkcnt_t) (n_blocks - root_inode - inode_base);
-	st->f_bfree = (fsblkcnt_t) num_free_blk();
-	st->f_bavail = st->f_bfree;
-	st->f_namemax = FS_FILENAME_SIZE - 1;
-
-	return 0;
+	if (ll_workq != NULL) workq_destroy(ll_workq);
+	ll_workq = NULL;
+	fs_destroy(userdata);
 }
 
 /**
- * Operations vector. Please don't rename it, as the
- * skeleton code in main.c assumes it is named 'fs_ops'.
+ * Low-level operations vector, used by main.c when mounting with
+ * -lowlevel. fs_ops serves -cmdline and the default mount.
  */
-struct fuse_operations fs_ops = {
-	.init = fs_init,
-	.getattr = fs_getattr,
-	.opendir = fs_opendir,
-	.readdir = fs_readdir,
-	.releasedir = fs_releasedir,
-	.mknod = fs_mknod,
-	.mkdir = fs_mkdir,
-	.unlink = fs_unlink,
-	.rmdir = fs_rmdir,
-	.rename = fs_rename,
-	.chmod = fs_chmod,
-	.utime = fs_utime,
-	.truncate = fs_truncate,
-	.open = fs_open,
-	.read = fs_read,
-	.write = fs_write,
-	.release = fs_release,
-	.statfs = fs_statfs,
+struct fuse_lowlevel_ops fs_ll_ops = {
+	.init = ll_init,
+	.destroy = ll_destroy,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.mknod = ll_mknod,
+	.mkdir = ll_mkdir,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.rename = ll_rename,
+	.open = ll_open,
+	.read = ll_read,
+	.write_buf = ll_write_buf,
+	.fallocate = ll_fallocate,
+	.flush = ll_flush,
+	.release = ll_release,
+	.fsync = ll_fsync,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.releasedir = ll_releasedir,
+	.statfs = ll_statfs,
 };
 
 /*#pragma clang diagnostic pop*/
@@ -9,9 +9,28 @@
 #ifndef __CSX492_H__
 #define __CSX492_H__
 
+/**
+ * The block size of a file system is FS_BLOCK_SIZE << log_block_size
+ * bytes, set when it is made, up to FS_MAX_BLOCK_SIZE. The
+ * superblock, and the journal header, descriptor and commit blocks,
+ * are FS_BLOCK_SIZE bytes at the start of their block; the rest of
+ * the block is zero.
+ */
+enum {
+	FS_BLOCK_SIZE = 1024, /* smallest block size in bytes */
+	FS_MAX_LOG_BLOCK_SIZE = 6, /* log2 of largest block size / FS_BLOCK_SIZE */
+	FS_MAX_BLOCK_SIZE = FS_BLOCK_SIZE << FS_MAX_LOG_BLOCK_SIZE, /* largest block size in bytes */
+	FS_MAX_BLOCKS = 0x7fffffff, /* most blocks in a file system, as block numbers are kept in 31 bits */
+	FS_MAGIC = 0x37363030, /* magic number for superblock */
+	FS_CLEAN = 0x4e41454c /* superblock state when cleanly unmounted */
+};
+
+/**
+ * Superblock feature flags
+ */
 enum {
-	FS_BLOCK_SIZE = 1024, /* block size in bytes */
-	FS_MAGIC = 0x37363030 /* magic number for superblock */
+	FS_FEAT_GROUPS = 1, /* block group layout, see below */
+	FS_FEAT_SIZE64 = 2 /* inode sizes are in the 64-bit size field */
 };
 
 /**
@@ -27,6 +46,19 @@ struct fs_dirent {
 
 /**
  * Superblock - holds file system parameters.
+ *
+ * The original layout has the inode map, the block map and the inode
+ * region right after the superblock, each in one piece. With
+ * FS_FEAT_GROUPS the image is instead divided into num_groups block
+ * groups of blocks_per_group blocks, group g starting at block
+ * g * blocks_per_group (the last group may be shorter). Each group
+ * starts with its own block map, covering the blocks of the group,
+ * then a one-block inode map for its inodes_per_group inodes, then
+ * its inode table, then its data blocks. Group 0 has the superblock
+ * in front of all that. Inode i is inode i % inodes_per_group of
+ * group i / inodes_per_group; map bits past the end of a group are
+ * set. The inode_map_sz, inode_region_sz and block_map_sz fields are
+ * 0 in this layout.
  */
 struct fs_super {
 	uint32_t magic; /* magic number */
@@ -35,38 +67,124 @@ struct fs_super {
 	uint32_t block_map_sz; /* block map size in blocks */
 	uint32_t num_blocks; /* total blocks, including SB, bitmaps, inodes */
 	uint32_t root_inode; /* always inode 1 */
-	char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; /* pad out to an entire block */
+	uint32_t free_blocks; /* free block count at the last clean unmount, not trusted at mount */
+	uint32_t free_inodes; /* free inode count at the last clean unmount, not trusted at mount */
+	uint32_t state; /* FS_CLEAN if unmounted cleanly, otherwise 0 */
+	uint32_t journal_start; /* first block of metadata journal, 0 if none */
+	uint32_t journal_len; /* journal size in blocks */
+	uint32_t features; /* FS_FEAT_ flags */
+	uint32_t blocks_per_group; /* blocks in a block group, a multiple of BITS_PER_BLK */
+	uint32_t inodes_per_group; /* inodes in a block group, a multiple of INODES_PER_BLK */
+	uint32_t num_groups; /* number of block groups */
+	uint32_t log_block_size; /* block size is FS_BLOCK_SIZE << log_block_size */
+	char pad[FS_BLOCK_SIZE - 16 * sizeof(uint32_t)]; /* pad out to FS_BLOCK_SIZE */
+}; /* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Metadata journal - a region of journal_len blocks starting at
+ * journal_start. The first block is the journal header; a
+ * transaction is written after it as a descriptor block listing
+ * the home block numbers, copies of those blocks, and a commit
+ * block. A transaction is replayed at mount if its sequence number
+ * is the one in the header and its commit block checksum matches.
+ */
+enum {
+	FS_JOURNAL_HDR_MAGIC = 0x4a524e48, /* journal header */
+	FS_JOURNAL_DESC_MAGIC = 0x4a524e44, /* transaction descriptor */
+	FS_JOURNAL_COMMIT_MAGIC = 0x4a524e43, /* transaction commit */
+	FS_JOURNAL_MAX_BLKS = FS_BLOCK_SIZE / sizeof(uint32_t) - 3 /* blocks per transaction */
+};
+
+struct fs_journal_header {
+	uint32_t magic; /* FS_JOURNAL_HDR_MAGIC */
+	uint32_t seq; /* sequence number of next transaction to replay */
+	char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; /* pad out to FS_BLOCK_SIZE */
+}; /* total FS_BLOCK_SIZE bytes */
+
+struct fs_journal_desc {
+	uint32_t magic; /* FS_JOURNAL_DESC_MAGIC */
+	uint32_t seq; /* transaction sequence number */
+	uint32_t count; /* number of blocks in transaction */
+	uint32_t blocks[FS_JOURNAL_MAX_BLKS]; /* home block numbers */
+}; /* total FS_BLOCK_SIZE bytes */
+
+struct fs_journal_commit {
+	uint32_t magic; /* FS_JOURNAL_COMMIT_MAGIC */
+	uint32_t seq; /* transaction sequence number */
+	uint32_t count; /* number of blocks in transaction */
+	uint32_t checksum; /* checksum of descriptor and blocks */
+	char pad[FS_BLOCK_SIZE - 4 * sizeof(uint32_t)]; /* pad out to FS_BLOCK_SIZE */
 }; /* total FS_BLOCK_SIZE bytes */
 
 /**
  * Inode - holds file entry information
+ *
+ * Images without FS_FEAT_SIZE64 keep the size in old_size, 32 bits,
+ * which is all older binaries read; their files stay under 2 GiB and
+ * size is only used in memory. fs_upgrade copies old_size to size in
+ * every inode and then sets the flag. Either way old_size is kept
+ * equal to size, or INT32_MAX past that, when an inode is written.
  */
 enum { N_DIRECT = 6 }; /* number direct entries */
+enum {
+	FS_INODE_INDEXED = 1, /* inode flag: directory has a hash index */
+	FS_INODE_ORPHAN = 2, /* inode flag: removed while in use, free when unused */
+	FS_INODE_TRUNC = 4 /* inode flag: blocks being freed, finish at mount */
+};
 struct fs_inode {
 	uint16_t uid; /* user ID of file owner */
 	uint16_t gid; /* group ID of file owner */
 	uint32_t mode; /* permissions | type: file, directory, ... */
 	uint32_t ctime; /* creation time */
 	uint32_t mtime; /* last modification time */
-	int32_t size; /* size in bytes */
+	int32_t old_size; /* size in bytes, without FS_FEAT_SIZE64 */
 	uint32_t direct[N_DIRECT]; /* direct block pointers */
 	uint32_t indir_1; /* single indirect block pointer */
 	uint32_t indir_2; /* double indirect block pointer */
-	uint32_t pad[3]; /* padding to make 64 bytes per inode */
+	uint32_t flags; /* FS_INODE_ flags */
+	int64_t size; /* size in bytes, with FS_FEAT_SIZE64 */
 }; /* total 64 bytes */
 
 /**
- * Constants for blocks
+ * Directory index - a directory that outgrows its first block is
+ * indexed by a hash of the entry names. Block 0 of the directory is
+ * the root of the index; the other blocks are index nodes or leaf
+ * blocks of dirents. Each index entry covers the names hashing from
+ * its hash up to the hash of the next entry, and points to the
+ * logical block of a leaf (depth 0) or of an index node (depth 1).
+ * Names with the same hash are always in the same leaf.
+ *
+ * The magic number reads as an invalid dirent with the unused bit
+ * set, so an index block is never taken for a leaf. An index node
+ * is FS_BLOCK_SIZE bytes at the start of its block whatever the
+ * block size, so it has DX_PER_BLK entries.
+ */
+enum { FS_DX_MAGIC = 0x44580002 };
+
+struct fs_dx_entry {
+	uint32_t hash; /* lowest name hash covered */
+	uint32_t blk; /* logical block in directory */
+}; /* total 8 bytes */
+
+enum { DX_PER_BLK = (FS_BLOCK_SIZE - 8) / sizeof(struct fs_dx_entry) };
+
+struct fs_dx_node {
+	uint32_t magic; /* FS_DX_MAGIC */
+	uint16_t count; /* entries in use */
+	uint16_t depth; /* in root: levels of index nodes below it, 0 or 1 */
+	struct fs_dx_entry entries[DX_PER_BLK]; /* sorted by hash */
+}; /* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Counts for a block of bs bytes
  *   DIRENTS_PER_BLK   - number of directory entries per block
  *   INODES_PER_BLOCK  - number of inodes per block
  *   PTRS_PER_BLOCK    - number of inode pointers per block
  *   BITS_PER_BLOCK    - number of bits per block
  */
-enum {
-	DIRENTS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dirent),
-	INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_inode),
-	PTRS_PER_BLK = FS_BLOCK_SIZE / sizeof(uint32_t),
-	BITS_PER_BLK = FS_BLOCK_SIZE * 8
-};
+#define DIRENTS_PER_BLK(bs) ((int) ((bs) / sizeof(struct fs_dirent)))
+#define INODES_PER_BLK(bs) ((int) ((bs) / sizeof(struct fs_inode)))
+#define PTRS_PER_BLK(bs) ((int) ((bs) / sizeof(uint32_t)))
+#define BITS_PER_BLK(bs) ((int) (bs) * 8)
 
 #endif
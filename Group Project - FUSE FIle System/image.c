@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
 #include <time.h>
 
 #include <unistd.h>
@@ -28,7 +29,9 @@ extern char* strdup(const char *);
 struct image_dev {
 	char *path; // path to device file
 	int   fd; // file descriptor of open file
-	int   nblks; // number of blocks in device
+	int64_t nblks; // number of blocks in device
+	int   blksz; // size of blocks in bytes
+	off_t size; // size of device file in bytes
 };
 
 /**
@@ -36,7 +39,7 @@ struct image_dev {
  * @param dev: the block device
  * @return: the number of blocks in the block device
 */
-static int image_num_blocks(struct blkdev *dev)
+static int64_t image_num_blocks(struct blkdev *dev)
 {
 	struct image_dev *im = dev->private;
 	//check if it's null, if so return null
@@ -46,6 +49,31 @@ static int image_num_blocks(struct blkdev *dev)
 	return im->nblks;
 }
 
+/**
+ * Read or write all of a byte range of the image file, as pread and
+ * pwrite may move less than asked for in one call.
+ * @param im: the image device
+ * @param buf: the buffer
+ * @param len: number of bytes
+ * @param pos: file offset of the first byte
+ * @param writing: true to write, false to read
+ * @return the number of bytes moved, less than len only at the end
+ *   of the file, or -1 on error
+*/
+static ssize_t image_xfer(struct image_dev *im, void *buf, size_t len, off_t pos, bool writing)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = writing ? pwrite(im->fd, (char*) buf + done, len - done, pos + done)
+				: pread(im->fd, (char*) buf + done, len - done, pos + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
 /**
  * To read blocks from block device starting at give block index
  * @param dev: the block device
@@ -54,7 +82,7 @@ static int image_num_blocks(struct blkdev *dev)
  * @param buf: buffer to store the data
  * @return: SUCCESS if successful, E_UNAVAIL if device unavailable
 */
-static int image_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
+static int image_read(struct blkdev *dev, int64_t first_blk, int nblks, void *buf)
 {
 	struct image_dev *im = dev->private;
 
@@ -65,7 +93,8 @@ static int image_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
 
 	assert(first_blk >= 0 && first_blk+nblks <= im->nblks);
 
-	int result = pread(im->fd, buf, nblks*BLOCK_SIZE, first_blk*BLOCK_SIZE);
+	size_t len = (size_t) nblks * im->blksz;
+	ssize_t result = image_xfer(im, buf, len, (off_t) first_blk * im->blksz, false);
 
 	/* Since we already checked the address, this shouldn't
 	 * happen very often.
@@ -74,7 +103,7 @@ static int image_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
 		fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
 		assert(0);
 	}
-	if (result != nblks*BLOCK_SIZE) {
+	if (result != len) {
 		fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
 		assert(0);
 	}
@@ -93,7 +122,7 @@ static int image_read(struct blkdev *dev, int first_blk, int nblks, void *buf)
  * writing to the superblock (block 0).  The write should then still
  * happen.
 */
-static int image_write(struct blkdev * dev, int first_blk, int nblks, void *buf)
+static int image_write(struct blkdev * dev, int64_t first_blk, int nblks, void *buf)
 {
 	struct image_dev *im = dev->private;
 	
@@ -105,18 +134,19 @@ static int image_write(struct blkdev * dev, int first_blk, int nblks, void *buf)
 		assert(0);
 	}
 	if(first_blk == 0){
-		fprintf(stderr, "warning! you're writing to the superblock");
+		fprintf(stderr, "warning! you're writing to the superblock\n");
 	}
 	assert(first_blk >= 0 && first_blk+nblks <= im->nblks);
 
-	int result = pwrite(im->fd, buf, nblks*BLOCK_SIZE, first_blk*BLOCK_SIZE);
+	size_t len = (size_t) nblks * im->blksz;
+	ssize_t result = image_xfer(im, buf, len, (off_t) first_blk * im->blksz, true);
 	
 	
 	if(result < 0){
 		fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
 		assert(0);
 	}
-	if(result != nblks*BLOCK_SIZE) {
+	if(result != len) {
 		fprintf(stderr, "short write on %s: %s\n", im->path, strerror(errno));
 		assert(0);
 	}
@@ -125,21 +155,89 @@ static int image_write(struct blkdev * dev, int first_blk, int nblks, void *buf)
 }
 
 /**
- * Flush the block device.
+ * Flush the block device: wait until blocks written to the image
+ * file are on stable storage.
  * @param dev: the block device
- * @aparam first_blk: index of the block to start flushing 
+ * @param first_blk: index of the block to start flushing
  * @param nblks: number of blocks to flush
- * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable or
+ *   the sync failed, E_BADADDR if the range is outside the device
  *
- * Note: this function does not actually flush anything, it just returns
- * one or the other of the twp possible return values.
+ * Note: any range is flushed with fdatasync, which also writes the
+ * file's own metadata (such as the blocks allocated to fill a sparse
+ * image) and flushes the drive's write cache; sync_file_range does
+ * neither, so it cannot make a range durable. The range is checked,
+ * and a caching device above uses it to pick the blocks to write back.
 */
-static int image_flush(struct blkdev * dev, int first_blk, int nblks)
+static int image_flush(struct blkdev * dev, int64_t first_blk, int64_t nblks)
 {
 	struct image_dev *im = dev->private;
 	if(im->fd == -1){
 		return E_UNAVAIL;
 	}
+	if (first_blk < 0 || nblks < 0 || first_blk + nblks > im->nblks) {
+		return E_BADADDR;
+	}
+	if (nblks == 0) {
+		return SUCCESS;
+	}
+
+	if (fdatasync(im->fd) < 0) {
+		fprintf(stderr, "flush error on %s: %s\n", im->path, strerror(errno));
+		return E_UNAVAIL;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Find where a run of blocks lies in the image file. Blocks are
+ * stored in order from the start of the file, so this is only
+ * arithmetic. As with image_write, a run to be written that takes in
+ * the superblock gets a warning.
+ * @param dev: the block device
+ * @param first_blk: index of the first block
+ * @param nblks: number of blocks
+ * @param writing: whether the blocks will be written
+ * @param fd: set to the image file descriptor
+ * @param pos: set to the file offset of the first block
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable,
+ *   E_BADADDR if the range is outside the device
+*/
+static int image_map(struct blkdev *dev, int64_t first_blk, int nblks, int writing,
+		int *fd, off_t *pos)
+{
+	struct image_dev *im = dev->private;
+	if (im->fd == -1) {
+		return E_UNAVAIL;
+	}
+	if (first_blk < 0 || nblks < 0 || first_blk + nblks > im->nblks) {
+		return E_BADADDR;
+	}
+	if (writing && first_blk == 0) {
+		fprintf(stderr, "warning! you're writing to the superblock\n");
+	}
+	*fd = im->fd;
+	*pos = (off_t) first_blk * im->blksz;
+	return SUCCESS;
+}
+
+/**
+ * Change the size of the blocks the image is addressed in.
+ * @param dev: the block device
+ * @param size: the block size in bytes, a power of two no smaller
+ *   than BLOCK_SIZE
+ * @return SUCCESS if successful, E_SIZE if the size is not allowed
+ *
+ * Note: as at creation, bytes past the last whole block are ignored.
+*/
+static int image_set_block_size(struct blkdev *dev, int size)
+{
+	struct image_dev *im = dev->private;
+	if (size < BLOCK_SIZE || (size & (size - 1)) != 0) {
+		return E_SIZE;
+	}
+	im->blksz = size;
+	im->nblks = im->size / size;
 	return SUCCESS;
 }
 
@@ -163,7 +261,9 @@ static struct blkdev_ops image_ops = {
 	.read = image_read,
 	.write = image_write,
 	.flush = image_flush,
-	.close = image_close
+	.close = image_close,
+	.map = image_map,
+	.set_block_size = image_set_block_size
 };
 
 /**
@@ -204,6 +304,8 @@ struct blkdev *image_create(char *path)
 		fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
 				path, BLOCK_SIZE);
 	}
+	im->size = sb.st_size;
+	im->blksz = BLOCK_SIZE;
 	im->nblks = sb.st_size / BLOCK_SIZE;
 	dev->private = im;
 	dev->ops = &image_ops;
@@ -0,0 +1,428 @@
+/*
+ * file:        journal.c
+ * description: write-ahead metadata journal for FSX492
+ *
+ * Metadata blocks are not written in place as they change. Instead
+ * copies are collected in a running transaction, which is committed
+ * as a whole: the transaction is written to the journal region with
+ * one sequential write, then each block is written to its home
+ * location, and finally the journal header is advanced past the
+ * transaction. If the system stops after the transaction reached
+ * the journal but before the header was advanced, the transaction
+ * is written home again when the journal is next opened.
+ *
+ * The running transaction is kept in memory in the same layout it
+ * is written in: a descriptor block, the logged blocks, and a
+ * commit block right after the last logged block.
+ *
+ * The journal has no lock of its own; fs.c calls it with its
+ * metadata lock held, except for the I/O of journal_commit_write,
+ * during which it keeps the transaction from changing.
+ *
+ * A device error while committing is returned as -EIO and leaves
+ * the transaction in memory, so a later commit tries it again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "blkdev.h"
+#include "fsx492.h"
+#include "journal.h"
+
+/** smallest region: header, descriptor, one block and commit block */
+enum { REGION_MIN_BLKS = 4 };
+
+/** the device holding the journal, NULL if no journal is open */
+static struct blkdev *jdev;
+
+/** first block of the journal region */
+static int jstart;
+
+/** size of the blocks of the device in bytes */
+static int jblksz;
+
+/** maximum number of blocks in a transaction */
+static int jmax;
+
+/** sequence number of the running transaction */
+static uint32_t jseq;
+
+/** running transaction: descriptor, jmax blocks and commit block */
+static char *txn;
+
+/** number of blocks in the running transaction */
+static int jcount;
+
+/** buffer for writing runs of blocks to their home locations */
+static char *runbuf;
+
+/** the descriptor of the running transaction */
+#define DESC ((struct fs_journal_desc*) txn)
+
+/**
+ * Get the buffer for a block of the running transaction.
+ *
+ * @param i: index of the block in the transaction
+ * @return: the block buffer
+ */
+static char *txn_block(int i)
+{
+	return txn + (size_t) (1 + i) * jblksz;
+}
+
+/**
+ * Find a block in the running transaction.
+ *
+ * @param blkno: the home block number
+ * @return: index of the block in the transaction, or -1
+ */
+static int txn_find(int blkno)
+{
+	for (int i = 0; i < jcount; i++) {
+		if (DESC->blocks[i] == (uint32_t) blkno) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Checksum a transaction (FNV-1a over 32-bit words).
+ *
+ * @param buf: the descriptor and blocks of the transaction
+ * @param nblks: number of blocks, including the descriptor
+ * @return: the checksum
+ */
+static uint32_t txn_checksum(const char *buf, int nblks)
+{
+	const uint32_t *w = (const uint32_t*) buf;
+	size_t nwords = (size_t) nblks * jblksz / sizeof(uint32_t);
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < nwords; i++) {
+		h = (h ^ w[i]) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Flush the whole journal device.
+ *
+ * @return: SUCCESS, or -EIO
+ */
+static int journal_flush(void)
+{
+	return (jdev->ops->flush(jdev, 0, jdev->ops->num_blocks(jdev)) < 0) ? -EIO : SUCCESS;
+}
+
+/**
+ * Write the journal header with the sequence number of the next
+ * transaction to replay.
+ *
+ * @param dev: the block device
+ * @param start: first block of the journal region
+ * @param blksz: size of the blocks of the device
+ * @param seq: the sequence number
+ */
+static int write_header(struct blkdev *dev, int start, int blksz, uint32_t seq)
+{
+	char block[blksz];
+	struct fs_journal_header *hdr = (struct fs_journal_header*) block;
+	memset(block, 0, blksz);
+	hdr->magic = FS_JOURNAL_HDR_MAGIC;
+	hdr->seq = seq;
+	return dev->ops->write(dev, start, 1, block);
+}
+
+/** descriptor used while sorting transaction blocks */
+static struct fs_journal_desc *sort_desc;
+
+/**
+ * Compare transaction block indexes by home block number.
+ */
+static int cmp_home(const void *a, const void *b)
+{
+	uint32_t x = sort_desc->blocks[*(const int*) a];
+	uint32_t y = sort_desc->blocks[*(const int*) b];
+	return (x > y) - (x < y);
+}
+
+/**
+ * Write the blocks of the running transaction to their home
+ * locations in block order, one write per run of adjacent blocks.
+ *
+ * @return: SUCCESS, or -EIO
+ */
+static int checkpoint(void)
+{
+	int order[jcount];
+	for (int i = 0; i < jcount; i++) {
+		order[i] = i;
+	}
+	sort_desc = DESC;
+	qsort(order, jcount, sizeof(int), cmp_home);
+
+	int n;
+	for (int i = 0; i < jcount; i += n) {
+		uint32_t blkno = DESC->blocks[order[i]];
+		memcpy(runbuf, txn_block(order[i]), jblksz);
+		for (n = 1; i + n < jcount && DESC->blocks[order[i + n]] == blkno + n; n++) {
+			memcpy(runbuf + (size_t) n * jblksz, txn_block(order[i + n]), jblksz);
+		}
+		if (jdev->ops->write(jdev, blkno, n, runbuf) < 0) return -EIO;
+	}
+	return journal_flush();
+}
+
+/**
+ * Initialize an empty journal in a region of a block device.
+ *
+ * @param dev: the block device
+ * @param start: first block of the journal region
+ * @param nblks: number of blocks in the journal region
+ * @param blksz: size of the blocks of the device
+ * @return: SUCCESS, -EINVAL if the region is too small to hold a
+ *   transaction, or error from the device
+ */
+int journal_format(struct blkdev *dev, int start, int nblks, int blksz)
+{
+	if (nblks < REGION_MIN_BLKS) {
+		return -EINVAL;
+	}
+	char zero[blksz];
+	memset(zero, 0, sizeof(zero));
+	int result = dev->ops->write(dev, start + 1, 1, zero);
+	if (result < 0) {
+		return result;
+	}
+	return write_header(dev, start, blksz, 1);
+}
+
+/**
+ * Open the journal in a region of a block device, replaying the
+ * last transaction if it was committed but not checkpointed.
+ *
+ * @param dev: the block device
+ * @param start: first block of the journal region
+ * @param nblks: number of blocks in the journal region
+ * @param blksz: size of the blocks of the device
+ * @return: number of transactions replayed, -EIO if the replay
+ *   failed, or other <0 if the region does not hold a journal
+ */
+int journal_open(struct blkdev *dev, int start, int nblks, int blksz)
+{
+	char block[blksz];
+	struct fs_journal_header *hdr = (struct fs_journal_header*) block;
+	if (nblks < REGION_MIN_BLKS || dev->ops->read(dev, start, 1, block) < 0 ||
+			hdr->magic != FS_JOURNAL_HDR_MAGIC) {
+		return -1;
+	}
+
+	jdev = dev;
+	jstart = start;
+	jblksz = blksz;
+	jmax = (nblks - 3 < FS_JOURNAL_MAX_BLKS) ? nblks - 3 : FS_JOURNAL_MAX_BLKS;
+	jseq = hdr->seq;
+	jcount = 0;
+	txn = calloc(jmax + 2, blksz);
+	runbuf = malloc((size_t) jmax * blksz);
+	if (txn == NULL || runbuf == NULL) {
+		fprintf(stderr, "cannot allocate journal buffers\n");
+		exit(1);
+	}
+
+	// replay the transaction after the header if it is the next
+	// one and was completely written
+	if (dev->ops->read(dev, start + 1, 1, DESC) < 0) return -EIO;
+	if (DESC->magic != FS_JOURNAL_DESC_MAGIC || DESC->seq != jseq || DESC->count > (uint32_t) jmax) {
+		return 0;
+	}
+	int count = DESC->count;
+	if (dev->ops->read(dev, start + 2, count + 1, txn_block(0)) < 0) return -EIO;
+	struct fs_journal_commit *commit = (struct fs_journal_commit*) txn_block(count);
+	if (commit->magic != FS_JOURNAL_COMMIT_MAGIC || commit->seq != jseq ||
+			commit->count != (uint32_t) count ||
+			commit->checksum != txn_checksum(txn, count + 1)) {
+		return 0;
+	}
+
+	jcount = count;
+	if (checkpoint() < 0) return -EIO;
+	jcount = 0;
+	jseq++;
+	if (write_header(jdev, jstart, jblksz, jseq) < 0 || journal_flush() < 0) return -EIO;
+	return 1;
+}
+
+/**
+ * Close the journal, committing any logged blocks first.
+ *
+ * @return: SUCCESS, or -EIO if the logged blocks could not be committed
+ */
+int journal_close(void)
+{
+	if (jdev == NULL) {
+		return SUCCESS;
+	}
+	int result = journal_commit();
+	free(txn);
+	free(runbuf);
+	txn = runbuf = NULL;
+	jdev = NULL;
+	return result;
+}
+
+/**
+ * Whether a journal is open.
+ */
+bool journal_active(void)
+{
+	return jdev != NULL;
+}
+
+/**
+ * Number of blocks that can still be logged before the running
+ * transaction is full and has to be committed.
+ */
+int journal_space(void)
+{
+	return jmax - jcount;
+}
+
+/**
+ * Number of blocks logged in the running transaction.
+ */
+int journal_pending(void)
+{
+	return jcount;
+}
+
+/**
+ * Add a copy of a metadata block to the running transaction.
+ *
+ * @param blkno: the home block number
+ * @param buf: the block contents
+ * @return: SUCCESS, or -ENOSPC if the transaction is full
+ */
+int journal_log(int blkno, const void *buf)
+{
+	int i = txn_find(blkno);
+	if (i < 0) {
+		if (jcount == jmax) {
+			return -ENOSPC;
+		}
+		i = jcount++;
+		DESC->blocks[i] = blkno;
+	}
+	memcpy(txn_block(i), buf, jblksz);
+	return SUCCESS;
+}
+
+/**
+ * Read a block from the running transaction.
+ *
+ * @param blkno: the home block number
+ * @param buf: buffer for the block contents
+ * @return: true if the block was in the transaction
+ */
+bool journal_read(int blkno, void *buf)
+{
+	int i = txn_find(blkno);
+	if (i < 0) {
+		return false;
+	}
+	memcpy(buf, txn_block(i), jblksz);
+	return true;
+}
+
+/**
+ * Drop a block from the running transaction.
+ *
+ * @param blkno: the home block number
+ */
+void journal_forget(int blkno)
+{
+	int i = txn_find(blkno);
+	if (i < 0) {
+		return;
+	}
+	int last = --jcount;
+	if (i != last) {
+		DESC->blocks[i] = DESC->blocks[last];
+		memcpy(txn_block(i), txn_block(last), jblksz);
+	}
+}
+
+/**
+ * Write the running transaction: to the journal, then to the home
+ * locations of its blocks, then retire it in the journal header. The
+ * device is flushed twice: once to make the transaction durable,
+ * which also flushes file data written before the commit, and once
+ * before the header is advanced past the checkpointed blocks. The
+ * header write itself needs no flush of its own; if it is lost the
+ * transaction is just replayed, and the next commit's first flush
+ * covers it before the transaction is overwritten.
+ *
+ * Only the descriptor's header fields and the commit block change,
+ * so journal_read and journal_space may be called meanwhile.
+ *
+ * @return: SUCCESS, or -EIO
+ */
+int journal_commit_write(void)
+{
+	if (jcount == 0) {
+		return SUCCESS;
+	}
+
+	// fill in descriptor and commit block
+	DESC->magic = FS_JOURNAL_DESC_MAGIC;
+	DESC->seq = jseq;
+	DESC->count = jcount;
+	struct fs_journal_commit *commit = (struct fs_journal_commit*) txn_block(jcount);
+	memset(commit, 0, jblksz);
+	commit->magic = FS_JOURNAL_COMMIT_MAGIC;
+	commit->seq = jseq;
+	commit->count = jcount;
+	commit->checksum = txn_checksum(txn, jcount + 1);
+
+	// the whole transaction goes to the journal in one write
+	if (jdev->ops->write(jdev, jstart + 1, jcount + 2, txn) < 0 || journal_flush() < 0) {
+		return -EIO;
+	}
+
+	// then home, and the transaction no longer needs replaying
+	if (checkpoint() < 0) {
+		return -EIO;
+	}
+	return (write_header(jdev, jstart, jblksz, jseq + 1) < 0) ? -EIO : SUCCESS;
+}
+
+/**
+ * Start a new, empty transaction after journal_commit_write succeeded.
+ */
+void journal_commit_end(void)
+{
+	if (jcount == 0) {
+		return;
+	}
+	jseq++;
+	jcount = 0;
+}
+
+/**
+ * Commit the running transaction (see journal_commit_write).
+ *
+ * @return: SUCCESS, or -EIO
+ */
+int journal_commit(void)
+{
+	int result = journal_commit_write();
+	if (result == SUCCESS) {
+		journal_commit_end();
+	}
+	return result;
+}
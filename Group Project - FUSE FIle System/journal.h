@@ -0,0 +1,121 @@
+/*
+ * file:        journal.h
+ * description: write-ahead metadata journal for FSX492
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+
+#include "blkdev.h"
+
+/**
+ * Initialize an empty journal in a region of a block device.
+ *
+ * @param dev: the block device
+ * @param start: first block of the journal region
+ * @param nblks: number of blocks in the journal region
+ * @param blksz: size of the blocks of the device
+ * @return: SUCCESS, -EINVAL if the region is too small to hold a
+ *   transaction, or error from the device
+ */
+extern int journal_format(struct blkdev *dev, int start, int nblks, int blksz);
+
+/**
+ * Open the journal in a region of a block device, replaying the
+ * last transaction if it was committed but not checkpointed.
+ *
+ * @param dev: the block device
+ * @param start: first block of the journal region
+ * @param nblks: number of blocks in the journal region
+ * @param blksz: size of the blocks of the device
+ * @return: number of transactions replayed, -EIO if the replay
+ *   failed, or other <0 if the region does not hold a journal
+ */
+extern int journal_open(struct blkdev *dev, int start, int nblks, int blksz);
+
+/**
+ * Close the journal, committing any logged blocks first.
+ *
+ * @return: SUCCESS, or -EIO if the logged blocks could not be committed
+ */
+extern int journal_close(void);
+
+/**
+ * Whether a journal is open.
+ */
+extern bool journal_active(void);
+
+/**
+ * Number of blocks that can still be logged before the running
+ * transaction is full and has to be committed.
+ */
+extern int journal_space(void);
+
+/**
+ * Number of blocks logged in the running transaction.
+ */
+extern int journal_pending(void);
+
+/**
+ * Add a copy of a metadata block to the running transaction,
+ * replacing any copy of the block already there. The block is
+ * written to its home location when the transaction is committed.
+ * A full transaction is not committed to make room, since it may
+ * hold part of an operation; the caller keeps it from filling up.
+ *
+ * @param blkno: the home block number
+ * @param buf: the block contents
+ * @return: SUCCESS, or -ENOSPC if the transaction is full
+ */
+extern int journal_log(int blkno, const void *buf);
+
+/**
+ * Read a block from the running transaction.
+ *
+ * @param blkno: the home block number
+ * @param buf: buffer for the block contents
+ * @return: true if the block was in the transaction
+ */
+extern bool journal_read(int blkno, void *buf);
+
+/**
+ * Drop a block from the running transaction, e.g. because the
+ * block has been freed and may be reused for file data.
+ *
+ * @param blkno: the home block number
+ */
+extern void journal_forget(int blkno);
+
+/**
+ * Write the running transaction to the journal and to the home
+ * locations of its blocks, as journal_commit does, but leave it
+ * running: journal_read still finds its blocks until
+ * journal_commit_end is called. Only journal_read, journal_space and
+ * journal_pending may be called meanwhile, so the I/O can be done
+ * without the lock that serializes the other calls.
+ *
+ * @return: SUCCESS, or -EIO
+ */
+extern int journal_commit_write(void);
+
+/**
+ * Start a new, empty transaction once journal_commit_write has
+ * succeeded.
+ */
+extern void journal_commit_end(void);
+
+/**
+ * Commit the running transaction: write it to the journal with
+ * one sequential write, write the blocks to their home locations,
+ * and retire the transaction in the journal header. The header
+ * update is flushed by the next commit or when the journal's device
+ * is next flushed. After a device error the transaction stays in
+ * memory and is written again by the next commit.
+ *
+ * @return: SUCCESS, or -EIO
+ */
+extern int journal_commit(void);
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,134 @@
+/*
+ * file:        lockstat.c
+ * description: locks that count how often and how long threads wait
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lockstat.h"
+
+/** registered records, in order of registration */
+static struct lock_stats *all_stats;
+
+/** protects the list of registered records */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Add a lock_stats record to the contention report. Registering a
+ * record twice has no effect.
+ *
+ * @param ls: the record, with name set
+ */
+void lock_stats_register(struct lock_stats *ls)
+{
+	pthread_mutex_lock(&stats_lock);
+	if (!ls->registered) {
+		struct lock_stats **p = &all_stats;
+		while (*p != NULL) {
+			p = &(*p)->next;
+		}
+		*p = ls;
+		ls->next = NULL;
+		ls->registered = true;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Get the current time in nanoseconds.
+ */
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Count an acquisition, and a wait that started at start if the
+ * lock was contended.
+ *
+ * @param ls: statistics of the lock
+ * @param start: when the wait started, or 0 if there was none
+ */
+static void count(struct lock_stats *ls, long start)
+{
+	__atomic_fetch_add(&ls->acquired, 1, __ATOMIC_RELAXED);
+	if (start != 0) {
+		__atomic_fetch_add(&ls->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ls->wait_ns, now_ns() - start, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Lock a mutex, counting the wait.
+ *
+ * @param m: the mutex
+ * @param ls: statistics of the mutex
+ */
+void lock_mutex(pthread_mutex_t *m, struct lock_stats *ls)
+{
+	long start = 0;
+	if (pthread_mutex_trylock(m) != 0) {
+		start = now_ns();
+		pthread_mutex_lock(m);
+	}
+	count(ls, start);
+}
+
+/**
+ * Lock a reader/writer lock for reading, counting the wait.
+ *
+ * @param l: the lock
+ * @param ls: statistics of the lock
+ */
+void lock_read(pthread_rwlock_t *l, struct lock_stats *ls)
+{
+	long start = 0;
+	if (pthread_rwlock_tryrdlock(l) != 0) {
+		start = now_ns();
+		pthread_rwlock_rdlock(l);
+	}
+	count(ls, start);
+}
+
+/**
+ * Lock a reader/writer lock for writing, counting the wait.
+ *
+ * @param l: the lock
+ * @param ls: statistics of the lock
+ */
+void lock_write(pthread_rwlock_t *l, struct lock_stats *ls)
+{
+	long start = 0;
+	if (pthread_rwlock_trywrlock(l) != 0) {
+		start = now_ns();
+		pthread_rwlock_wrlock(l);
+	}
+	count(ls, start);
+}
+
+/**
+ * Print the contention report: for each registered lock, how often
+ * it was acquired, how often a thread had to wait for it, and the
+ * total and average wait.
+ *
+ * @param f: the stream to print to
+ */
+void lock_report(FILE *f)
+{
+	fprintf(f, "%-12s %12s %10s %8s %12s %10s\n",
+			"lock", "acquired", "contended", "%", "wait ms", "avg us");
+	pthread_mutex_lock(&stats_lock);
+	for (struct lock_stats *ls = all_stats; ls != NULL; ls = ls->next) {
+		long acquired = __atomic_load_n(&ls->acquired, __ATOMIC_RELAXED);
+		long contended = __atomic_load_n(&ls->contended, __ATOMIC_RELAXED);
+		long wait_ns = __atomic_load_n(&ls->wait_ns, __ATOMIC_RELAXED);
+		fprintf(f, "%-12s %12ld %10ld %7.2f%% %12.3f %10.2f\n", ls->name,
+				acquired, contended, acquired ? 100.0 * contended / acquired : 0.0,
+				wait_ns / 1e6, contended ? wait_ns / 1e3 / contended : 0.0);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,69 @@
+/*
+ * file:        lockstat.h
+ * description: locks that count how often and how long threads wait
+ *
+ * Each lock, or class of locks such as all the inode locks, has a
+ * lock_stats record. Acquiring a lock through the functions here
+ * first tries it without blocking; only if that fails is the wait
+ * timed, so an uncontended lock costs one extra atomic add.
+ */
+
+#ifndef LOCKSTAT_H_
+#define LOCKSTAT_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/** wait statistics of a lock or class of locks */
+struct lock_stats {
+	const char *name; /* name in the report */
+	long acquired; /* times acquired */
+	long contended; /* times a thread had to wait */
+	long wait_ns; /* total nanoseconds spent waiting */
+	struct lock_stats *next; /* next record in the report */
+	bool registered; /* whether the record is in the report */
+};
+
+/**
+ * Add a lock_stats record to the contention report. Registering a
+ * record twice has no effect.
+ *
+ * @param ls: the record, with name set
+ */
+extern void lock_stats_register(struct lock_stats *ls);
+
+/**
+ * Lock a mutex, counting the wait.
+ *
+ * @param m: the mutex
+ * @param ls: statistics of the mutex
+ */
+extern void lock_mutex(pthread_mutex_t *m, struct lock_stats *ls);
+
+/**
+ * Lock a reader/writer lock for reading, counting the wait.
+ *
+ * @param l: the lock
+ * @param ls: statistics of the lock
+ */
+extern void lock_read(pthread_rwlock_t *l, struct lock_stats *ls);
+
+/**
+ * Lock a reader/writer lock for writing, counting the wait.
+ *
+ * @param l: the lock
+ * @param ls: statistics of the lock
+ */
+extern void lock_write(pthread_rwlock_t *l, struct lock_stats *ls);
+
+/**
+ * Print the contention report: for each registered lock, how often
+ * it was acquired, how often a thread had to wait for it, and the
+ * total and average wait.
+ *
+ * @param f: the stream to print to
+ */
+extern void lock_report(FILE *f);
+
+#endif /* LOCKSTAT_H_ */
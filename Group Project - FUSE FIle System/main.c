@@ -23,8 +23,13 @@ struct stat sb;
 #include <errno.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include "image.h"
+#include "cache.h"
+#include "lockstat.h"
+#include "mkfs.h"
 
 #include "fsx492.h"		/* only for certain constants */
 
@@ -36,6 +41,10 @@ extern char *strdup(const char* str);
  * All functions accessed through operations structure. */
 extern struct fuse_operations fs_ops;
 
+/**
+ * The same file system through the low-level (inode-based) API. */
+extern struct fuse_lowlevel_ops fs_ll_ops;
+
 /**  disk block device */
 struct blkdev *disk;
 
@@ -43,6 +52,15 @@ struct data {
 	char *image_name;
 	int   part;
 	int   cmd_mode;
+	int   cache_blks;
+	int   writeback;
+	char *lockstats;
+	int   lowlevel;
+	int   mkfs_blks;
+	int   groups;
+	int   block_size;
+	int   upgrade;
+	int   journal;
 } _data;
 
 /**
@@ -50,23 +68,63 @@ struct data {
  */
 enum { MAX_PATH = 4096 };
 
+/**
+ * Constant: default number of blocks in the buffer cache
+ */
+enum { DEFAULT_CACHE_BLKS = 1024 };
+
+/**
+ * Constants: seconds a block may stay dirty in write-back mode,
+ * and the fraction of the cache that may be dirty
+ */
+enum { WRITEBACK_AGE = 5, WRITEBACK_DIRTY_DIV = 2 };
+
 static void help(){
 	printf("Arguments:\n");
 	printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
 	printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
+	printf(" -cache <nblks> : Size of the block buffer cache in blocks, 0 to disable (default %d)\n",
+			DEFAULT_CACHE_BLKS);
+	printf(" -writeback : Hold written blocks in the cache and write them back in the background\n");
+	printf(" -lockstats <file> : Write a lock contention report to the file at unmount\n");
+	printf(" -lowlevel : Mount through the inode-based FUSE API instead of the path-based one\n");
+	printf(" -mkfs <nblks> : Create the image with an empty file system of nblks blocks, and exit\n");
+	printf(" -groups : With -mkfs, divide the file system into block groups\n");
+	printf(" -blocksize <bytes> : With -mkfs, the block size, a power of two from %d to %d (default %d)\n",
+			FS_BLOCK_SIZE, FS_MAX_BLOCK_SIZE, FS_BLOCK_SIZE);
+	printf(" -upgrade : Let files of the image grow past 2 GiB, which older versions cannot read, and exit\n");
+	printf(" -journal : Add a metadata journal to an image made without one, and exit\n");
 }
 
 /*
  * See comments in /usr/include/fuse/fuse_opts.h for details of
  * FUSE argument processing.
  *
- *  usage: ./fsx492 [-cmdline] -image test/fsx492.img <directory>
+ *  usage: ./fsx492 [-cmdline] [-cache nblks] [-writeback] -image test/fsx492.img <directory>
  *  		[-cmdline cmd]: optional; run the file system in cmdline mode
+ *  		[-cache nblks]: optional; buffer cache size in blocks, 0 = none
+ *  		[-writeback]: optional; write-back instead of write-through cache
+ *  		[-lockstats file]: optional; lock contention report written at unmount
+ *  		[-lowlevel]: optional; serve the mount through fs_ll_ops
+ *  		[-mkfs nblks]: optional; format a new image of nblks blocks and exit
+ *  		[-groups]: optional; with -mkfs, use the block group layout
+ *  		[-blocksize bytes]: optional; with -mkfs, the block size
+ *  		[-upgrade]: optional; move the image to 64-bit file sizes and exit
+ *  		[-journal]: optional; add a journal to the image and exit
  *              <directory> - directory to mount it on
  */
 static struct fuse_opt opts[] = {
 	{"-image %s", offsetof(struct data, image_name), 0},
 	{"-cmdline", offsetof(struct data, cmd_mode), 1},
+	{"-cache %d", offsetof(struct data, cache_blks), 0},
+	{"-writeback", offsetof(struct data, writeback), 1},
+	{"-lockstats %s", offsetof(struct data, lockstats), 0},
+	{"-lowlevel", offsetof(struct data, lowlevel), 1},
+	{"-mkfs %d", offsetof(struct data, mkfs_blks), 0},
+	{"-groups", offsetof(struct data, groups), 1},
+	{"-blocksize %d", offsetof(struct data, block_size), 0},
+	{"-upgrade", offsetof(struct data, upgrade), 1},
+	{"-journal", offsetof(struct data, journal), 1},
 	FUSE_OPT_END
 };
 
@@ -266,17 +324,30 @@ static int do_pwd(char *argv[])
 	return 0;
 }
 
-static char lsbuf[DIRENTS_PER_BLK][MAX_PATH]; /** buffer to list directory entries */
+static char (*lsbuf)[MAX_PATH]; /** buffer to list directory entries */
 static int  lsi;  /* current ls index */
+static int  lsmax;  /* number of entries allocated in lsbuf */
 
 static void init_ls(void)
 {
 	lsi = 0;
 }
 
+/**
+ * Get the next entry of the ls buffer, growing the buffer if it is full.
+ */
+static char *ls_next(void)
+{
+	if (lsi == lsmax) {
+		lsmax = lsmax ? 2 * lsmax : 64;
+		lsbuf = realloc(lsbuf, lsmax * sizeof(*lsbuf));
+	}
+	return lsbuf[lsi++];
+}
+
 static int filler(void *buf, const char *name, const struct stat *sb, off_t off)
 {
-	sprintf(lsbuf[lsi++], "%s\n", name);
+	sprintf(ls_next(), "%s\n", name);
 	return 0;
 }
 
@@ -331,7 +402,7 @@ static int do_ls0(char *argv[])
 static int dashl_filler(void *buf, const char *name, const struct stat *sb, off_t off)
 {
 	char mode[16], time[26], *lasts;
-	sprintf(lsbuf[lsi++], "%5jd %s %2jd %4d %4d %8jd %s %s\n",
+	sprintf(ls_next(), "%5jd %s %2jd %4d %4d %8jd %s %s\n",
 			sb->st_blocks, strmode(mode, sb->st_mode),
 			sb->st_nlink, sb->st_uid, sb->st_gid, sb->st_size,
 			strtok_r(ctime_r(&sb->st_mtime,time),"\n",&lasts), name);
@@ -476,7 +547,8 @@ static int do_put(char *argv[])
 {
 	char *outside = argv[0], *inside = argv[1];
 	char path[MAX_PATH];
-	int len, fd, offset = 0, val;
+	int len, fd, val;
+	off_t offset = 0;
 
 	if ((fd = open(outside, O_RDONLY, 0)) < 0) {
 		return fd;
@@ -526,7 +598,8 @@ static int do_get(char *argv[])
 {
 	char *inside = argv[0], *outside = argv[1];
 	char path[MAX_PATH];
-	int len, fd, offset = 0;
+	int len, fd;
+	off_t offset = 0;
 
 	if ((fd = open(outside, O_WRONLY|O_CREAT|O_TRUNC, 0777)) < 0) {
 		return fd;
@@ -574,7 +647,8 @@ static int do_get1(char *argv[])
 static int do_show(char *argv[])
 {
 	char path[MAX_PATH];
-	int len, offset = 0;
+	int len;
+	off_t offset = 0;
 
 	full_path(argv[0], path);
 	struct fuse_file_info info;
@@ -604,11 +678,59 @@ static int do_statfs(char *argv[])
 		printf("block size: %lu\n", st.f_bsize);
 		printf("no. blocks: %ju\n", st.f_blocks);
 		printf("avail blocks: %ju\n", st.f_bavail);
+		printf("avail inodes: %ju\n", st.f_favail);
 		printf("max name length: %lu\n", st.f_namemax);
 	}
 	return retval;
 }
 
+/**
+ * Write back all changes to the image
+ *
+ * @argv unused
+ */
+static int do_sync(char *argv[])
+{
+	return fs_ops.fsync("/", 0, NULL);
+}
+
+/**
+ * Print buffer cache statistics
+ *
+ * @argv unused
+ */
+static int do_cachestats(char *argv[])
+{
+	if (_data.cache_blks <= 0) {
+		printf("buffer cache disabled\n");
+		return 0;
+	}
+	struct cache_stats st;
+	cache_get_stats(disk, &st);
+	long total = st.hits + st.misses;
+	printf("cache blocks: %d\n", st.nbufs);
+	printf("hits: %ld\n", st.hits);
+	printf("misses: %ld\n", st.misses);
+	printf("hit rate: %.1f%%\n", total ? 100.0 * st.hits / total : 0.0);
+	printf("readahead blocks: %ld\n", st.prefetched);
+	printf("readahead hits: %ld\n", st.ra_hits);
+	printf("readahead wasted: %ld\n", st.ra_wasted);
+	printf("dirty blocks: %d\n", st.ndirty);
+	printf("written back: %ld\n", st.written_back);
+	return 0;
+}
+
+/**
+ * Print lock contention statistics
+ *
+ * @argv unused
+ */
+static int do_lockstats(char *argv[])
+{
+	lock_report(stdout);
+	return 0;
+}
+
 /**
  * Print files statistics
  *
@@ -718,6 +840,9 @@ static struct {
 	{"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
 	{"show", 1, do_show, "show <file> - retrieve and print a file"},
 	{"statfs", 0, do_statfs, "statfs - print file system info"},
+	{"sync", 0, do_sync, "sync - write back all changes to the image"},
+	{"cachestats", 0, do_cachestats, "cachestats - print buffer cache hit/miss and readahead counts"},
+	{"lockstats", 0, do_lockstats, "lockstats - print how often and how long threads waited for locks"},
 	{"truncate", 1, do_truncate, "truncate <file> - truncate to zero length"},
 	{"utime", 1, do_utime, "utime <file> - set modified time to current time"},
 	{"touch", 1, do_touch, "touch <file> - create file or set modified time to current time"},
@@ -813,6 +938,40 @@ static void fixup(int argc, char *argv[]) {
 	}
 }
 
+/**
+ * Mount the file system and serve it through the low-level API
+ * until it is unmounted, as fuse_main does for fs_ops.
+ *
+ * @param args the FUSE arguments left after option processing
+ * @return 0 if successful, 1 on error
+ */
+static int lowlevel_main(struct fuse_args *args)
+{
+	char *mountpoint;
+	int multithreaded, foreground;
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+		return 1;
+	}
+	int err = -1;
+	struct fuse_chan *ch = fuse_mount(mountpoint, args);
+	if (ch != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(args, &fs_ll_ops, sizeof(fs_ll_ops), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) == 0) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return err ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	fixup(argc, argv);
@@ -820,6 +979,8 @@ int main(int argc, char **argv)
 	/* Argument processing and checking
 	 */
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	_data.cache_blks = DEFAULT_CACHE_BLKS;
+	_data.block_size = FS_BLOCK_SIZE;
 	if (fuse_opt_parse(&args, &_data, opts, NULL) == -1){
 		help();
 		exit(1);
@@ -838,19 +999,79 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (_data.mkfs_blks > 0) {  /* make an empty image of that size */
+		int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		if (fd < 0 || ftruncate(fd, (off_t) _data.mkfs_blks * _data.block_size) < 0) {
+			fprintf(stderr, "cannot create image file '%s': %s\n", file, strerror(errno));
+			exit(1);
+		}
+		close(fd);
+	}
+
 	if ((disk = image_create(file)) == NULL) {
 		fprintf(stderr, "cannot open image file '%s': %s\n", file, strerror(errno));
 		help();
 		exit(1);
 	}
 
+	if (_data.mkfs_blks > 0) {
+		int err = fs_format(disk, _data.groups, _data.block_size);
+		disk->ops->close(disk);
+		if (err < 0) {
+			fprintf(stderr, "cannot format image file '%s'\n", file);
+			exit(1);
+		}
+		return 0;
+	}
+
+	if (_data.upgrade || _data.journal) {
+		int err = _data.upgrade ? fs_upgrade(disk) : SUCCESS;
+		if (err >= 0 && _data.journal) {
+			err = fs_add_journal(disk);
+		}
+		disk->ops->close(disk);
+		if (err < 0) {
+			fprintf(stderr, "cannot %s image file '%s'\n",
+					_data.upgrade ? "upgrade" : "add a journal to", file);
+			exit(1);
+		}
+		return 0;
+	}
+
+	/* layer the buffer cache over the image */
+	if (_data.cache_blks > 0) {
+		if ((disk = cache_create(disk, _data.cache_blks)) == NULL) {
+			fprintf(stderr, "cannot create %d block cache\n", _data.cache_blks);
+			exit(1);
+		}
+		if (_data.writeback) {
+			cache_set_writeback(disk, WRITEBACK_AGE, _data.cache_blks / WRITEBACK_DIRTY_DIV);
+		}
+	} else if (_data.writeback) {
+		fprintf(stderr, "-writeback needs the buffer cache, ignored\n");
+	}
+
 	if (_data.cmd_mode) {  /* process interactive commands */
 		fs_ops.init(NULL);
-		_blksiz(FS_BLOCK_SIZE);
+		struct statvfs st;
+		_blksiz(fs_ops.statfs("/", &st) == 0 ? st.f_bsize : FS_BLOCK_SIZE);
 		cmdloop();
+		fs_ops.destroy(NULL);
 		return 0;
 	}
 
 	/** pass control to fuse */
-	return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+	int result = _data.lowlevel ? lowlevel_main(&args)
+			: fuse_main(args.argc, args.argv, &fs_ops, NULL);
+
+	/* fuse_main returns at unmount, in the process that served the
+	 * file system, which may have lost its stdout by daemonizing */
+	if (_data.lockstats != NULL) {
+		FILE *f = fopen(_data.lockstats, "w");
+		if (f != NULL) {
+			lock_report(f);
+			fclose(f);
+		}
+	}
+	return result;
 }
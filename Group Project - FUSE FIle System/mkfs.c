@@ -0,0 +1,421 @@
+/*
+ * file:        mkfs.c
+ * description: create an empty FSX492 file system on a block device
+ *
+ * The file system made has a root directory with one empty block and
+ * a metadata journal right after it, of 1/16 of the image but from 8
+ * to 256 blocks. There is about one inode for every four blocks.
+ *
+ * Images in the original layout with 1024 byte blocks are made
+ * without FS_FEAT_SIZE64, so that older binaries can still use them;
+ * fs_upgrade lets their files grow past 2 GiB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "blkdev.h"
+#include "bitmap.h"
+#include "fsx492.h"
+#include "journal.h"
+#include "mkfs.h"
+
+/**
+ * Constant: blocks per inode
+ */
+enum { BLKS_PER_INODE = 4 };
+
+/**
+ * Constants: journal size as a fraction of the image, and its limits
+ * in blocks; the smallest journal still holds the most blocks a
+ * single operation may change, which fs_init checks at mount
+ */
+enum { JOURNAL_FRACTION = 16, JOURNAL_MIN_BLKS = 64, JOURNAL_MAX_BLKS = 256 };
+
+/**
+ * Get the size of the journal for a file system.
+ *
+ * @param nblocks: number of blocks in the file system
+ * @return: the journal size in blocks
+ */
+static int journal_blks(int nblocks)
+{
+	int len = nblocks / JOURNAL_FRACTION;
+	if (len < JOURNAL_MIN_BLKS) len = JOURNAL_MIN_BLKS;
+	if (len > JOURNAL_MAX_BLKS) len = JOURNAL_MAX_BLKS;
+	return len;
+}
+
+/**
+ * Fill in the root directory inode.
+ *
+ * @param ip: the inode
+ * @param blk: the first block of the directory
+ */
+static void make_root(struct fs_inode *ip, int blk)
+{
+	memset(ip, 0, sizeof(struct fs_inode));
+	ip->mode = S_IFDIR | 0777;
+	ip->ctime = ip->mtime = time(NULL);
+	ip->size = 0;
+	ip->direct[0] = blk;
+}
+
+/**
+ * Write metadata blocks and the empty root directory block. The
+ * metadata buffer is freed.
+ *
+ * @param dev: the block device
+ * @param first: the first block of the metadata
+ * @param nblks: the number of metadata blocks
+ * @param meta: the metadata blocks
+ * @param root_blk: the root directory block, 0 if none here
+ * @param bs: the block size
+ * @return: SUCCESS, or error from the device
+ */
+static int write_meta(struct blkdev *dev, int first, int nblks, char *meta, int root_blk, int bs)
+{
+	int rv = dev->ops->write(dev, first, nblks, meta);
+	if (rv >= 0 && root_blk != 0) {
+		memset(meta, 0, bs);
+		rv = dev->ops->write(dev, root_blk, 1, meta);
+	}
+	free(meta);
+	return rv;
+}
+
+/**
+ * Write the superblock at the start of block 0.
+ *
+ * @param dev: the block device
+ * @param sb: the superblock
+ * @param bs: the block size
+ * @return: SUCCESS, or error from the device
+ */
+static int write_super(struct blkdev *dev, struct fs_super *sb, int bs)
+{
+	char *block = calloc(1, bs);
+	if (block == NULL) {
+		return E_UNAVAIL;
+	}
+	memcpy(block, sb, sizeof(*sb));
+	int rv = dev->ops->write(dev, 0, 1, block);
+	free(block);
+	return rv;
+}
+
+/**
+ * Format in the original layout: the inode map, block map and inode
+ * region follow the superblock, and the root directory block comes
+ * right after them.
+ */
+static int format_flat(struct blkdev *dev, int nblocks, struct fs_super *sb, int bs)
+{
+	int ipb = INODES_PER_BLK(bs);
+	int ninodes = (nblocks / BLKS_PER_INODE + ipb - 1) / ipb * ipb;
+	if (ninodes < ipb) ninodes = ipb;
+	sb->inode_map_sz = (ninodes + BITS_PER_BLK(bs) - 1) / BITS_PER_BLK(bs);
+	sb->block_map_sz = (nblocks + BITS_PER_BLK(bs) - 1) / BITS_PER_BLK(bs);
+	sb->inode_region_sz = ninodes / ipb;
+	int meta_blks = sb->inode_map_sz + sb->block_map_sz + sb->inode_region_sz;
+	int root_blk = 1 + meta_blks;
+	sb->journal_start = root_blk + 1;
+	sb->journal_len = journal_blks(nblocks);
+	if (sb->journal_start + sb->journal_len >= (uint32_t) nblocks) {
+		return E_SIZE;
+	}
+
+	char *meta = calloc(meta_blks, bs);
+	if (meta == NULL) {
+		return E_UNAVAIL;
+	}
+	char *imap = meta;
+	char *bmap = imap + (size_t) sb->inode_map_sz * bs;
+	struct fs_inode *inodes = (struct fs_inode*) (bmap + (size_t) sb->block_map_sz * bs);
+	bitmap_set(imap, 0);
+	bitmap_set(imap, sb->root_inode);
+	for (int i = 0; i < (int) (sb->journal_start + sb->journal_len); i++) {
+		bitmap_set(bmap, i);
+	}
+	make_root(&inodes[sb->root_inode], root_blk);
+
+	int rv = write_super(dev, sb, bs);
+	if (rv < 0) {
+		free(meta);
+		return rv;
+	}
+	rv = write_meta(dev, 1, meta_blks, meta, root_blk, bs);
+	return (rv < 0) ? rv : journal_format(dev, sb->journal_start, sb->journal_len, bs);
+}
+
+/**
+ * Format in the block group layout. A last group too small for its
+ * own metadata and a data block is left off the file system, and a
+ * file system of one group gets inodes for the blocks it has.
+ */
+static int format_groups(struct blkdev *dev, int nblocks, struct fs_super *sb, int bs)
+{
+	int bpg = BITS_PER_BLK(bs);
+	int ipb = INODES_PER_BLK(bs);
+	int ipg = ((nblocks < bpg ? nblocks : bpg) / BLKS_PER_INODE + ipb - 1) / ipb * ipb;
+	int bmap_blks = bpg / BITS_PER_BLK(bs);
+	int meta_blks = bmap_blks + 1 + ipg / ipb;
+	int ngroups = (nblocks + bpg - 1) / bpg;
+	int last = nblocks - (ngroups - 1) * bpg - (ngroups == 1);
+	if (last <= meta_blks) {
+		if (ngroups == 1) {
+			return E_SIZE;
+		}
+		ngroups--;
+		nblocks = ngroups * bpg;
+	}
+	sb->journal_start = 1 + meta_blks + 1;
+	sb->journal_len = journal_blks(nblocks);
+	if (sb->journal_start + sb->journal_len >= (uint32_t) (nblocks < bpg ? nblocks : bpg)) {
+		return E_SIZE;
+	}
+	sb->num_blocks = nblocks;
+	sb->features |= FS_FEAT_GROUPS;
+	sb->blocks_per_group = bpg;
+	sb->inodes_per_group = ipg;
+	sb->num_groups = ngroups;
+	int rv = write_super(dev, sb, bs);
+	if (rv < 0) {
+		return rv;
+	}
+
+	for (int g = 0; g < ngroups; g++) {
+		int first = g * bpg;
+		int start = first + (g == 0);
+		int gblocks = (nblocks - first < bpg) ? nblocks - first : bpg;
+		char *meta = calloc(meta_blks, bs);
+		if (meta == NULL) {
+			return E_UNAVAIL;
+		}
+		char *bmap = meta;
+		char *imap = bmap + (size_t) bmap_blks * bs;
+		struct fs_inode *inodes = (struct fs_inode*) (imap + bs);
+
+		// the metadata of the group, and the bits past its end
+		for (int i = 0; i < start - first + meta_blks; i++) {
+			bitmap_set(bmap, i);
+		}
+		for (int i = gblocks; i < bpg; i++) {
+			bitmap_set(bmap, i);
+		}
+		for (int i = ipg; i < BITS_PER_BLK(bs); i++) {
+			bitmap_set(imap, i);
+		}
+
+		int root_blk = 0;
+		if (g == 0) {
+			root_blk = start + meta_blks;
+			for (int i = root_blk; i < (int) (sb->journal_start + sb->journal_len); i++) {
+				bitmap_set(bmap, i);
+			}
+			bitmap_set(imap, 0);
+			bitmap_set(imap, sb->root_inode);
+			make_root(&inodes[sb->root_inode], root_blk);
+		}
+		rv = write_meta(dev, start, meta_blks, meta, root_blk, bs);
+		if (rv < 0) {
+			return rv;
+		}
+	}
+	return journal_format(dev, sb->journal_start, sb->journal_len, bs);
+}
+
+/**
+ * Write an empty file system over the whole of a block device, or
+ * its first FS_MAX_BLOCKS blocks: a superblock, the maps, the inode
+ * table, a root directory and a metadata journal.
+ *
+ * @param dev: the block device
+ * @param groups: true for the block group layout, false for the
+ *   original one with the maps and inodes in one piece
+ * @param block_size: the block size, a power of two from
+ *   FS_BLOCK_SIZE to FS_MAX_BLOCK_SIZE
+ * @return: SUCCESS, E_SIZE if the device is too small or cannot use
+ *   the block size, or error from the device
+ */
+int fs_format(struct blkdev *dev, bool groups, int block_size)
+{
+	int log_block_size = 0;
+	while ((FS_BLOCK_SIZE << log_block_size) < block_size && log_block_size < FS_MAX_LOG_BLOCK_SIZE) {
+		log_block_size++;
+	}
+	if ((FS_BLOCK_SIZE << log_block_size) != block_size) {
+		return E_SIZE;
+	}
+	if (block_size != BLOCK_SIZE && (dev->ops->set_block_size == NULL ||
+			dev->ops->set_block_size(dev, block_size) < 0)) {
+		return E_SIZE;
+	}
+	int64_t dev_blocks = dev->ops->num_blocks(dev);
+	if (dev_blocks < 0) {
+		return dev_blocks;
+	}
+	int nblocks = (dev_blocks > FS_MAX_BLOCKS) ? FS_MAX_BLOCKS : dev_blocks;
+	struct fs_super sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = FS_MAGIC;
+	sb.num_blocks = nblocks;
+	sb.root_inode = 1;
+	sb.features = (groups || log_block_size != 0) ? FS_FEAT_SIZE64 : 0;
+	sb.log_block_size = log_block_size;
+	int rv = groups ? format_groups(dev, nblocks, &sb, block_size)
+			: format_flat(dev, nblocks, &sb, block_size);
+	if (rv < 0) {
+		return rv;
+	}
+	return dev->ops->flush(dev, 0, sb.num_blocks);
+}
+
+/**
+ * Read the superblock of a file system, switch the device to its
+ * block size, and replay its journal if the last transaction was not
+ * written home, so that the metadata can be changed in place.
+ *
+ * @param dev: the block device
+ * @param sb: the superblock
+ * @return: SUCCESS, E_SIZE if the device holds no file system or
+ *   cannot use its block size, or error from the device
+ */
+static int open_super(struct blkdev *dev, struct fs_super *sb)
+{
+	char block[BLOCK_SIZE];
+	int rv = dev->ops->read(dev, 0, 1, block);
+	if (rv < 0) {
+		return rv;
+	}
+	memcpy(sb, block, sizeof(*sb));
+	if (sb->magic != FS_MAGIC || sb->log_block_size > FS_MAX_LOG_BLOCK_SIZE) {
+		return E_SIZE;
+	}
+	int bs = FS_BLOCK_SIZE << sb->log_block_size;
+	if (bs != BLOCK_SIZE && (dev->ops->set_block_size == NULL ||
+			dev->ops->set_block_size(dev, bs) < 0)) {
+		return E_SIZE;
+	}
+	if (sb->journal_len != 0) {
+		if (journal_open(dev, sb->journal_start, sb->journal_len, bs) < 0) {
+			return E_UNAVAIL;
+		}
+		journal_close();
+	}
+	return SUCCESS;
+}
+
+/**
+ * Let the files of a file system made without FS_FEAT_SIZE64 grow
+ * past 2 GiB: copy old_size to size in every inode, and only once
+ * the inode tables are home set the feature flag. Older binaries
+ * read old_size, so they see wrong sizes for files past 2 GiB.
+ *
+ * @param dev: the block device
+ * @return: SUCCESS, E_SIZE if the device holds no file system or
+ *   cannot use its block size, or error from the device
+ */
+int fs_upgrade(struct blkdev *dev)
+{
+	struct fs_super sb;
+	int rv = open_super(dev, &sb);
+	if (rv < 0 || (sb.features & FS_FEAT_SIZE64)) {
+		return rv;
+	}
+	int bs = FS_BLOCK_SIZE << sb.log_block_size;
+	bool groups = (sb.features & FS_FEAT_GROUPS) != 0;
+	int ngroups = groups ? (int) sb.num_groups : 1;
+	int nblks = groups ? (int) sb.inodes_per_group / INODES_PER_BLK(bs) : (int) sb.inode_region_sz;
+	struct fs_inode *inodes = malloc((size_t) nblks * bs);
+	if (inodes == NULL) {
+		return E_UNAVAIL;
+	}
+	for (int g = 0; rv >= 0 && g < ngroups; g++) {
+		int first = groups ? g * sb.blocks_per_group + (g == 0) + sb.blocks_per_group / BITS_PER_BLK(bs) + 1
+				: 1 + sb.inode_map_sz + sb.block_map_sz;
+		rv = dev->ops->read(dev, first, nblks, inodes);
+		for (int i = 0; rv >= 0 && i < nblks * INODES_PER_BLK(bs); i++) {
+			inodes[i].size = inodes[i].old_size;
+		}
+		if (rv >= 0) {
+			rv = dev->ops->write(dev, first, nblks, inodes);
+		}
+	}
+	free(inodes);
+	if (rv >= 0) {
+		rv = dev->ops->flush(dev, 0, sb.num_blocks);
+	}
+	if (rv >= 0) {
+		sb.features |= FS_FEAT_SIZE64;
+		rv = write_super(dev, &sb, bs);
+	}
+	return (rv < 0) ? rv : dev->ops->flush(dev, 0, sb.num_blocks);
+}
+
+/**
+ * Add a metadata journal to a file system made without one, in the
+ * first free run of blocks long enough for it. The journal is
+ * formatted and its blocks marked in the block map before the
+ * superblock points at it.
+ *
+ * @param dev: the block device
+ * @return: SUCCESS, E_SIZE if the device holds no file system, cannot
+ *   use its block size or has no room for the journal, or error from
+ *   the device
+ */
+int fs_add_journal(struct blkdev *dev)
+{
+	struct fs_super sb;
+	int rv = open_super(dev, &sb);
+	if (rv < 0 || sb.journal_len != 0) {
+		return rv;
+	}
+	int bs = FS_BLOCK_SIZE << sb.log_block_size;
+	bool groups = (sb.features & FS_FEAT_GROUPS) != 0;
+	int ngroups = groups ? (int) sb.num_groups : 1;
+	int map_bits = groups ? (int) sb.blocks_per_group : (int) sb.num_blocks;
+	int map_blks = (map_bits + BITS_PER_BLK(bs) - 1) / BITS_PER_BLK(bs);
+	int len = journal_blks(sb.num_blocks);
+	char *bmap = malloc((size_t) map_blks * bs);
+	if (bmap == NULL) {
+		return E_UNAVAIL;
+	}
+
+	// each group's map covers its own blocks, from the group's start
+	int start = -1;
+	for (int g = 0; rv >= 0 && start < 0 && g < ngroups; g++) {
+		int first = groups ? g * (int) sb.blocks_per_group : 0;
+		int map = groups ? first + (g == 0) : 1 + (int) sb.inode_map_sz;
+		rv = dev->ops->read(dev, map, map_blks, bmap);
+		int run = (rv < 0) ? -1 : bitmap_find_zero_run(bmap, map_bits, 0, len);
+		if (run >= 0) {
+			for (int i = run; i < run + len; i++) {
+				bitmap_set(bmap, i);
+			}
+			start = first + run;
+			rv = journal_format(dev, start, len, bs);
+			if (rv >= 0) {
+				rv = dev->ops->write(dev, map, map_blks, bmap);
+			}
+		}
+	}
+	free(bmap);
+	if (rv >= 0 && start < 0) {
+		rv = E_SIZE;
+	}
+	if (rv >= 0) {
+		rv = dev->ops->flush(dev, 0, sb.num_blocks);
+	}
+	if (rv >= 0) {
+		sb.journal_start = start;
+		sb.journal_len = len;
+		rv = write_super(dev, &sb, bs);
+	}
+	return (rv < 0) ? rv : dev->ops->flush(dev, 0, sb.num_blocks);
+}
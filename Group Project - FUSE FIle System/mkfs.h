@@ -0,0 +1,50 @@
+/*
+ * file:        mkfs.h
+ * description: create an empty FSX492 file system on a block device
+ */
+
+#ifndef MKFS_H_
+#define MKFS_H_
+
+#include <stdbool.h>
+
+#include "blkdev.h"
+
+/**
+ * Write an empty file system over the whole of a block device, or
+ * its first FS_MAX_BLOCKS blocks: a superblock, the maps, the inode
+ * table, a root directory and a metadata journal.
+ *
+ * @param dev: the block device
+ * @param groups: true for the block group layout, false for the
+ *   original one with the maps and inodes in one piece
+ * @param block_size: the block size, a power of two from
+ *   FS_BLOCK_SIZE to FS_MAX_BLOCK_SIZE
+ * @return: SUCCESS, E_SIZE if the device is too small or cannot use
+ *   the block size, or error from the device
+ */
+extern int fs_format(struct blkdev *dev, bool groups, int block_size);
+
+/**
+ * Let the files of a file system made without FS_FEAT_SIZE64 grow
+ * past 2 GiB, by moving every file size to the 64-bit size field.
+ * Older binaries then see wrong sizes for files past 2 GiB.
+ *
+ * @param dev: the block device
+ * @return: SUCCESS, E_SIZE if the device holds no file system or
+ *   cannot use its block size, or error from the device
+ */
+extern int fs_upgrade(struct blkdev *dev);
+
+/**
+ * Add a metadata journal to a file system made without one. A file
+ * system that has a journal is left alone.
+ *
+ * @param dev: the block device
+ * @return: SUCCESS, E_SIZE if the device holds no file system, cannot
+ *   use its block size or has no room for the journal, or error from
+ *   the device
+ */
+extern int fs_add_journal(struct blkdev *dev);
+
+#endif /* MKFS_H_ */
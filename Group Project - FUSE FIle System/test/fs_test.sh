@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# file:        fs_test.sh
+# description: tests of fsx492 through -cmdline on images made with -mkfs
+#
+# Checks that a journal transaction committed but not written home
+# is replayed at mount, that directories of thousands of entries can
+# be listed, emptied and removed, and that the free block and inode
+# counts are the same after a remount, whatever the superblock says.
+#
+# usage: sh test/fs_test.sh [fsx492 binary]   (default ./fsx492)
+#
+
+FSX=${1:-./fsx492}
+BS=1024 # block size of the images, the -mkfs default
+NFILES=3000 # entries in the large directory
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# run commands, one per argument, on an image and print the output
+run() {
+	img=$1
+	shift
+	printf '%s\n' "$@" | "$FSX" -cmdline -image "$img" 2>/dev/null
+}
+
+mkfs() {
+	"$FSX" -image "$1" -mkfs "$2" >/dev/null 2>&1 || { echo "FAIL: mkfs $1"; exit 1; }
+}
+
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "ok: $1"
+	else
+		echo "FAIL: $1: got '$2', expected '$3'"
+		failed=1
+	fi
+}
+
+# a 32-bit field of the superblock, by byte offset
+super() {
+	od -An -tu4 -j"$2" -N4 "$1" | tr -d ' '
+}
+
+# the free block and inode counts that statfs reports
+counts() {
+	run "$1" statfs | awk '/^avail (blocks|inodes)/ { printf "%s ", $3 }'
+}
+
+# number of entries named f<number> in a directory listing
+nentries() {
+	run "$1" "ls $2" | grep -c '^f[0-9][0-9]*$'
+}
+
+# journal replay: the journal region of an image after a commit,
+# copied over the image from before it with the old header, is a
+# transaction committed but never written to its home blocks
+mkfs "$TMP/r0.img" 4000
+cp "$TMP/r0.img" "$TMP/r1.img"
+run "$TMP/r1.img" "mkdir replayed" "touch replayed/file" >/dev/null
+jstart=$(super "$TMP/r0.img" 36)
+jlen=$(super "$TMP/r0.img" 40)
+cp "$TMP/r0.img" "$TMP/r2.img"
+dd if="$TMP/r1.img" of="$TMP/r2.img" bs=$BS skip=$((jstart + 1)) seek=$((jstart + 1)) \
+		count=$((jlen - 1)) conv=notrunc 2>/dev/null
+check "journal at block $jstart" "$([ "$jstart" -gt 0 ] && echo yes)" yes
+check "no replay without the transaction" "$(run "$TMP/r0.img" ls | grep -c '^replayed$')" 0
+check "replay of a committed transaction" "$(run "$TMP/r2.img" "ls replayed" | grep -c '^file$')" 1
+check "free counts after replay" "$(counts "$TMP/r2.img")" "$(counts "$TMP/r1.img")"
+
+# a directory of thousands of entries, listed in a later mount, then
+# emptied and removed; the free counts come back to where they started
+mkfs "$TMP/d.img" 20000
+before=$(counts "$TMP/d.img")
+i=0
+{
+	echo "mkdir big"
+	echo "cd big"
+	while [ $i -lt $NFILES ]; do
+		echo "touch f$i"
+		i=$((i + 1))
+	done
+} | "$FSX" -cmdline -image "$TMP/d.img" >/dev/null 2>&1
+check "entries in a large directory" "$(nentries "$TMP/d.img" big)" $NFILES
+i=0
+{
+	echo "cd big"
+	while [ $i -lt $NFILES ]; do
+		if [ $((i % 2)) -eq 1 ]; then echo "rm f$i"; fi
+		i=$((i + 1))
+	done
+} | "$FSX" -cmdline -image "$TMP/d.img" >/dev/null 2>&1
+check "entries after removing half" "$(nentries "$TMP/d.img" big)" $((NFILES / 2))
+check "rmdir of a directory in use" "$(run "$TMP/d.img" "rmdir big" | grep -c '^error: Directory not empty$')" 1
+i=0
+{
+	echo "cd big"
+	while [ $i -lt $NFILES ]; do
+		if [ $((i % 2)) -eq 0 ]; then echo "rm f$i"; fi
+		i=$((i + 1))
+	done
+	echo "cd /"
+	echo "rmdir big"
+} | "$FSX" -cmdline -image "$TMP/d.img" >/dev/null 2>&1
+check "large directory removed" "$(run "$TMP/d.img" ls | grep -c '^big$')" 0
+check "free counts after removing it" "$(counts "$TMP/d.img")" "$before"
+
+# free counts across a remount, counted from the maps rather than
+# taken from the superblock
+mkfs "$TMP/c.img" 4000
+head -c 300000 /dev/urandom > "$TMP/data"
+during=$(run "$TMP/c.img" "put $TMP/data data" "mkdir dir" statfs |
+		awk '/^avail (blocks|inodes)/ { printf "%s ", $3 }')
+check "free counts after a remount" "$(counts "$TMP/c.img")" "$during"
+printf '\001\000\000\000\001\000\000\000' |
+		dd of="$TMP/c.img" bs=1 seek=24 conv=notrunc 2>/dev/null
+check "free counts with stale superblock counts" "$(counts "$TMP/c.img")" "$during"
+run "$TMP/c.img" "get data $TMP/data.out" >/dev/null
+check "file data after a remount" "$(cmp -s "$TMP/data" "$TMP/data.out" && echo same)" same
+
+if [ $failed -ne 0 ]; then
+	echo "FAILED"
+	exit 1
+fi
+echo "all tests passed"
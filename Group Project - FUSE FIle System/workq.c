@@ -0,0 +1,137 @@
+/*
+ * file:        workq.c
+ * description: a pool of threads running queued jobs
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "workq.h"
+#include "lockstat.h"
+
+/** a queued job */
+struct job {
+	void (*fn)(void*); /* the function to run */
+	void *arg; /* argument for fn */
+	struct job *next; /* next job in the queue */
+};
+
+struct workq {
+	pthread_mutex_t lock; /* the queue and stop */
+	pthread_cond_t ready; /* signalled when a job is queued or stop is set */
+	struct job *head, *tail; /* the queue, oldest first */
+	bool stop; /* threads exit once the queue is empty */
+	int nthreads; /* number of threads started */
+	pthread_t *threads;
+};
+
+/** contention statistics of the queue locks, for lock_report */
+static struct lock_stats workq_lock_stats = { .name = "work queue" };
+
+/**
+ * Body of a pool thread: run jobs until the pool is stopped and the
+ * queue is empty.
+ *
+ * @param arg: the pool
+ * @return: NULL
+ */
+static void *workq_thread(void *arg)
+{
+	struct workq *wq = arg;
+	lock_mutex(&wq->lock, &workq_lock_stats);
+	for (;;) {
+		while (wq->head == NULL && !wq->stop) {
+			pthread_cond_wait(&wq->ready, &wq->lock);
+		}
+		struct job *job = wq->head;
+		if (job == NULL) break;
+		wq->head = job->next;
+		if (wq->head == NULL) wq->tail = NULL;
+		pthread_mutex_unlock(&wq->lock);
+
+		job->fn(job->arg);
+		free(job);
+
+		lock_mutex(&wq->lock, &workq_lock_stats);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+/**
+ * Create a pool of threads.
+ *
+ * @param nthreads: the number of threads
+ * @return: the pool, or NULL if it cannot be created
+ */
+struct workq *workq_create(int nthreads)
+{
+	struct workq *wq = calloc(1, sizeof(struct workq));
+	if (wq == NULL) return NULL;
+	wq->threads = calloc(nthreads, sizeof(pthread_t));
+	if (wq->threads == NULL) {
+		free(wq);
+		return NULL;
+	}
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->ready, NULL);
+	lock_stats_register(&workq_lock_stats);
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&wq->threads[i], NULL, workq_thread, wq) != 0) break;
+		wq->nthreads++;
+	}
+	if (wq->nthreads == 0) {
+		workq_destroy(wq);
+		return NULL;
+	}
+	return wq;
+}
+
+/**
+ * Queue a job.
+ *
+ * @param wq: the pool
+ * @param fn: the function to run
+ * @param arg: argument for fn
+ * @return: 0 if queued, or -ENOMEM
+ */
+int workq_add(struct workq *wq, void (*fn)(void*), void *arg)
+{
+	struct job *job = malloc(sizeof(struct job));
+	if (job == NULL) return -ENOMEM;
+	job->fn = fn;
+	job->arg = arg;
+	job->next = NULL;
+	lock_mutex(&wq->lock, &workq_lock_stats);
+	if (wq->tail != NULL) {
+		wq->tail->next = job;
+	} else {
+		wq->head = job;
+	}
+	wq->tail = job;
+	pthread_cond_signal(&wq->ready);
+	pthread_mutex_unlock(&wq->lock);
+	return 0;
+}
+
+/**
+ * Run the jobs still queued, then stop the threads and free the pool.
+ *
+ * @param wq: the pool
+ */
+void workq_destroy(struct workq *wq)
+{
+	lock_mutex(&wq->lock, &workq_lock_stats);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->ready);
+	pthread_mutex_unlock(&wq->lock);
+	for (int i = 0; i < wq->nthreads; i++) {
+		pthread_join(wq->threads[i], NULL);
+	}
+	pthread_cond_destroy(&wq->ready);
+	pthread_mutex_destroy(&wq->lock);
+	free(wq->threads);
+	free(wq);
+}
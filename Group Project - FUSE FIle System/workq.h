@@ -0,0 +1,40 @@
+/*
+ * file:        workq.h
+ * description: a pool of threads running queued jobs
+ *
+ * Jobs run in the order they were queued, each on whichever pool
+ * thread is free first. A job that finds the pool busy waits in the
+ * queue; the thread that queued it carries on at once.
+ */
+
+#ifndef WORKQ_H_
+#define WORKQ_H_
+
+struct workq;
+
+/**
+ * Create a pool of threads.
+ *
+ * @param nthreads: the number of threads
+ * @return: the pool, or NULL if it cannot be created
+ */
+extern struct workq *workq_create(int nthreads);
+
+/**
+ * Queue a job.
+ *
+ * @param wq: the pool
+ * @param fn: the function to run
+ * @param arg: argument for fn
+ * @return: 0 if queued, or -ENOMEM
+ */
+extern int workq_add(struct workq *wq, void (*fn)(void*), void *arg);
+
+/**
+ * Run the jobs still queued, then stop the threads and free the pool.
+ *
+ * @param wq: the pool
+ */
+extern void workq_destroy(struct workq *wq);
+
+#endif /* WORKQ_H_ */